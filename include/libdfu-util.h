@@ -7,6 +7,14 @@ void libdfu_set_download(const char *filename);
 void libdfu_set_altsetting(int alt);
 void libdfu_set_vendprod(int vendor, int product);
 void libdfu_set_dfuse_options(const char *dfuse_opts);
+void libdfu_set_simulate(const char *alt_name);
+void libdfu_set_adaptive_poll(int enable);
+void libdfu_set_profile_cache(const char *path);
+void libdfu_set_flash_ledger(const char *path);
+void libdfu_set_stream(int enable);
+void libdfu_set_targets(const char *list);
+void libdfu_set_jobs(int max_jobs);
+void libdfu_set_simulate_devices(int num_devices);
 int libdfu_execute();
 void libdfu_set_stderr_callback(void (*callback)(const char *));
 void libdfu_set_stdout_callback(void (*callback)(const char *));
@@ -27,66 +27,271 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libusb.h>
 
 #include "portable.h"
 #include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_poll.h"
+#include "dfu_session.h"
 #include "quirks.h"
 
-static int dfu_timeout = 5000;  /* 5 seconds - default */
+static int libusb_transport_open(struct dfu_if *dif)
+{
+    int ret;
+
+    ret = libusb_open(dif->dev, &dif->dev_handle);
+    if (ret == 0 && !dif->dev_handle)
+        ret = LIBUSB_ERROR_OTHER;
+    return ret;
+}
+
+static void libusb_transport_close(struct dfu_if *dif)
+{
+    libusb_close(dif->dev_handle);
+}
+
+static int libusb_transport_claim_interface(struct dfu_if *dif)
+{
+    return libusb_claim_interface(dif->dev_handle, dif->interface);
+}
+
+static int libusb_transport_release_interface(struct dfu_if *dif)
+{
+    return libusb_release_interface(dif->dev_handle, dif->interface);
+}
+
+static int libusb_transport_set_alt_setting(struct dfu_if *dif, int altsetting)
+{
+    return libusb_set_interface_alt_setting(dif->dev_handle, dif->interface,
+                                            altsetting);
+}
+
+static int libusb_transport_reset_device(struct dfu_if *dif)
+{
+    return libusb_reset_device(dif->dev_handle);
+}
+
+static int libusb_transport_control_transfer(struct dfu_if *dif,
+    uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+    unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+    return libusb_control_transfer(dif->dev_handle, bmRequestType, bRequest,
+                                   wValue, dif->interface, data, wLength,
+                                   timeout);
+}
+
+static void LIBUSB_CALL libusb_transport_callback(struct libusb_transfer *transfer)
+{
+    struct dfu_transfer *xfer = transfer->user_data;
+
+    switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        xfer->result = transfer->actual_length;
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        xfer->result = LIBUSB_ERROR_TIMEOUT;
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        xfer->result = LIBUSB_ERROR_PIPE;
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        xfer->result = LIBUSB_ERROR_NO_DEVICE;
+        break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        xfer->result = LIBUSB_ERROR_OVERFLOW;
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        xfer->result = LIBUSB_ERROR_INTERRUPTED;
+        break;
+    default:
+        xfer->result = LIBUSB_ERROR_IO;
+        break;
+    }
+    xfer->callback(xfer);
+}
+
+static int libusb_transport_submit_transfer(struct dfu_transfer *xfer)
+{
+    struct libusb_transfer *transfer = xfer->transport_priv;
+
+    if (!transfer) {
+        transfer = libusb_alloc_transfer(0);
+        if (!transfer)
+            return LIBUSB_ERROR_NO_MEM;
+        xfer->transport_priv = transfer;
+    }
+    libusb_fill_control_transfer(transfer, xfer->dif->dev_handle,
+                                 xfer->buffer, libusb_transport_callback,
+                                 xfer, xfer->timeout);
+    return libusb_submit_transfer(transfer);
+}
+
+static void libusb_transport_free_transfer(struct dfu_transfer *xfer)
+{
+    libusb_free_transfer(xfer->transport_priv);
+}
+
+static int libusb_transport_handle_events(struct dfu_if *dif,
+                                          unsigned int timeout_ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    return libusb_handle_events_timeout(dif->transport_data, &tv);
+}
+
+/* transport_data is the libusb context the device was found in */
+const struct dfu_transport dfu_libusb_transport = {
+    libusb_transport_open,
+    libusb_transport_close,
+    libusb_transport_claim_interface,
+    libusb_transport_release_interface,
+    libusb_transport_set_alt_setting,
+    libusb_transport_reset_device,
+    libusb_transport_control_transfer,
+    libusb_transport_submit_transfer,
+    libusb_transport_free_transfer,
+    libusb_transport_handle_events
+};
+
+int dfu_open( struct dfu_if *dif )
+{
+    return dif->transport->open(dif);
+}
+
+void dfu_close( struct dfu_if *dif )
+{
+    dif->transport->close(dif);
+    dif->dev_handle = NULL;
+}
+
+int dfu_claim_interface( struct dfu_if *dif )
+{
+    return dif->transport->claim_interface(dif);
+}
+
+int dfu_release_interface( struct dfu_if *dif )
+{
+    return dif->transport->release_interface(dif);
+}
+
+int dfu_set_alt_setting( struct dfu_if *dif, int altsetting )
+{
+    return dif->transport->set_alt_setting(dif, altsetting);
+}
+
+int dfu_reset_device( struct dfu_if *dif )
+{
+    return dif->transport->reset_device(dif);
+}
+
+int dfu_async_supported( struct dfu_if *dif )
+{
+    return dif->transport->submit_transfer != NULL;
+}
+
+struct dfu_transfer *dfu_alloc_transfer( struct dfu_if *dif, int max_length )
+{
+    struct dfu_transfer *xfer;
+
+    xfer = dfu_malloc(sizeof(*xfer));
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->dif = dif;
+    xfer->buffer = dfu_malloc(LIBUSB_CONTROL_SETUP_SIZE + max_length);
+    xfer->max_length = max_length;
+    xfer->timeout = dif->session->timeout;
+    return xfer;
+}
+
+void dfu_free_transfer( struct dfu_transfer *xfer )
+{
+    if (!xfer)
+        return;
+    if (xfer->transport_priv)
+        xfer->dif->transport->free_transfer(xfer);
+    free(xfer->buffer);
+    free(xfer);
+}
+
+/*
+ *  Builds the setup packet of a DFU class request into the transfer buffer,
+ *  followed by the payload for OUT requests. Doing this ahead of time lets
+ *  the transfer be submitted as soon as the device is ready for it.
+ */
+void dfu_fill_transfer( struct dfu_transfer *xfer,
+                        uint8_t bmRequestType,
+                        uint8_t bRequest,
+                        uint16_t wValue,
+                        const unsigned char *data,
+                        uint16_t wLength )
+{
+    if (wLength > xfer->max_length)
+        errx(EX_SOFTWARE, "Transfer of %u bytes exceeds buffer", wLength);
+    libusb_fill_control_setup(xfer->buffer, bmRequestType, bRequest, wValue,
+                              xfer->dif->interface, wLength);
+    if (!(bmRequestType & LIBUSB_ENDPOINT_IN) && wLength)
+        memcpy(xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+}
+
+int dfu_submit_transfer( struct dfu_transfer *xfer )
+{
+    return xfer->dif->transport->submit_transfer(xfer);
+}
+
+int dfu_handle_events( struct dfu_if *dif, unsigned int timeout_ms )
+{
+    return dif->transport->handle_events(dif, timeout_ms);
+}
 
 /*
  *  DFU_DETACH Request (DFU Spec 1.0, Section 5.1)
  *
- *  device    - the usb_dev_handle to communicate with
- *  interface - the interface to communicate with
+ *  dif       - the DFU interface to communicate with
  *  timeout   - the timeout in ms the USB device should wait for a pending
  *              USB reset before giving up and terminating the operation
  *
  *  returns 0 or < 0 on error
  */
-int dfu_detach( libusb_device_handle *device,
-                const unsigned short interface,
+int dfu_detach( struct dfu_if *dif,
                 const unsigned short timeout )
 {
-    return libusb_control_transfer( device,
+    return dif->transport->control_transfer( dif,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_DETACH,
         /* wValue        */ timeout,
-        /* wIndex        */ interface,
         /* Data          */ NULL,
         /* wLength       */ 0,
-                            dfu_timeout );
+                            dif->session->timeout );
 }
 
 
 /*
  *  DFU_DNLOAD Request (DFU Spec 1.0, Section 6.1.1)
  *
- *  device    - the usb_dev_handle to communicate with
- *  interface - the interface to communicate with
+ *  dif       - the DFU interface to communicate with
  *  length    - the total number of bytes to transfer to the USB
  *              device - must be less than wTransferSize
  *  data      - the data to transfer
  *
  *  returns the number of bytes written or < 0 on error
  */
-int dfu_download( libusb_device_handle *device,
-                  const unsigned short interface,
+int dfu_download( struct dfu_if *dif,
                   const unsigned short length,
                   const unsigned short transaction,
                   unsigned char* data )
 {
     int status;
 
-    status = libusb_control_transfer( device,
+    status = dif->transport->control_transfer( dif,
           /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_DNLOAD,
           /* wValue        */ transaction,
-          /* wIndex        */ interface,
           /* Data          */ data,
           /* wLength       */ length,
-                              dfu_timeout );
+                              dif->session->timeout );
     return status;
 }
 
@@ -94,39 +299,51 @@ int dfu_download( libusb_device_handle *device,
 /*
  *  DFU_UPLOAD Request (DFU Spec 1.0, Section 6.2)
  *
- *  device    - the usb_dev_handle to communicate with
- *  interface - the interface to communicate with
+ *  dif       - the DFU interface to communicate with
  *  length    - the maximum number of bytes to receive from the USB
  *              device - must be less than wTransferSize
  *  data      - the buffer to put the received data in
  *
  *  returns the number of bytes received or < 0 on error
  */
-int dfu_upload( libusb_device_handle *device,
-                const unsigned short interface,
+int dfu_upload( struct dfu_if *dif,
                 const unsigned short length,
                 const unsigned short transaction,
                 unsigned char* data )
 {
     int status;
 
-    status = libusb_control_transfer( device,
+    status = dif->transport->control_transfer( dif,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_UPLOAD,
           /* wValue        */ transaction,
-          /* wIndex        */ interface,
           /* Data          */ data,
           /* wLength       */ length,
-                              dfu_timeout );
+                              dif->session->timeout );
     return status;
 }
 
 
+/* fills in status from the 6 bytes of a GETSTATUS reply */
+static void dfu_parse_status( struct dfu_if *dif,
+                              const unsigned char *buffer,
+                              struct dfu_status *status )
+{
+    status->bStatus = buffer[0];
+    if (dif->quirks & QUIRK_POLLTIMEOUT)
+        status->bwPollTimeout = DEFAULT_POLLTIMEOUT;
+    else
+        status->bwPollTimeout = ((0xff & buffer[3]) << 16) |
+                                ((0xff & buffer[2]) << 8)  |
+                                (0xff & buffer[1]);
+    status->bState  = buffer[4];
+    status->iString = buffer[5];
+}
+
 /*
  *  DFU_GETSTATUS Request (DFU Spec 1.0, Section 6.1.2)
  *
- *  device    - the usb_dev_handle to communicate with
- *  interface - the interface to communicate with
+ *  dif       - the DFU interface to communicate with
  *  status    - the data structure to be populated with the results
  *
  *  return the number of bytes read in or < 0 on an error
@@ -142,78 +359,98 @@ int dfu_get_status( struct dfu_if *dif, struct dfu_status *status )
     status->bState        = STATE_DFU_ERROR;
     status->iString       = 0;
 
-    result = libusb_control_transfer( dif->dev_handle,
+    result = dif->transport->control_transfer( dif,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATUS,
           /* wValue        */ 0,
-          /* wIndex        */ dif->interface,
           /* Data          */ buffer,
           /* wLength       */ 6,
-                              dfu_timeout );
-
-    if( 6 == result ) {
-        status->bStatus = buffer[0];
-        if (dif->quirks & QUIRK_POLLTIMEOUT)
-            status->bwPollTimeout = DEFAULT_POLLTIMEOUT;
-        else
-            status->bwPollTimeout = ((0xff & buffer[3]) << 16) |
-                                    ((0xff & buffer[2]) << 8)  |
-                                    (0xff & buffer[1]);
-        status->bState  = buffer[4];
-        status->iString = buffer[5];
-    }
+                              dif->session->timeout );
+
+    if( 6 == result )
+        dfu_parse_status( dif, buffer, status );
 
     return result;
 }
 
+/* Asynchronous counterparts of dfu_download() and dfu_get_status() */
+void dfu_fill_download( struct dfu_transfer *xfer,
+                        const unsigned short length,
+                        const unsigned short transaction,
+                        const unsigned char *data )
+{
+    dfu_fill_transfer( xfer,
+        /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+        /* bRequest      */ DFU_DNLOAD,
+        /* wValue        */ transaction,
+        /* Data          */ data,
+        /* wLength       */ length );
+}
+
+void dfu_fill_get_status( struct dfu_transfer *xfer )
+{
+    dfu_fill_transfer( xfer,
+        /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+        /* bRequest      */ DFU_GETSTATUS,
+        /* wValue        */ 0,
+        /* Data          */ NULL,
+        /* wLength       */ 6 );
+}
+
+/* returns the status of a completed GETSTATUS transfer, like dfu_get_status */
+int dfu_transfer_status( struct dfu_transfer *xfer, struct dfu_status *status )
+{
+    status->bStatus       = DFU_STATUS_ERROR_UNKNOWN;
+    status->bwPollTimeout = 0;
+    status->bState        = STATE_DFU_ERROR;
+    status->iString       = 0;
+
+    if( 6 == xfer->result )
+        dfu_parse_status( xfer->dif, xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+                          status );
+
+    return xfer->result;
+}
+
 
 /*
  *  DFU_CLRSTATUS Request (DFU Spec 1.0, Section 6.1.3)
  *
- *  device    - the usb_dev_handle to communicate with
- *  interface - the interface to communicate with
+ *  dif       - the DFU interface to communicate with
  *
  *  return 0 or < 0 on an error
  */
-int dfu_clear_status( libusb_device_handle *device,
-                      const unsigned short interface )
+int dfu_clear_status( struct dfu_if *dif )
 {
-    return libusb_control_transfer( device,
+    return dif->transport->control_transfer( dif,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_CLRSTATUS,
         /* wValue        */ 0,
-        /* wIndex        */ interface,
         /* Data          */ NULL,
         /* wLength       */ 0,
-                            dfu_timeout );
+                            dif->session->timeout );
 }
 
 
 /*
  *  DFU_GETSTATE Request (DFU Spec 1.0, Section 6.1.5)
  *
- *  device    - the usb_dev_handle to communicate with
- *  interface - the interface to communicate with
- *  length    - the maximum number of bytes to receive from the USB
- *              device - must be less than wTransferSize
- *  data      - the buffer to put the received data in
+ *  dif       - the DFU interface to communicate with
  *
  *  returns the state or < 0 on error
  */
-int dfu_get_state( libusb_device_handle *device,
-                   const unsigned short interface )
+int dfu_get_state( struct dfu_if *dif )
 {
     int result;
     unsigned char buffer[1];
 
-    result = libusb_control_transfer( device,
+    result = dif->transport->control_transfer( dif,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATE,
           /* wValue        */ 0,
-          /* wIndex        */ interface,
           /* Data          */ buffer,
           /* wLength       */ 1,
-                              dfu_timeout );
+                              dif->session->timeout );
 
     /* Return the error if there is one. */
     if (result < 1)
@@ -227,22 +464,19 @@ int dfu_get_state( libusb_device_handle *device,
 /*
  *  DFU_ABORT Request (DFU Spec 1.0, Section 6.1.4)
  *
- *  device    - the usb_dev_handle to communicate with
- *  interface - the interface to communicate with
+ *  dif       - the DFU interface to communicate with
  *
  *  returns 0 or < 0 on an error
  */
-int dfu_abort( libusb_device_handle *device,
-               const unsigned short interface )
+int dfu_abort( struct dfu_if *dif )
 {
-    return libusb_control_transfer( device,
+    return dif->transport->control_transfer( dif,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_ABORT,
         /* wValue        */ 0,
-        /* wIndex        */ interface,
         /* Data          */ NULL,
         /* wLength       */ 0,
-                            dfu_timeout );
+                            dif->session->timeout );
 }
 
 
@@ -341,20 +575,20 @@ int dfu_abort_to_idle(struct dfu_if *dif)
 	int ret;
 	struct dfu_status dst;
 
-	ret = dfu_abort(dif->dev_handle, dif->interface);
+	ret = dfu_abort(dif);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error sending dfu abort request");
-		exit(1);
+		warnx("Error sending dfu abort request");
+		return ret;
 	}
 	ret = dfu_get_status(dif, &dst);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error during abort get_status");
-		exit(1);
+		warnx("Error during abort get_status");
+		return ret;
 	}
 	if (dst.bState != DFU_STATE_dfuIDLE) {
-		errx(EX_IOERR, "Failed to enter idle state on abort");
-		exit(1);
+		warnx("Failed to enter idle state on abort");
+		return -1;
 	}
-	milli_sleep(dst.bwPollTimeout);
+	dfu_poll_wait(dif, dst.bwPollTimeout);
 	return ret;
 }
@@ -85,6 +85,45 @@ struct dfu_status {
     unsigned char iString;
 };
 
+struct dfu_if;
+struct dfu_session;
+
+/* Asynchronous control transfer on a DFU interface. As with libusb, the
+ * buffer holds the setup packet followed by up to max_length data bytes.
+ * The callback is run from dfu_handle_events() once the transfer is done,
+ * with result set to the number of data bytes or a LIBUSB_ERROR code. */
+struct dfu_transfer {
+    struct dfu_if *dif;
+    unsigned char *buffer;
+    int max_length;
+    unsigned int timeout;
+    int result;
+    void (*callback)(struct dfu_transfer *xfer);
+    void *user_data;
+    void *transport_priv;
+};
+
+/* Backend carrying the DFU requests of an interface, normally libusb.
+ * wIndex of all class requests is the interface number of the dfu_if. */
+struct dfu_transport {
+    int (*open)(struct dfu_if *dif);
+    void (*close)(struct dfu_if *dif);
+    int (*claim_interface)(struct dfu_if *dif);
+    int (*release_interface)(struct dfu_if *dif);
+    int (*set_alt_setting)(struct dfu_if *dif, int altsetting);
+    int (*reset_device)(struct dfu_if *dif);
+    int (*control_transfer)(struct dfu_if *dif, uint8_t bmRequestType,
+                            uint8_t bRequest, uint16_t wValue,
+                            unsigned char *data, uint16_t wLength,
+                            unsigned int timeout);
+    /* asynchronous transfers, NULL if the backend does not support them */
+    int (*submit_transfer)(struct dfu_transfer *xfer);
+    void (*free_transfer)(struct dfu_transfer *xfer);
+    int (*handle_events)(struct dfu_if *dif, unsigned int timeout_ms);
+};
+
+extern const struct dfu_transport dfu_libusb_transport;
+
 struct dfu_if {
     struct usb_dfu_func_descriptor func_dfu;
     uint16_t quirks;
@@ -102,31 +141,54 @@ struct dfu_if {
     char *serial_name;
     libusb_device *dev;
     libusb_device_handle *dev_handle;
+    const struct dfu_transport *transport;
+    void *transport_data;
+    struct dfu_session *session;
     struct dfu_if *next;
-    struct memsegment *mem_layout; /* for DfuSe */
+    struct memlayout *mem_layout; /* for DfuSe */
 };
 
-int dfu_detach( libusb_device_handle *device,
-                const unsigned short interface,
+int dfu_open( struct dfu_if *dif );
+void dfu_close( struct dfu_if *dif );
+int dfu_claim_interface( struct dfu_if *dif );
+int dfu_release_interface( struct dfu_if *dif );
+int dfu_set_alt_setting( struct dfu_if *dif, int altsetting );
+int dfu_reset_device( struct dfu_if *dif );
+
+int dfu_async_supported( struct dfu_if *dif );
+struct dfu_transfer *dfu_alloc_transfer( struct dfu_if *dif, int max_length );
+void dfu_free_transfer( struct dfu_transfer *xfer );
+void dfu_fill_transfer( struct dfu_transfer *xfer,
+                        uint8_t bmRequestType,
+                        uint8_t bRequest,
+                        uint16_t wValue,
+                        const unsigned char *data,
+                        uint16_t wLength );
+void dfu_fill_download( struct dfu_transfer *xfer,
+                        const unsigned short length,
+                        const unsigned short transaction,
+                        const unsigned char *data );
+void dfu_fill_get_status( struct dfu_transfer *xfer );
+int dfu_transfer_status( struct dfu_transfer *xfer,
+                         struct dfu_status *status );
+int dfu_submit_transfer( struct dfu_transfer *xfer );
+int dfu_handle_events( struct dfu_if *dif, unsigned int timeout_ms );
+
+int dfu_detach( struct dfu_if *dif,
                 const unsigned short timeout );
-int dfu_download( libusb_device_handle *device,
-                  const unsigned short interface,
+int dfu_download( struct dfu_if *dif,
                   const unsigned short length,
                   const unsigned short transaction,
                   unsigned char* data );
-int dfu_upload( libusb_device_handle *device,
-                const unsigned short interface,
+int dfu_upload( struct dfu_if *dif,
                 const unsigned short length,
                 const unsigned short transaction,
                 unsigned char* data );
 int dfu_get_status( struct dfu_if *dif,
                     struct dfu_status *status );
-int dfu_clear_status( libusb_device_handle *device,
-                      const unsigned short interface );
-int dfu_get_state( libusb_device_handle *device,
-                   const unsigned short interface );
-int dfu_abort( libusb_device_handle *device,
-               const unsigned short interface );
+int dfu_clear_status( struct dfu_if *dif );
+int dfu_get_state( struct dfu_if *dif );
+int dfu_abort( struct dfu_if *dif );
 int dfu_abort_to_idle( struct dfu_if *dif);
 
 const char *dfu_state_to_string( int state );
@@ -0,0 +1,257 @@
+/*
+ * Pipelined DFU download on asynchronous control transfers
+ *
+ * Each block is sent as DNLOAD followed by GETSTATUS until the device is
+ * back in dfuDNLOAD_IDLE. Instead of issuing these as blocking requests,
+ * the DNLOAD for the next block (setup packet and payload) is built while
+ * the current one is being processed, and it is submitted straight from
+ * the completion callback of the GETSTATUS request that reports the
+ * device ready. This removes the host side turnaround between blocks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define __USE_MINGW_ANSI_STDIO 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_async.h"
+#include "dfu_poll.h"
+#include "dfu_session.h"
+
+enum async_error { ASYNC_OK, ASYNC_DNLOAD, ASYNC_GET_STATUS, ASYNC_STATUS };
+
+struct async_dnload {
+	struct dfu_transfer *dnload;
+	struct dfu_transfer *status;
+	const unsigned char *data;
+	off_t size;
+	off_t sent;		/* bytes accepted by the device */
+	int xfer_size;
+	int chunk_size;		/* size of the block built into dnload */
+	unsigned short transaction;
+	struct dfu_status dst;
+	struct dfu_poll_entry poll;
+	struct dfu_poll_busy busy;
+	int poll_pending;	/* device busy, GETSTATUS after bwPollTimeout */
+	int done;
+	enum async_error error;
+	int ret;
+};
+
+static void async_fail(struct async_dnload *p, enum async_error error,
+		       int ret)
+{
+	p->error = error;
+	p->ret = ret;
+	p->done = 1;
+}
+
+/* Build the DNLOAD request for the next block */
+static void async_prepare_dnload(struct async_dnload *p)
+{
+	off_t bytes_left = p->size - p->sent;
+
+	if (bytes_left < p->xfer_size)
+		p->chunk_size = (int) bytes_left;
+	else
+		p->chunk_size = p->xfer_size;
+	dfu_fill_download(p->dnload, p->chunk_size, p->transaction,
+			  p->data + p->sent);
+}
+
+static void async_submit_dnload(struct async_dnload *p)
+{
+	int ret;
+
+	ret = dfu_submit_transfer(p->dnload);
+	if (ret < 0) {
+		async_fail(p, ASYNC_DNLOAD, ret);
+		return;
+	}
+	p->transaction++;
+}
+
+static void async_submit_status(struct async_dnload *p)
+{
+	int ret;
+
+	ret = dfu_submit_transfer(p->status);
+	if (ret < 0)
+		async_fail(p, ASYNC_GET_STATUS, ret);
+}
+
+static void async_dnload_done(struct dfu_transfer *xfer)
+{
+	struct async_dnload *p = xfer->user_data;
+
+	if (xfer->result < 0) {
+		async_fail(p, ASYNC_DNLOAD, xfer->result);
+		return;
+	}
+	p->sent += p->chunk_size;
+	async_submit_status(p);
+
+	/* the DNLOAD buffer is free again, get the next block ready
+	 * while the device is busy with this one */
+	if (!p->done && p->sent < p->size)
+		async_prepare_dnload(p);
+}
+
+static void async_status_done(struct dfu_transfer *xfer)
+{
+	struct async_dnload *p = xfer->user_data;
+	int ret;
+	unsigned int wait;
+
+	ret = dfu_transfer_status(xfer, &p->dst);
+	if (ret == LIBUSB_ERROR_PIPE && dfu_poll_busy_early(&p->busy)) {
+		/* polled ahead of the reported timeout */
+		p->dst.bState = DFU_STATE_dfuDNBUSY;
+		dfu_poll_busy_stall(&p->busy);
+	} else if (ret < 0) {
+		async_fail(p, ASYNC_GET_STATUS, ret);
+		return;
+	}
+
+	if (p->dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
+	    p->dst.bState == DFU_STATE_dfuERROR) {
+		dfu_poll_busy_done(&p->busy);
+		dfu_poll_busy_init(&p->busy, xfer->dif->session,
+				   DFU_POLL_DNLOAD);
+		if (p->dst.bStatus != DFU_STATUS_OK)
+			async_fail(p, ASYNC_STATUS, -1);
+		else if (p->sent >= p->size)
+			p->done = 1;
+		else
+			async_submit_dnload(p);
+		return;
+	}
+
+	wait = dfu_poll_busy_next(&p->busy, p->dst.bwPollTimeout);
+	if (wait == 0) {
+		async_submit_status(p);
+	} else {
+		/* Wait while device executes flashing */
+		if (verbose > 1)
+			_FPRINTF(stderr, "Poll timeout %i ms\n", wait);
+		p->poll_pending = 1;
+		dfu_poll_schedule(&xfer->dif->session->poller, &p->poll,
+				  xfer->dif, wait);
+	}
+}
+
+static void async_poll_done(struct dfu_poll_entry *entry)
+{
+	struct async_dnload *p = entry->user_data;
+
+	p->poll_pending = 0;
+	async_submit_status(p);
+}
+
+/*
+ * Download size bytes from data in blocks of xfer_size, starting with
+ * block number *transaction which is updated on return. The device must
+ * be in dfuIDLE or dfuDNLOAD_IDLE state. The final zero length DNLOAD is
+ * left to the caller.
+ *
+ * returns 0 or < 0 on error
+ */
+int dfu_async_dnload(struct dfu_if *dif, int xfer_size,
+		     const unsigned char *data, off_t size,
+		     unsigned short *transaction)
+{
+	struct async_dnload p;
+	off_t reported = 0;
+	int ret;
+
+	memset(&p, 0, sizeof(p));
+	p.data = data;
+	p.size = size;
+	p.xfer_size = xfer_size;
+	p.transaction = *transaction;
+
+	p.dnload = dfu_alloc_transfer(dif, xfer_size);
+	p.dnload->callback = async_dnload_done;
+	p.dnload->user_data = &p;
+
+	/* the GETSTATUS request never changes, build it once */
+	p.status = dfu_alloc_transfer(dif, 6);
+	p.status->callback = async_status_done;
+	p.status->user_data = &p;
+	dfu_fill_get_status(p.status);
+
+	p.poll.callback = async_poll_done;
+	p.poll.user_data = &p;
+	dfu_poll_busy_init(&p.busy, dif->session, DFU_POLL_DNLOAD);
+
+	if (size > 0) {
+		async_prepare_dnload(&p);
+		async_submit_dnload(&p);
+	} else {
+		p.done = 1;
+	}
+
+	while (!p.done) {
+		if (p.poll_pending) {
+			dfu_poll_run(&dif->session->poller);
+			continue;
+		}
+
+		ret = dfu_handle_events(dif, 1000);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+			errx(EX_IOERR, "Error handling USB events (%s)",
+			     libusb_error_name(ret));
+
+		if (p.sent != reported) {
+			reported = p.sent;
+			dfu_progress_bar("Download", reported, size);
+		}
+	}
+
+	dfu_free_transfer(p.dnload);
+	dfu_free_transfer(p.status);
+	*transaction = p.transaction;
+
+	switch (p.error) {
+	case ASYNC_DNLOAD:
+		warnx("Error during download (%s)",
+		      libusb_error_name(p.ret));
+		break;
+	case ASYNC_GET_STATUS:
+		warnx("Error during download get_status (%s)",
+		      libusb_error_name(p.ret));
+		break;
+	case ASYNC_STATUS:
+		_PRINTF(" failed!\n");
+		_PRINTF("DFU state(%u) = %s, status(%u) = %s\n", p.dst.bState,
+			dfu_state_to_string(p.dst.bState), p.dst.bStatus,
+			dfu_status_to_string(p.dst.bStatus));
+		break;
+	case ASYNC_OK:
+		break;
+	}
+	return p.ret;
+}
@@ -3,12 +3,16 @@
 #define DFU_FILE_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
 
 struct dfu_file {
     /* File name */
     const char *name;
     /* Pointer to file loaded into memory */
     uint8_t *firmware;
+    /* Length of the mapping if the file is mapped, see dfu_map_file() */
+    size_t mapped;
     /* Different sizes */
     struct {
 	off_t total;
@@ -28,6 +32,21 @@ struct dfu_file {
     uint16_t bcdDevice;
 };
 
+/* A file read while it is downloaded, see dfu_stream_open() */
+struct dfu_stream {
+    struct dfu_file *file;
+    FILE *f;
+    /* One block and a possible suffix */
+    uint8_t *buf;
+    size_t block_size;
+    /* Start of what has not been handed out yet, and end of the data */
+    size_t start;
+    size_t fill;
+    int eof;
+    /* CRC of what has been handed out, for checking the suffix */
+    uint32_t crc;
+};
+
 enum suffix_req {
 	NO_SUFFIX,
 	NEEDS_SUFFIX,
@@ -46,15 +65,31 @@ enum prefix_type {
 	LPCDFU_UNENCRYPTED_PREFIX
 };
 
+/* Room for the reason a file can't be loaded, see dfu_try_map_file() */
+#define DFU_LOAD_ERROR_LEN 512
+
 extern int verbose;
 
 void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix);
+void dfu_map_file(struct dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix);
+int dfu_try_map_file(struct dfu_file *file, enum suffix_req check_suffix,
+		     enum prefix_req check_prefix, char *error, size_t error_len);
+void dfu_free_file(struct dfu_file *file);
+void dfu_stream_file(struct dfu_file *file);
+void dfu_stream_open(struct dfu_stream *st, struct dfu_file *file,
+		     size_t block_size);
+int dfu_stream_read(struct dfu_stream *st, uint8_t **data);
+void dfu_stream_close(struct dfu_stream *st);
 void dfu_store_file(struct dfu_file *file, int write_suffix, int write_prefix);
 
 void dfu_progress_bar(const char *desc, unsigned long long curr,
 		unsigned long long max);
 void *dfu_malloc(size_t size);
 uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size);
+void dfu_rewrite_db(const char *path, const char *what, const char *header,
+		    int (*drop)(char *line, const void *arg),
+		    void (*append)(FILE *out, const void *arg),
+		    const void *arg);
 void show_suffix_and_prefix(struct dfu_file *file);
 
 #endif /* DFU_FILE_H */
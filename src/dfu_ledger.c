@@ -0,0 +1,253 @@
+/*
+ * Record of what was flashed to each device
+ *
+ * For every page a DfuSe download has written, a hash of the data the
+ * image put into it is kept in a text file, per device serial number.
+ * The next download to the same device can then leave out the pages
+ * whose hash did not change, without reading them back.
+ *
+ * The entries of a device are taken out of the file when a download
+ * starts and written back, updated, only after it succeeded, so that
+ * a download that fails halfway never leaves entries for pages that
+ * may have been erased.
+ *
+ * Each line holds the alternate setting, page address in hex, page
+ * size and hash in hex, then the serial number up to the end of line.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define __USE_MINGW_ANSI_STDIO 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_session.h"
+#include "dfu_ledger.h"
+
+#define LEDGER_HEADER "# dfu-util flash ledger v1\n"
+#define LEDGER_LINE_LEN 512
+
+/* 64-bit FNV-1a */
+unsigned long long dfu_ledger_hash(unsigned long long hash,
+				   const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+const struct dfu_ledger_page *dfu_ledger_find(const struct dfu_ledger *ledger,
+					      int alt, unsigned int address,
+					      unsigned int size)
+{
+	int i;
+
+	for (i = 0; i < ledger->num_pages; i++) {
+		const struct dfu_ledger_page *page = &ledger->pages[i];
+
+		if (page->alt == alt && page->address == address &&
+		    page->size == size)
+			return page;
+	}
+	return NULL;
+}
+
+void dfu_ledger_set(struct dfu_ledger *ledger, int alt, unsigned int address,
+		    unsigned int size, unsigned long long hash)
+{
+	struct dfu_ledger_page *page;
+	int i;
+
+	for (i = 0; i < ledger->num_pages; i++) {
+		page = &ledger->pages[i];
+		if (page->alt == alt && page->address == address) {
+			page->size = size;
+			page->hash = hash;
+			return;
+		}
+	}
+	if (ledger->num_pages == ledger->alloc) {
+		ledger->alloc = ledger->alloc ? ledger->alloc * 2 : 64;
+		ledger->pages = realloc(ledger->pages,
+					ledger->alloc * sizeof(*ledger->pages));
+		if (ledger->pages == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	page = &ledger->pages[ledger->num_pages++];
+	page->alt = alt;
+	page->address = address;
+	page->size = size;
+	page->hash = hash;
+}
+
+void dfu_ledger_free(struct dfu_ledger *ledger)
+{
+	free(ledger->pages);
+	memset(ledger, 0, sizeof(*ledger));
+}
+
+/* The serial number identifying the device, or NULL if it has none */
+static const char *ledger_serial(const struct dfu_session *s)
+{
+	const char *serial = s->dfu_root->serial_name;
+
+	if (serial == NULL || serial[0] == '\0' || !strcmp(serial, "UNKNOWN"))
+		return NULL;
+	return serial;
+}
+
+/* returns 0 on success, -1 on a malformed line */
+static int ledger_parse_line(char *line, struct dfu_ledger_page *page,
+			     const char **serial)
+{
+	char *p = line;
+	size_t len;
+	int n;
+
+	if (sscanf(p, "%d %x %u %llx%n", &page->alt, &page->address,
+		   &page->size, &page->hash, &n) != 4)
+		return -1;
+	p += n;
+	if (*p != ' ')
+		return -1;
+	p++;
+	len = strlen(p);
+	while (len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r'))
+		p[--len] = '\0';
+	*serial = p;
+	return 0;
+}
+
+struct ledger_save {
+	const char *serial;
+	const struct dfu_ledger *ledger;
+};
+
+/* drops malformed lines and the earlier entries of the device */
+static int ledger_drop_line(char *line, const void *arg)
+{
+	const struct ledger_save *ls = arg;
+	struct dfu_ledger_page page;
+	const char *serial;
+
+	return ledger_parse_line(line, &page, &serial) < 0 ||
+	    !strcmp(serial, ls->serial);
+}
+
+static void ledger_write_lines(FILE *f, const void *arg)
+{
+	const struct ledger_save *ls = arg;
+	int i;
+
+	for (i = 0; ls->ledger && i < ls->ledger->num_pages; i++) {
+		const struct dfu_ledger_page *p = &ls->ledger->pages[i];
+
+		fprintf(f, "%d 0x%08x %u %016llx %s\n", p->alt, p->address,
+			p->size, p->hash, ls->serial);
+	}
+}
+
+/*
+ * Rewrites the ledger with the entries of all other devices and those
+ * in ledger for this one.
+ */
+static void ledger_write(const char *path, const char *serial,
+			 const struct dfu_ledger *ledger)
+{
+	struct ledger_save ls;
+
+	ls.serial = serial;
+	ls.ledger = ledger;
+	dfu_rewrite_db(path, "flash ledger", LEDGER_HEADER,
+		       ledger_drop_line, ledger_write_lines, &ls);
+}
+
+/*
+ * Takes the entries for the device of the session out of the ledger
+ * file into s->ledger.
+ *
+ * returns the number of pages found, or -1 if the device can't be told
+ * apart from others
+ */
+int dfu_ledger_load(struct dfu_session *s)
+{
+	const char *path = s->flash_ledger;
+	const char *serial = ledger_serial(s);
+	char line[LEDGER_LINE_LEN];
+	struct dfu_ledger_page page;
+	const char *line_serial;
+	FILE *f;
+
+	dfu_ledger_free(&s->ledger);
+	if (serial == NULL) {
+		warnx("Device has no serial number, not using the flash ledger");
+		return -1;
+	}
+	s->ledger.loaded = 1;
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			warn("Cannot open flash ledger %s", path);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (ledger_parse_line(line, &page, &line_serial) < 0) {
+			warnx("Ignoring malformed line in flash ledger %s", path);
+			continue;
+		}
+		if (strcmp(line_serial, serial))
+			continue;
+		dfu_ledger_set(&s->ledger, page.alt, page.address, page.size,
+			       page.hash);
+	}
+	fclose(f);
+
+	if (s->ledger.num_pages > 0) {
+		ledger_write(path, serial, NULL);
+		if (verbose)
+			_PRINTF("Loaded %i pages from flash ledger %s\n",
+				s->ledger.num_pages, path);
+	}
+	return s->ledger.num_pages;
+}
+
+/* Puts the entries of the device back into the ledger file, with the
+ * pages written by the session */
+void dfu_ledger_save(struct dfu_session *s)
+{
+	const char *serial = ledger_serial(s);
+
+	if (!s->ledger.loaded || serial == NULL)
+		return;
+	ledger_write(s->flash_ledger, serial, &s->ledger);
+}
@@ -0,0 +1,56 @@
+/*
+ * Record of what was flashed to each device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_LEDGER_H
+#define DFU_LEDGER_H
+
+#include <stddef.h>
+
+#define DFU_LEDGER_HASH_INIT 0xcbf29ce484222325ULL
+
+struct dfu_session;
+
+/* Hash of what a download put into a page of memory */
+struct dfu_ledger_page {
+	int alt;
+	unsigned int address;
+	unsigned int size;
+	unsigned long long hash;
+};
+
+/* Pages recorded for the device of a session */
+struct dfu_ledger {
+	struct dfu_ledger_page *pages;
+	int num_pages;
+	int alloc;
+	int loaded;
+};
+
+unsigned long long dfu_ledger_hash(unsigned long long hash,
+				   const void *data, size_t len);
+const struct dfu_ledger_page *dfu_ledger_find(const struct dfu_ledger *ledger,
+					      int alt, unsigned int address,
+					      unsigned int size);
+void dfu_ledger_set(struct dfu_ledger *ledger, int alt, unsigned int address,
+		    unsigned int size, unsigned long long hash);
+void dfu_ledger_free(struct dfu_ledger *ledger);
+
+int dfu_ledger_load(struct dfu_session *s);
+void dfu_ledger_save(struct dfu_session *s);
+
+#endif /* DFU_LEDGER_H */
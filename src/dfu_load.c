@@ -43,6 +43,9 @@
 #include "usb_dfu.h"
 #include "dfu_file.h"
 #include "dfu_load.h"
+#include "dfu_async.h"
+#include "dfu_poll.h"
+#include "dfu_session.h"
 #include "quirks.h"
 
 int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
@@ -60,8 +63,7 @@ int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
 	while (1) {
 		int rc;
 		dfu_progress_bar("Upload", total_bytes, expected_size);
-		rc = dfu_upload(dif->dev_handle, dif->interface,
-				xfer_size, transaction++, buf);
+		rc = dfu_upload(dif, xfer_size, transaction++, buf);
 		if (rc < 0) {
 			warnx("\nError during upload (%s)",
 			      libusb_error_name(rc));
@@ -98,77 +100,72 @@ int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
 	return ret;
 }
 
-int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
+/* Sends one block and waits until the device has taken care of it */
+static int dfuload_dnload_block(struct dfu_session *s, struct dfu_if *dif,
+				unsigned char *buf, int chunk_size,
+				unsigned short transaction)
 {
-	off_t bytes_sent;
-	off_t expected_size;
-	unsigned char *buf;
-	unsigned short transaction = 0;
 	struct dfu_status dst;
+	struct dfu_poll_busy busy;
+	unsigned int wait;
 	int ret;
 
-	_PRINTF("Copying data from PC to DFU device\n");
+	ret = dfu_download(dif, chunk_size, transaction,
+			   chunk_size ? buf : NULL);
+	if (ret < 0) {
+		warnx("Error during download (%s)",
+		      libusb_error_name(ret));
+		return ret;
+	}
 
-	buf = file->firmware;
-	expected_size = file->size.total - file->size.suffix;
-	bytes_sent = 0;
+	dfu_poll_busy_init(&busy, s, DFU_POLL_DNLOAD);
+	do {
+		ret = dfu_get_status(dif, &dst);
+		if (ret == LIBUSB_ERROR_PIPE && dfu_poll_busy_early(&busy)) {
+			/* polled ahead of the reported timeout */
+			dst.bState = DFU_STATE_dfuDNBUSY;
+			dfu_poll_busy_stall(&busy);
+		} else if (ret < 0) {
+			warnx("Error during download get_status (%s)",
+			      libusb_error_name(ret));
+			return ret;
+		}
 
-	dfu_progress_bar("Download", 0, 1);
-	while (bytes_sent < expected_size) {
-		off_t bytes_left;
-		int chunk_size;
+		if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
+				dst.bState == DFU_STATE_dfuERROR)
+			break;
 
-		bytes_left = expected_size - bytes_sent;
-		if (bytes_left < xfer_size)
-			chunk_size = (int) bytes_left;
-		else
-			chunk_size = xfer_size;
+		/* Wait while device executes flashing */
+		wait = dfu_poll_busy_next(&busy, dst.bwPollTimeout);
+		dfu_poll_wait(dif, wait);
+		if (verbose > 1)
+			_FPRINTF(stderr, "Poll timeout %i ms\n", wait);
 
-		ret = dfu_download(dif->dev_handle, dif->interface,
-				   chunk_size, transaction++, chunk_size ? buf : NULL);
-		if (ret < 0) {
-			warnx("Error during download (%s)",
-			      libusb_error_name(ret));
-			goto out;
-		}
-		bytes_sent += chunk_size;
-		buf += chunk_size;
+	} while (1);
+	dfu_poll_busy_done(&busy);
 
-		do {
-			ret = dfu_get_status(dif, &dst);
-			if (ret < 0) {
-				errx(EX_IOERR, "Error during download get_status (%s)",
-				     libusb_error_name(ret));
-				goto out;
-			}
-
-			if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
-					dst.bState == DFU_STATE_dfuERROR)
-				break;
-
-			/* Wait while device executes flashing */
-			milli_sleep(dst.bwPollTimeout);
-			if (verbose > 1)
-				_FPRINTF(stderr, "Poll timeout %i ms\n", dst.bwPollTimeout);
-
-		} while (1);
-
-		if (dst.bStatus != DFU_STATUS_OK) {
-			_PRINTF(" failed!\n");
-			_PRINTF("DFU state(%u) = %s, status(%u) = %s\n", dst.bState,
-				dfu_state_to_string(dst.bState), dst.bStatus,
-				dfu_status_to_string(dst.bStatus));
-			ret = -1;
-			goto out;
-		}
-		dfu_progress_bar("Download", bytes_sent, bytes_sent + bytes_left);
+	if (dst.bStatus != DFU_STATUS_OK) {
+		_PRINTF(" failed!\n");
+		_PRINTF("DFU state(%u) = %s, status(%u) = %s\n", dst.bState,
+			dfu_state_to_string(dst.bState), dst.bStatus,
+			dfu_status_to_string(dst.bStatus));
+		return -1;
 	}
+	return 0;
+}
+
+/* Ends the download and waits for the device to manifest it */
+static int dfuload_dnload_end(struct dfu_if *dif, unsigned short transaction,
+			      off_t bytes_sent)
+{
+	struct dfu_status dst;
+	int ret;
 
 	/* send one zero sized download request to signalize end */
-	ret = dfu_download(dif->dev_handle, dif->interface, 0, transaction, NULL);
+	ret = dfu_download(dif, 0, transaction, NULL);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error sending completion packet (%s)",
-		     libusb_error_name(ret));
+		warnx("Error sending completion packet (%s)",
+		      libusb_error_name(ret));
 		goto out;
 	}
 
@@ -189,7 +186,7 @@ get_status:
 		dfu_state_to_string(dst.bState), dst.bStatus,
 		dfu_status_to_string(dst.bStatus));
 
-	milli_sleep(dst.bwPollTimeout);
+	dfu_poll_wait(dif, dst.bwPollTimeout);
 
 	/* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
 	switch (dst.bState) {
@@ -197,12 +194,12 @@ get_status:
 	case DFU_STATE_dfuMANIFEST:
 		/* some devices (e.g. TAS1020b) need some time before we
 		 * can obtain the status */
-		milli_sleep(1000);
+		dfu_poll_wait(dif, 1000);
 		goto get_status;
 		break;
 	case DFU_STATE_dfuMANIFEST_WAIT_RST:
 		_PRINTF("Resetting USB to switch back to runtime mode\n");
-		ret = libusb_reset_device(dif->dev_handle);
+		ret = dfu_reset_device(dif);
 		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
 			_FPRINTF(stderr, "error resetting after download (%s)\n",
 				libusb_error_name(ret));
@@ -216,3 +213,86 @@ get_status:
 out:
 	return ret;
 }
+
+int dfuload_do_dnload(struct dfu_session *s, struct dfu_if *dif, int xfer_size,
+    struct dfu_file *file)
+{
+	off_t bytes_sent;
+	off_t expected_size;
+	unsigned char *buf;
+	unsigned short transaction = 0;
+	int ret;
+
+	_PRINTF("Copying data from PC to DFU device\n");
+
+	buf = file->firmware;
+	expected_size = file->size.total - file->size.suffix;
+	bytes_sent = 0;
+
+	dfu_progress_bar("Download", 0, 1);
+	if (dfu_async_supported(dif)) {
+		ret = dfu_async_dnload(dif, xfer_size, buf, expected_size,
+				       &transaction);
+		if (ret < 0)
+			return ret;
+		bytes_sent = expected_size;
+	}
+	while (bytes_sent < expected_size) {
+		off_t bytes_left;
+		int chunk_size;
+
+		bytes_left = expected_size - bytes_sent;
+		if (bytes_left < xfer_size)
+			chunk_size = (int) bytes_left;
+		else
+			chunk_size = xfer_size;
+
+		ret = dfuload_dnload_block(s, dif, buf, chunk_size,
+					   transaction++);
+		if (ret < 0)
+			return ret;
+		bytes_sent += chunk_size;
+		buf += chunk_size;
+
+		dfu_progress_bar("Download", bytes_sent, bytes_sent + bytes_left);
+	}
+
+	return dfuload_dnload_end(dif, transaction, bytes_sent);
+}
+
+/*
+ * Downloads a file while it is being read, e.g. from a pipe, holding no
+ * more than one block in memory. See dfu_stream_open().
+ */
+int dfuload_do_dnload_stream(struct dfu_session *s, struct dfu_if *dif,
+			     int xfer_size, struct dfu_file *file)
+{
+	struct dfu_stream stream;
+	off_t bytes_sent = 0;
+	unsigned short transaction = 0;
+	uint8_t *buf;
+	int chunk_size;
+	int ret = 0;
+
+	_PRINTF("Copying data from PC to DFU device while reading %s\n",
+		file->name);
+
+	dfu_stream_open(&stream, file, xfer_size);
+	while ((chunk_size = dfu_stream_read(&stream, &buf)) > 0) {
+		ret = dfuload_dnload_block(s, dif, buf, chunk_size,
+					   transaction++);
+		if (ret < 0)
+			break;
+		bytes_sent += chunk_size;
+		if (verbose > 1)
+			_FPRINTF(stderr, "Sent %lli bytes\n",
+				 (long long) bytes_sent);
+	}
+	dfu_stream_close(&stream);
+	if (chunk_size < 0)
+		ret = -1;
+	if (ret < 0)
+		return ret;
+
+	return dfuload_dnload_end(dif, transaction, bytes_sent);
+}
@@ -0,0 +1,565 @@
+/*
+ * Flashing several devices at once
+ *
+ * Every target, given by serial number or USB path, gets its own
+ * session copied from the one set up by the command line, and goes
+ * through detach, re-enumeration and download on one of a bounded
+ * number of worker threads. Each worker has a libusb context of its own,
+ * so that the events of its transfers, and the callbacks that update its
+ * sessions, are only ever handled on its own thread. The workers only
+ * share the loaded file, which is read-only by then, and the profile
+ * cache and flash ledger, which are accessed under a lock.
+ *
+ * Failures are recorded per target instead of ending the program, so
+ * one bad device on a programming jig does not stop the others. Usage
+ * errors, which would hit every target alike, are checked before any
+ * worker starts. Only a failure to handle USB events ends the whole run.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <libusb.h>
+
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#else
+# include <pthread.h>
+#endif
+
+#include "portable.h"
+#include "dfu.h"
+#include "usb_dfu.h"
+#include "dfu_file.h"
+#include "dfu_load.h"
+#include "dfu_util.h"
+#include "dfuse.h"
+#include "dfu_poll.h"
+#include "dfu_profile.h"
+#include "dfu_session.h"
+#include "dfu_sim.h"
+#include "dfu_multi.h"
+
+#ifdef HAVE_WINDOWS_H
+typedef HANDLE multi_thread_t;
+typedef CRITICAL_SECTION multi_lock_t;
+# define multi_lock_init(l)	InitializeCriticalSection(l)
+# define multi_lock_destroy(l)	DeleteCriticalSection(l)
+# define multi_lock(l)		EnterCriticalSection(l)
+# define multi_unlock(l)	LeaveCriticalSection(l)
+#else
+typedef pthread_t multi_thread_t;
+typedef pthread_mutex_t multi_lock_t;
+# define multi_lock_init(l)	pthread_mutex_init(l, NULL)
+# define multi_lock_destroy(l)	pthread_mutex_destroy(l)
+# define multi_lock(l)		pthread_mutex_lock(l)
+# define multi_unlock(l)	pthread_mutex_unlock(l)
+#endif
+
+/* State shared by the workers */
+struct multi_pool {
+	struct dfu_multi *m;
+	multi_lock_t lock;
+	int next;			/* first target not taken yet */
+};
+
+/* A USB path as printed by --list, e.g. 1-2.3 */
+static int multi_is_path(const char *name)
+{
+	const char *p;
+
+	if (!isdigit((unsigned char) name[0]) || !strchr(name, '-'))
+		return 0;
+	for (p = name; *p; p++) {
+		if (!isdigit((unsigned char) *p) && *p != '-' && *p != '.')
+			return 0;
+	}
+	return 1;
+}
+
+int dfu_multi_parse_targets(const char *list,
+			    struct dfu_multi_target **targets)
+{
+	struct dfu_multi_target *t = NULL;
+	const char *p = list;
+	int num = 0;
+
+	while (*p) {
+		const char *end = strchr(p, ',');
+		size_t len;
+
+		if (!end)
+			end = p + strlen(p);
+		len = end - p;
+		if (len) {
+			t = realloc(t, (num + 1) * sizeof(*t));
+			if (!t)
+				errx(EX_SOFTWARE, "Out of memory");
+			memset(&t[num], 0, sizeof(*t));
+			t[num].name = dfu_malloc(len + 1);
+			memcpy(t[num].name, p, len);
+			t[num].name[len] = 0;
+			t[num].is_path = multi_is_path(t[num].name);
+			num++;
+		}
+		p = *end ? end + 1 : end;
+	}
+	if (num == 0)
+		errx(EX_USAGE, "No targets given");
+	*targets = t;
+	return num;
+}
+
+void dfu_multi_free_targets(struct dfu_multi_target *targets,
+			    int num_targets)
+{
+	int i;
+
+	for (i = 0; i < num_targets; i++)
+		free(targets[i].name);
+	free(targets);
+}
+
+/* Finds the one device of the session, waiting up to wait_ms for it
+ * or forever if wait_ms is negative */
+static int multi_probe(libusb_context *ctx, struct dfu_session *s,
+		       int wait_ms, const char **error)
+{
+	if (wait_devices(s, ctx, wait_ms) < 0) {
+		*error = "device not found";
+		return EX_IOERR;
+	}
+	if (s->dfu_root->next != NULL &&
+	    !(s->file.bcdDFU == 0x11a && dfuse_multiple_alt(s->dfu_root))) {
+		*error = "more than one DFU interface matches";
+		return EX_IOERR;
+	}
+	return EX_OK;
+}
+
+/* Sends a device in run-time mode to DFU mode and finds it again */
+static int multi_detach(struct dfu_multi *m, libusb_context *ctx,
+			struct dfu_session *s, const char **error)
+{
+	struct dfu_if *dif = s->dfu_root;
+	struct dfu_status status;
+	int ret;
+
+	if (dfu_open(dif)) {
+		*error = "cannot open device";
+		return EX_IOERR;
+	}
+	if (dfu_claim_interface(dif) < 0) {
+		dfu_close(dif);
+		*error = "cannot claim run-time interface";
+		return EX_IOERR;
+	}
+	if (dif->interface > 0 || dif->flags & DFU_IFF_ALT)
+		dfu_set_alt_setting(dif, 0);
+
+	ret = dfu_get_status(dif, &status);
+	if (ret == LIBUSB_ERROR_PIPE) {
+		status.bState = DFU_STATE_appIDLE;
+		status.bwPollTimeout = 0;
+	} else if (ret < 0) {
+		dfu_release_interface(dif);
+		dfu_close(dif);
+		*error = "get_status failed in run-time mode";
+		return EX_IOERR;
+	}
+	dfu_poll_wait(dif, status.bwPollTimeout);
+
+	if (status.bState != DFU_STATE_appIDLE &&
+	    status.bState != DFU_STATE_appDETACH) {
+		/* already in DFU mode after all */
+		dfu_release_interface(dif);
+		dfu_close(dif);
+		return EX_OK;
+	}
+	if (dfu_detach(dif, 1000) < 0)
+		warnx("%s: error detaching", s->match_path ? s->match_path :
+		      s->match_serial);
+	if (!(dif->func_dfu.bmAttributes & USB_DFU_WILL_DETACH)) {
+		ret = dfu_reset_device(dif);
+		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
+			dfu_release_interface(dif);
+			dfu_close(dif);
+			*error = "reset after detach failed";
+			return EX_IOERR;
+		}
+	}
+	dfu_release_interface(dif);
+	dfu_close(dif);
+
+	/* keeping handles open might prevent re-enumeration */
+	disconnect_devices(s);
+
+	/* only DFU mode matches from now on */
+	s->match_vendor = s->match_product = 0x10000;
+	ret = multi_probe(ctx, s, m->detach_delay * 1000, error);
+	if (ret != EX_OK) {
+		*error = "device lost after detach";
+		return ret;
+	}
+	if (!(s->dfu_root->flags & DFU_IFF_DFU)) {
+		*error = "device is not in DFU mode";
+		return EX_PROTOCOL;
+	}
+	return EX_OK;
+}
+
+/* Brings the opened interface to dfuIDLE */
+static int multi_idle(struct dfu_if *dif, const char **error)
+{
+	struct dfu_status status;
+	int tries;
+
+	for (tries = 0; tries < 4; tries++) {
+		if (dfu_get_status(dif, &status) < 0) {
+			*error = "get_status failed";
+			return EX_IOERR;
+		}
+		dfu_poll_wait(dif, status.bwPollTimeout);
+
+		switch (status.bState) {
+		case DFU_STATE_dfuIDLE:
+			if (status.bStatus == DFU_STATUS_OK)
+				return EX_OK;
+			/* fall through */
+		case DFU_STATE_dfuERROR:
+			if (dfu_clear_status(dif) < 0) {
+				*error = "clear_status failed";
+				return EX_IOERR;
+			}
+			break;
+		case DFU_STATE_dfuDNLOAD_IDLE:
+		case DFU_STATE_dfuUPLOAD_IDLE:
+			if (dfu_abort(dif) < 0) {
+				*error = "abort failed";
+				return EX_IOERR;
+			}
+			break;
+		case DFU_STATE_appIDLE:
+		case DFU_STATE_appDETACH:
+			*error = "device still in run-time mode";
+			return EX_PROTOCOL;
+		default:
+			*error = "device in unexpected state";
+			return EX_PROTOCOL;
+		}
+	}
+	*error = "device does not get to dfuIDLE";
+	return EX_PROTOCOL;
+}
+
+static int multi_dnload(struct multi_pool *pool, struct dfu_session *s,
+			uint16_t runtime_vendor, uint16_t runtime_product,
+			const char **error)
+{
+	struct dfu_multi *m = pool->m;
+	struct dfu_if *dif = s->dfu_root;
+	unsigned int transfer_size = m->transfer_size;
+	unsigned int profile_transfer_size = 0;
+	int ret;
+
+	if (s->profile_cache) {
+		multi_lock(&pool->lock);
+		dfu_profile_load(s, &profile_transfer_size);
+		multi_unlock(&pool->lock);
+	}
+	if (s->flash_ledger) {
+		multi_lock(&pool->lock);
+		dfu_ledger_load(s);
+		multi_unlock(&pool->lock);
+	}
+	if (!transfer_size)
+		transfer_size = libusb_le16_to_cpu(dif->func_dfu.wTransferSize);
+	if (!transfer_size)
+		transfer_size = profile_transfer_size;
+	if (!transfer_size) {
+		*error = "transfer size must be specified";
+		return EX_USAGE;
+	}
+#ifdef __linux__
+	/* limited to 4k in libusb Linux backend */
+	if (transfer_size > 4096)
+		transfer_size = 4096;
+#endif /* __linux__ */
+	if (transfer_size < dif->bMaxPacketSize0)
+		transfer_size = dif->bMaxPacketSize0;
+
+	if (((s->file.idVendor  != 0xffff && s->file.idVendor  != runtime_vendor) ||
+	     (s->file.idProduct != 0xffff && s->file.idProduct != runtime_product)) &&
+	    ((s->file.idVendor  != 0xffff && s->file.idVendor  != dif->vendor) ||
+	     (s->file.idProduct != 0xffff && s->file.idProduct != dif->product))) {
+		*error = "file ID does not match device";
+		return EX_USAGE;
+	}
+
+	if (dif->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a) ||
+	    s->dfuse_options || s->file.bcdDFU == 0x11a)
+		ret = dfuse_do_dnload(s, dif, transfer_size, &s->file,
+				      s->dfuse_options);
+	else
+		ret = dfuload_do_dnload(s, dif, transfer_size, &s->file);
+	if (ret < 0) {
+		*error = "download failed";
+		return EX_IOERR;
+	}
+
+	if (s->profile_cache) {
+		multi_lock(&pool->lock);
+		dfu_profile_save(s, transfer_size);
+		multi_unlock(&pool->lock);
+	}
+	if (s->flash_ledger) {
+		multi_lock(&pool->lock);
+		dfu_ledger_save(s);
+		multi_unlock(&pool->lock);
+	}
+
+	if (m->final_reset) {
+		dfu_detach(dif, 1000);
+		ret = dfu_reset_device(dif);
+		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
+			*error = "reset after download failed";
+			return EX_IOERR;
+		}
+	}
+	return EX_OK;
+}
+
+/* The sequence of main() for one device, with the errors returned */
+static int multi_flash(struct multi_pool *pool, libusb_context *ctx,
+		       struct dfu_session *s, const char **error)
+{
+	struct dfu_multi *m = pool->m;
+	struct dfu_if *dif;
+	uint16_t runtime_vendor;
+	uint16_t runtime_product;
+	int ret;
+
+	ret = multi_probe(ctx, s, m->wait_device ? -1 : 0, error);
+	if (ret != EX_OK)
+		return ret;
+
+	runtime_vendor = s->dfu_root->vendor;
+	runtime_product = s->dfu_root->product;
+	if (!(s->dfu_root->flags & DFU_IFF_DFU)) {
+		ret = multi_detach(m, ctx, s, error);
+		if (ret != EX_OK)
+			return ret;
+	} else {
+		if (s->match_vendor >= 0)
+			runtime_vendor = s->match_vendor;
+		if (s->match_product >= 0)
+			runtime_product = s->match_product;
+	}
+	dif = s->dfu_root;
+
+	if (dfu_open(dif)) {
+		*error = "cannot open device";
+		return EX_IOERR;
+	}
+	if (dfu_claim_interface(dif) < 0) {
+		*error = "cannot claim interface";
+		ret = EX_IOERR;
+		goto out_close;
+	}
+	if (dif->flags & DFU_IFF_ALT && dfu_set_alt_setting(dif, dif->altsetting) < 0) {
+		*error = "cannot set alternate interface";
+		ret = EX_IOERR;
+		goto out_release;
+	}
+	ret = multi_idle(dif, error);
+	if (ret == EX_OK)
+		ret = multi_dnload(pool, s, runtime_vendor, runtime_product,
+				   error);
+out_release:
+	dfu_release_interface(dif);
+out_close:
+	dfu_close(dif);
+	return ret;
+}
+
+/* A libusb context for one worker, NULL for simulated devices or if
+ * libusb can't be initialized */
+static libusb_context *multi_usb_init(const char **error)
+{
+	libusb_context *ctx = NULL;
+	int ret;
+
+	*error = NULL;
+	if (dfu_sim_num_alts())
+		return NULL;
+	ret = libusb_init(&ctx);
+	if (ret) {
+		*error = "unable to initialize libusb";
+		return NULL;
+	}
+	if (verbose > 2) {
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000106
+		libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
+#else
+		libusb_set_debug(ctx, 255);
+#endif
+	}
+	return ctx;
+}
+
+static void multi_worker(struct multi_pool *pool)
+{
+	struct dfu_multi *m = pool->m;
+	const char *usb_error;
+	libusb_context *ctx;
+
+	ctx = multi_usb_init(&usb_error);
+	while (1) {
+		struct dfu_multi_target *t;
+		struct dfu_session session;
+		unsigned long long start;
+		int i;
+
+		multi_lock(&pool->lock);
+		i = pool->next++;
+		multi_unlock(&pool->lock);
+		if (i >= m->num_targets)
+			break;
+		t = &m->targets[i];
+
+		session = *m->tmpl;
+		session.dfu_root = NULL;
+		session.desc_cache = NULL;
+		memset(&session.poller, 0, sizeof(session.poller));
+		memset(&session.poll_profile, 0, sizeof(session.poll_profile));
+		if (t->is_path) {
+			session.match_path = t->name;
+		} else {
+			session.match_serial = t->name;
+			session.match_serial_dfu = t->name;
+		}
+
+		start = dfu_poll_now();
+		t->error = usb_error;
+		if (usb_error)
+			t->result = EX_IOERR;
+		else
+			t->result = multi_flash(pool, ctx, &session, &t->error);
+		t->elapsed_us = dfu_poll_now() - start;
+		disconnect_devices(&session);
+		/* the file is shared with the other workers */
+		memset(&session.file, 0, sizeof(session.file));
+		dfu_session_exit(&session);
+
+		if (t->result == EX_OK)
+			_PRINTF("%s: done in %llu ms\n", t->name,
+				t->elapsed_us / 1000);
+		else
+			_PRINTF("%s: %s\n", t->name, t->error);
+	}
+	if (ctx)
+		libusb_exit(ctx);
+}
+
+#ifdef HAVE_WINDOWS_H
+static DWORD WINAPI multi_thread(LPVOID arg)
+{
+	multi_worker(arg);
+	return 0;
+}
+#else
+static void *multi_thread(void *arg)
+{
+	multi_worker(arg);
+	return NULL;
+}
+#endif
+
+int dfu_multi_run(struct dfu_multi *m)
+{
+	struct multi_pool pool;
+	multi_thread_t threads[DFU_MULTI_MAX_JOBS];
+	unsigned long long start;
+	int jobs = m->jobs;
+	int started;
+	int failed = 0;
+	int ret = EX_OK;
+	int i;
+
+	if (jobs <= 0 || jobs > m->num_targets)
+		jobs = m->num_targets;
+	if (jobs > DFU_MULTI_MAX_JOBS)
+		jobs = DFU_MULTI_MAX_JOBS;
+
+	if (m->tmpl->dfuse_options)
+		dfuse_check_options(m->tmpl->dfuse_options);
+
+	pool.m = m;
+	pool.next = 0;
+	multi_lock_init(&pool.lock);
+
+	_PRINTF("Flashing %d targets with %d workers\n", m->num_targets, jobs);
+	start = dfu_poll_now();
+	for (started = 0; started < jobs; started++) {
+#ifdef HAVE_WINDOWS_H
+		threads[started] = CreateThread(NULL, 0, multi_thread, &pool,
+						0, NULL);
+		if (threads[started] == NULL)
+			break;
+#else
+		if (pthread_create(&threads[started], NULL, multi_thread, &pool))
+			break;
+#endif
+	}
+	/* carry on with what we got, if anything */
+	if (started == 0)
+		multi_worker(&pool);
+	for (i = 0; i < started; i++) {
+#ifdef HAVE_WINDOWS_H
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+	multi_lock_destroy(&pool.lock);
+
+	for (i = 0; i < m->num_targets; i++) {
+		const struct dfu_multi_target *t = &m->targets[i];
+
+		if (t->result == EX_OK) {
+			_PRINTF("  %-20s OK      %8llu ms\n", t->name,
+				t->elapsed_us / 1000);
+		} else {
+			_PRINTF("  %-20s FAILED  %8llu ms  %s\n", t->name,
+				t->elapsed_us / 1000, t->error);
+			if (!failed)
+				ret = t->result;
+			failed++;
+		}
+	}
+	_PRINTF("Flashed %d of %d targets in %llu ms\n",
+		m->num_targets - failed, m->num_targets,
+		(dfu_poll_now() - start) / 1000);
+	return ret;
+}
@@ -0,0 +1,53 @@
+/*
+ * Flashing several devices at once
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_MULTI_H
+#define DFU_MULTI_H
+
+#include <libusb.h>
+
+#include "dfu_session.h"
+
+#define DFU_MULTI_MAX_JOBS 64
+
+struct dfu_multi_target {
+	char *name;			/* serial number or USB path */
+	int is_path;
+	int result;			/* EX_OK or exit code of the failure */
+	const char *error;		/* what went wrong, if anything */
+	unsigned long long elapsed_us;
+};
+
+struct dfu_multi {
+	const struct dfu_session *tmpl;	/* options shared by all targets */
+	struct dfu_multi_target *targets;
+	int num_targets;
+	int jobs;			/* 0 for one worker per target */
+	unsigned int transfer_size;	/* 0 for the one of the device */
+	int final_reset;
+	int wait_device;
+	int detach_delay;		/* in seconds */
+};
+
+int dfu_multi_parse_targets(const char *list,
+			    struct dfu_multi_target **targets);
+void dfu_multi_free_targets(struct dfu_multi_target *targets,
+			    int num_targets);
+int dfu_multi_run(struct dfu_multi *m);
+
+#endif /* DFU_MULTI_H */
@@ -0,0 +1,337 @@
+/*
+ * Deadline based scheduler for device poll timeouts
+ *
+ * A device that is busy tells the host in bwPollTimeout how long to wait
+ * before the next GETSTATUS request. Rather than sleeping for that long,
+ * which on a loaded host tends to oversleep, every wait is turned into an
+ * absolute deadline on a monotonic clock, and the wait itself is spent in
+ * the USB event loop. Any number of devices can have a deadline pending
+ * in the same poller, so one thread can serve all of them by calling
+ * dfu_poll_run(), which wakes up at the earliest deadline.
+ *
+ * The time a device really stays busy with each kind of command is
+ * measured along the way. Many devices, notably STM32 ROM bootloaders,
+ * report a much longer bwPollTimeout than they need. In adaptive mode the
+ * first GETSTATUS is sent after the learned busy time instead, followed
+ * by exponentially growing waits, never going past the reported timeout.
+ * Devices that stall GETSTATUS while busy are tolerated until then.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define __USE_MINGW_ANSI_STDIO 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#elif defined(__APPLE__)
+# include <mach/mach_time.h>
+#endif
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_poll.h"
+#include "dfu_session.h"
+
+static const char *dfu_poll_cmd_name[DFU_POLL_NUM_CMDS] = {
+	"DNLOAD", "SET_ADDRESS", "ERASE/KB", "MASS_ERASE"
+};
+
+unsigned long long dfu_poll_now(void)
+{
+#ifdef HAVE_WINDOWS_H
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (count.QuadPart / freq.QuadPart) * 1000000ULL +
+	    (count.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+#elif defined(__APPLE__)
+	/* clock_gettime() needs macOS 10.12 */
+	mach_timebase_info_data_t timebase;
+	unsigned long long ns;
+
+	mach_timebase_info(&timebase);
+	ns = mach_absolute_time() * timebase.numer / timebase.denom;
+	return ns / 1000;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+void dfu_poll_schedule(struct dfu_poller *poller, struct dfu_poll_entry *entry,
+		       struct dfu_if *dif, unsigned int poll_timeout)
+{
+	struct dfu_poll_entry **pos;
+
+	entry->dif = dif;
+	entry->poll_timeout = poll_timeout;
+	entry->deadline = dfu_poll_now() + poll_timeout * 1000ULL;
+
+	for (pos = &poller->pending; *pos; pos = &(*pos)->next)
+		if ((*pos)->deadline > entry->deadline)
+			break;
+	entry->next = *pos;
+	*pos = entry;
+}
+
+void dfu_poll_cancel(struct dfu_poller *poller, struct dfu_poll_entry *entry)
+{
+	struct dfu_poll_entry **pos;
+
+	for (pos = &poller->pending; *pos; pos = &(*pos)->next) {
+		if (*pos == entry) {
+			*pos = entry->next;
+			entry->next = NULL;
+			return;
+		}
+	}
+}
+
+/* Spend the time until the deadline handling USB events. All interfaces
+ * of a session are in the same libusb context, which no other thread
+ * handles events of, so the events of the first one cover the others
+ * too. */
+static void dfu_poll_wait_until(struct dfu_if *dif, unsigned long long deadline)
+{
+	unsigned long long now = dfu_poll_now();
+
+	while (now < deadline) {
+		/* round up, never poll before the device asked for */
+		unsigned int msec = (unsigned int) ((deadline - now + 999) / 1000);
+
+		if (dif && dif->transport->handle_events) {
+			int ret = dfu_handle_events(dif, msec);
+
+			if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+				errx(EX_IOERR, "Error handling USB events (%s)",
+				     libusb_error_name(ret));
+		} else {
+			milli_sleep(msec);
+		}
+		now = dfu_poll_now();
+	}
+}
+
+/*
+ * Waits for the earliest pending deadline and runs the callbacks of all
+ * entries that have expired by then. Callbacks may schedule again.
+ *
+ * returns the number of expired entries, 0 if nothing was scheduled
+ */
+int dfu_poll_run(struct dfu_poller *poller)
+{
+	struct dfu_poll_entry *entry;
+	unsigned long long now;
+	int count = 0;
+
+	if (!poller->pending)
+		return 0;
+
+	dfu_poll_wait_until(poller->pending->dif, poller->pending->deadline);
+
+	now = dfu_poll_now();
+	while ((entry = poller->pending) && entry->deadline <= now) {
+		unsigned long long late = now - entry->deadline;
+
+		poller->pending = entry->next;
+		entry->next = NULL;
+
+		poller->stats.waits++;
+		poller->stats.scheduled_us += entry->poll_timeout * 1000ULL;
+		poller->stats.late_us += late;
+		if (late > poller->stats.max_late_us)
+			poller->stats.max_late_us = late;
+		if (verbose > 2)
+			_FPRINTF(stderr, "   Poll timeout %u ms, woke up %llu us late\n",
+				 entry->poll_timeout, late);
+
+		count++;
+		if (entry->callback)
+			entry->callback(entry);
+	}
+	return count;
+}
+
+static void dfu_poll_wait_done(struct dfu_poll_entry *entry)
+{
+	*(int *) entry->user_data = 1;
+}
+
+/* Block until poll_timeout milliseconds have passed, like milli_sleep(),
+ * serving the other deadlines of the interface's session meanwhile */
+void dfu_poll_wait(struct dfu_if *dif, unsigned int poll_timeout)
+{
+	struct dfu_poller *poller = &dif->session->poller;
+	struct dfu_poll_entry entry;
+	int done = 0;
+
+	if (poll_timeout == 0)
+		return;
+
+	entry.callback = dfu_poll_wait_done;
+	entry.user_data = &done;
+	dfu_poll_schedule(poller, &entry, dif, poll_timeout);
+	while (!done)
+		dfu_poll_run(poller);
+}
+
+void dfu_poll_print_stats(const struct dfu_session *s)
+{
+	const struct dfu_poll_stats *st = &s->poller.stats;
+	int i;
+
+	if (st->waits == 0)
+		return;
+	_PRINTF("Poll timeouts: %u waits, %llu ms scheduled, "
+		"%llu.%03llu ms late in total (max %llu.%03llu ms)\n",
+		st->waits, st->scheduled_us / 1000,
+		st->late_us / 1000, st->late_us % 1000,
+		st->max_late_us / 1000, st->max_late_us % 1000);
+
+	for (i = 0; i < DFU_POLL_NUM_CMDS; i++) {
+		const struct dfu_poll_learned *l = &s->poll_profile.cmd[i];
+
+		if (l->samples == 0)
+			continue;
+		_PRINTF("  %-11s busy %llu.%03llu ms (reported %u ms), "
+			"%u samples, %u early polls, %u stalls\n",
+			dfu_poll_cmd_name[i], l->busy_us / 1000,
+			l->busy_us % 1000, l->reported, l->samples,
+			l->early_polls, l->stalls);
+	}
+}
+
+void dfu_poll_busy_init(struct dfu_poll_busy *busy, struct dfu_session *s,
+			enum dfu_poll_cmd cmd)
+{
+	busy->learned = &s->poll_profile.cmd[cmd];
+	busy->units = 1;
+	busy->adaptive = s->poll_adaptive;
+	busy->active = 0;
+	busy->polls = 0;
+}
+
+/*
+ * Tells that the busy time of the command grows with its size, units,
+ * such as the KB of a page to erase. The time is then learned per unit.
+ */
+void dfu_poll_busy_scale(struct dfu_poll_busy *busy, unsigned int units)
+{
+	busy->units = units ? units : 1;
+}
+
+/*
+ * Returns how long to wait before the next GETSTATUS request, given the
+ * bwPollTimeout of the device's last status. The first call starts the
+ * busy period.
+ */
+unsigned int dfu_poll_busy_next(struct dfu_poll_busy *busy,
+				unsigned int poll_timeout)
+{
+	const struct dfu_poll_learned *l = busy->learned;
+	unsigned long long busy_us = l->busy_us * busy->units;
+	unsigned long long now = dfu_poll_now();
+	unsigned long long end;
+	unsigned int wait;
+
+	if (!busy->active) {
+		busy->active = 1;
+		busy->start = now;
+		busy->reported = poll_timeout;
+		busy->last_wait = 0;
+		busy->polls = 0;
+	}
+	busy->polls++;
+
+	if (!busy->adaptive)
+		return poll_timeout;
+
+	end = busy->start + busy->reported * 1000ULL;
+	if (now >= end)
+		return poll_timeout;
+
+	if (busy->last_wait == 0) {
+		/* aim slightly before the learned time, so that the
+		 * estimate can also move downwards, unless every early
+		 * poll costs a stall */
+		if (l->samples && l->stall_prone)
+			wait = (unsigned int) (busy_us / 1000);
+		else if (l->samples)
+			wait = (unsigned int) (busy_us * 7 / 8000);
+		else
+			wait = busy->reported / 8;
+	} else if (busy->polls == 2) {
+		if (l->samples)
+			wait = (unsigned int) (busy_us / 16000);
+		else
+			wait = busy->reported / 16;
+	} else {
+		wait = busy->last_wait * 2;
+	}
+	if (wait == 0)
+		wait = 1;
+	if (now + wait * 1000ULL > end)
+		wait = (unsigned int) ((end - now + 999) / 1000);
+	busy->last_wait = wait;
+	return wait;
+}
+
+/* Whether the reported poll timeout has not yet passed, so that
+ * the device may legitimately still be busy */
+int dfu_poll_busy_early(const struct dfu_poll_busy *busy)
+{
+	return busy->adaptive && busy->active &&
+	    dfu_poll_now() < busy->start + busy->reported * 1000ULL;
+}
+
+void dfu_poll_busy_stall(struct dfu_poll_busy *busy)
+{
+	busy->learned->stalls++;
+	busy->learned->stall_prone = 1;
+}
+
+/* The device reported the command done, learn how long it took */
+void dfu_poll_busy_done(struct dfu_poll_busy *busy)
+{
+	struct dfu_poll_learned *l = busy->learned;
+	unsigned long long elapsed;
+
+	if (!busy->active)
+		return;
+	busy->active = 0;
+
+	elapsed = (dfu_poll_now() - busy->start) / busy->units;
+	if (l->samples == 0)
+		l->busy_us = elapsed;
+	else
+		l->busy_us = (l->busy_us * 3 + elapsed) / 4;
+	l->samples++;
+	l->reported = busy->reported;
+	if (busy->polls > 1)
+		l->early_polls += busy->polls - 1;
+}
@@ -0,0 +1,103 @@
+/*
+ * Deadline based scheduler for device poll timeouts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_POLL_H
+#define DFU_POLL_H
+
+#include "dfu.h"
+
+struct dfu_session;
+
+struct dfu_poll_entry {
+	struct dfu_if *dif;
+	unsigned long long deadline;	/* monotonic time in microseconds */
+	unsigned int poll_timeout;	/* requested wait in milliseconds */
+	void (*callback)(struct dfu_poll_entry *entry);
+	void *user_data;
+	struct dfu_poll_entry *next;
+};
+
+/* Scheduled against actual wakeup times of all expired entries */
+struct dfu_poll_stats {
+	unsigned int waits;
+	unsigned long long scheduled_us;
+	unsigned long long late_us;
+	unsigned long long max_late_us;
+};
+
+struct dfu_poller {
+	struct dfu_poll_entry *pending;	/* ordered by deadline */
+	struct dfu_poll_stats stats;
+};
+
+/* Commands whose busy time is learned separately */
+enum dfu_poll_cmd {
+	DFU_POLL_DNLOAD,
+	DFU_POLL_SET_ADDRESS,
+	DFU_POLL_ERASE_PAGE,	/* learned per KB of the page */
+	DFU_POLL_MASS_ERASE,
+	DFU_POLL_NUM_CMDS
+};
+
+/* Busy time of a command as measured during the session. For commands
+ * whose busy time grows with their size, see dfu_poll_busy_scale(),
+ * it is the time per unit of size. */
+struct dfu_poll_learned {
+	unsigned int samples;
+	unsigned long long busy_us;	/* running estimate */
+	unsigned int reported;		/* last bwPollTimeout, in ms */
+	unsigned int early_polls;	/* GETSTATUS while still busy */
+	unsigned int stalls;
+	int stall_prone;		/* device stalls GETSTATUS while busy */
+};
+
+struct dfu_poll_profile {
+	struct dfu_poll_learned cmd[DFU_POLL_NUM_CMDS];
+};
+
+/* One busy period of the device, from the first GETSTATUS reporting it
+ * busy until it reports the command done */
+struct dfu_poll_busy {
+	struct dfu_poll_learned *learned;
+	unsigned int units;		/* size of the command */
+	int adaptive;
+	int active;
+	unsigned long long start;
+	unsigned int reported;
+	unsigned int last_wait;
+	unsigned int polls;
+};
+
+unsigned long long dfu_poll_now(void);
+void dfu_poll_schedule(struct dfu_poller *poller, struct dfu_poll_entry *entry,
+		       struct dfu_if *dif, unsigned int poll_timeout);
+void dfu_poll_cancel(struct dfu_poller *poller, struct dfu_poll_entry *entry);
+int dfu_poll_run(struct dfu_poller *poller);
+void dfu_poll_wait(struct dfu_if *dif, unsigned int poll_timeout);
+void dfu_poll_print_stats(const struct dfu_session *s);
+
+void dfu_poll_busy_init(struct dfu_poll_busy *busy, struct dfu_session *s,
+			enum dfu_poll_cmd cmd);
+void dfu_poll_busy_scale(struct dfu_poll_busy *busy, unsigned int units);
+unsigned int dfu_poll_busy_next(struct dfu_poll_busy *busy,
+				unsigned int poll_timeout);
+int dfu_poll_busy_early(const struct dfu_poll_busy *busy);
+void dfu_poll_busy_stall(struct dfu_poll_busy *busy);
+void dfu_poll_busy_done(struct dfu_poll_busy *busy);
+
+#endif /* DFU_POLL_H */
@@ -0,0 +1,166 @@
+/*
+ * Loading the download file while the device is brought up
+ *
+ * Reading a large file and checking the CRC of its suffix takes time
+ * that can be spent on probing, detaching and waiting for the device
+ * to come back in DFU mode instead. The file is then loaded on a thread
+ * of its own, and whoever needs it next waits for that thread.
+ *
+ * This is only possible when the IDs in the file suffix are not needed
+ * to match the device. Between dfu_preload_start() and dfu_preload_wait()
+ * nothing else may touch the file of the session. A file that can't be
+ * loaded is only reported by dfu_preload_wait(), so that the thread never
+ * exits the program.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#else
+# include <pthread.h>
+#endif
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_session.h"
+#include "dfu_preload.h"
+
+struct dfu_preload {
+	struct dfu_file *file;
+	/* exit status and reason if the file could not be loaded */
+	int status;
+	char error[DFU_LOAD_ERROR_LEN];
+#ifdef HAVE_WINDOWS_H
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+};
+
+#ifdef HAVE_WINDOWS_H
+static DWORD WINAPI preload_thread(LPVOID arg)
+{
+	struct dfu_preload *pl = arg;
+
+	pl->status = dfu_try_map_file(pl->file, MAYBE_SUFFIX, MAYBE_PREFIX,
+				      pl->error, sizeof(pl->error));
+	return 0;
+}
+#else
+static void *preload_thread(void *arg)
+{
+	struct dfu_preload *pl = arg;
+
+	pl->status = dfu_try_map_file(pl->file, MAYBE_SUFFIX, MAYBE_PREFIX,
+				      pl->error, sizeof(pl->error));
+	return NULL;
+}
+#endif
+
+/*
+ * Starts loading the file of the session in the background, or loads
+ * it right away if no thread can be started.
+ */
+void dfu_preload_start(struct dfu_session *s)
+{
+	struct dfu_preload *pl;
+
+	/* fail before touching the device if the file can't be read */
+	if (strcmp(s->file.name, "-")) {
+		FILE *f = fopen(s->file.name, "rb");
+
+		if (!f)
+			err(EX_NOINPUT, "Could not open file %s for reading",
+			    s->file.name);
+		fclose(f);
+	}
+
+	pl = dfu_malloc(sizeof(*pl));
+	pl->file = &s->file;
+	pl->status = 0;
+#ifdef HAVE_WINDOWS_H
+	pl->thread = CreateThread(NULL, 0, preload_thread, pl, 0, NULL);
+	if (pl->thread != NULL) {
+		s->preload = pl;
+		return;
+	}
+#else
+	if (!pthread_create(&pl->thread, NULL, preload_thread, pl)) {
+		s->preload = pl;
+		return;
+	}
+#endif
+	free(pl);
+	dfu_map_file(&s->file, MAYBE_SUFFIX, MAYBE_PREFIX);
+}
+
+/*
+ * Waits for the loading thread, if any, and returns its exit status,
+ * with the reason copied to error
+ */
+static int preload_join(struct dfu_session *s, char *error, size_t error_len)
+{
+	struct dfu_preload *pl = s->preload;
+	int status;
+
+	if (pl == NULL)
+		return 0;
+#ifdef HAVE_WINDOWS_H
+	WaitForSingleObject(pl->thread, INFINITE);
+	CloseHandle(pl->thread);
+#else
+	pthread_join(pl->thread, NULL);
+#endif
+	status = pl->status;
+	if (status)
+		snprintf(error, error_len, "%s", pl->error);
+	free(pl);
+	s->preload = NULL;
+	return status;
+}
+
+/*
+ * Waits until the file of the session is loaded, if it is being loaded,
+ * and exits if it could not be
+ */
+void dfu_preload_wait(struct dfu_session *s)
+{
+	char error[DFU_LOAD_ERROR_LEN];
+	int status;
+
+	status = preload_join(s, error, sizeof(error));
+	if (status)
+		errx(status, "%s", error);
+}
+
+/* Like dfu_preload_wait(), for when the file is not going to be used */
+void dfu_preload_drop(struct dfu_session *s)
+{
+	char error[DFU_LOAD_ERROR_LEN];
+
+	preload_join(s, error, sizeof(error));
+}
@@ -0,0 +1,28 @@
+/*
+ * Loading the download file while the device is brought up
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_PRELOAD_H
+#define DFU_PRELOAD_H
+
+struct dfu_session;
+
+void dfu_preload_start(struct dfu_session *s);
+void dfu_preload_wait(struct dfu_session *s);
+void dfu_preload_drop(struct dfu_session *s);
+
+#endif /* DFU_PRELOAD_H */
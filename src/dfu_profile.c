@@ -0,0 +1,223 @@
+/*
+ * Persistent per-device timing profiles
+ *
+ * The busy times learned by the poll scheduler and the transfer size of
+ * the device are stored in a small text file, one line per device model and
+ * alternate setting, and read back at the start of the next session so
+ * that the first block is already polled at the right time.
+ *
+ * Each line holds vendor, product and bcdDevice in hex, the transfer
+ * size, then busy_us/samples/reported_ms/stall_prone for DNLOAD,
+ * SET_ADDRESS, ERASE_PAGE and MASS_ERASE, and finally the name of the
+ * alternate setting, which may contain spaces, up to the end of line.
+ * The busy time of ERASE_PAGE is per KB of the page. A file with another
+ * header line holds another format and is ignored.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define __USE_MINGW_ANSI_STDIO 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_poll.h"
+#include "dfu_session.h"
+#include "dfu_profile.h"
+
+#define PROFILE_HEADER "# dfu-util timing profiles v2\n"
+#define PROFILE_LINE_LEN 512
+
+/* Samples carried over from earlier sessions, so that new
+ * measurements still have an effect on the estimate */
+#define PROFILE_MAX_SAMPLES 16
+
+struct profile_entry {
+	unsigned int vendor;
+	unsigned int product;
+	unsigned int bcdDevice;
+	unsigned int transfer_size;
+	struct dfu_poll_learned cmd[DFU_POLL_NUM_CMDS];
+	const char *alt_name;
+};
+
+static const char *profile_alt_name(const struct dfu_if *dif)
+{
+	return dif->alt_name ? dif->alt_name : "";
+}
+
+/* returns 0 on success, -1 on a malformed line */
+static int profile_parse_line(char *line, struct profile_entry *entry)
+{
+	char *p = line;
+	size_t len;
+	int n;
+	int i;
+
+	memset(entry, 0, sizeof(*entry));
+	if (sscanf(p, "%x %x %x %u%n", &entry->vendor, &entry->product,
+		   &entry->bcdDevice, &entry->transfer_size, &n) != 4)
+		return -1;
+	p += n;
+	for (i = 0; i < DFU_POLL_NUM_CMDS; i++) {
+		struct dfu_poll_learned *l = &entry->cmd[i];
+
+		if (sscanf(p, " %llu/%u/%u/%d%n", &l->busy_us, &l->samples,
+			   &l->reported, &l->stall_prone, &n) != 4)
+			return -1;
+		p += n;
+	}
+	if (*p != ' ' && *p != '\n' && *p != '\0')
+		return -1;
+	if (*p == ' ')
+		p++;
+	len = strlen(p);
+	while (len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r'))
+		p[--len] = '\0';
+	entry->alt_name = p;
+	return 0;
+}
+
+static int profile_matches(const struct profile_entry *entry,
+			   const struct dfu_if *dif)
+{
+	return entry->vendor == dif->vendor &&
+	    entry->product == dif->product &&
+	    entry->bcdDevice == dif->bcdDevice &&
+	    !strcmp(entry->alt_name, profile_alt_name(dif));
+}
+
+/*
+ * Seeds the learned busy times of the session with the stored profile of
+ * its device, and returns the stored transfer size in *transfer_size,
+ * to be used only if the device doesn't report one.
+ *
+ * returns 1 if a profile was found, 0 otherwise
+ */
+int dfu_profile_load(struct dfu_session *s, unsigned int *transfer_size)
+{
+	const char *path = s->profile_cache;
+	const struct dfu_if *dif = s->dfu_root;
+	char line[PROFILE_LINE_LEN];
+	struct profile_entry entry;
+	FILE *f;
+	int i;
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			warn("Cannot open profile cache %s", path);
+		return 0;
+	}
+	if (!fgets(line, sizeof(line), f) || strcmp(line, PROFILE_HEADER)) {
+		if (verbose)
+			_PRINTF("Ignoring profile cache %s of another format\n",
+				path);
+		fclose(f);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (profile_parse_line(line, &entry) < 0) {
+			warnx("Ignoring malformed line in profile cache %s", path);
+			continue;
+		}
+		if (!profile_matches(&entry, dif))
+			continue;
+		fclose(f);
+
+		for (i = 0; i < DFU_POLL_NUM_CMDS; i++) {
+			struct dfu_poll_learned *l = &s->poll_profile.cmd[i];
+
+			l->busy_us = entry.cmd[i].busy_us;
+			l->samples = entry.cmd[i].samples;
+			if (l->samples > PROFILE_MAX_SAMPLES)
+				l->samples = PROFILE_MAX_SAMPLES;
+			l->reported = entry.cmd[i].reported;
+			l->stall_prone = entry.cmd[i].stall_prone;
+		}
+		*transfer_size = entry.transfer_size;
+		if (verbose)
+			_PRINTF("Loaded timing profile from %s\n", path);
+		return 1;
+	}
+	fclose(f);
+	return 0;
+}
+
+struct profile_save {
+	const struct dfu_session *s;
+	unsigned int transfer_size;
+};
+
+/* drops malformed lines and the earlier profile of the device */
+static int profile_drop_line(char *line, const void *arg)
+{
+	const struct profile_save *ps = arg;
+	struct profile_entry entry;
+
+	return profile_parse_line(line, &entry) < 0 ||
+	    profile_matches(&entry, ps->s->dfu_root);
+}
+
+static void profile_write_line(FILE *f, const void *arg)
+{
+	const struct profile_save *ps = arg;
+	const struct dfu_if *dif = ps->s->dfu_root;
+	int i;
+
+	fprintf(f, "%04x %04x %04x %u", dif->vendor, dif->product,
+		dif->bcdDevice, ps->transfer_size);
+	for (i = 0; i < DFU_POLL_NUM_CMDS; i++) {
+		const struct dfu_poll_learned *l = &ps->s->poll_profile.cmd[i];
+
+		fprintf(f, " %llu/%u/%u/%d", l->busy_us, l->samples,
+			l->reported, l->stall_prone);
+	}
+	fprintf(f, " %s\n", profile_alt_name(dif));
+}
+
+/*
+ * Stores the busy times learned in the session and the transfer size
+ * for its device, replacing its earlier profile.
+ *
+ * The transfer size stored is the one reported by the device, so that
+ * a one-off -t does not stick; transfer_size, the size used, is only
+ * stored for devices that report none.
+ */
+void dfu_profile_save(struct dfu_session *s, unsigned int transfer_size)
+{
+	const struct dfu_if *dif = s->dfu_root;
+	struct profile_save ps;
+
+	ps.s = s;
+	ps.transfer_size = transfer_size;
+	if (dif->func_dfu.wTransferSize)
+		ps.transfer_size = libusb_le16_to_cpu(dif->func_dfu.wTransferSize);
+
+	dfu_rewrite_db(s->profile_cache, "profile cache", PROFILE_HEADER,
+		       profile_drop_line, profile_write_line, &ps);
+}
@@ -0,0 +1,27 @@
+/*
+ * Persistent per-device timing profiles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_PROFILE_H
+#define DFU_PROFILE_H
+
+#include "dfu_session.h"
+
+int dfu_profile_load(struct dfu_session *s, unsigned int *transfer_size);
+void dfu_profile_save(struct dfu_session *s, unsigned int transfer_size);
+
+#endif /* DFU_PROFILE_H */
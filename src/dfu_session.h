@@ -0,0 +1,110 @@
+/*
+ * State of one dfu-util run against one device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_SESSION_H
+#define DFU_SESSION_H
+
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_poll.h"
+#include "dfu_ledger.h"
+
+struct dfu_preload;
+
+#define MAX_PATH_LEN 20
+
+enum mode {
+	MODE_NONE,
+	MODE_VERSION,
+	MODE_LIST,
+	MODE_DETACH,
+	MODE_UPLOAD,
+	MODE_DOWNLOAD
+};
+
+struct dfu_desc_cache;
+
+/*
+ * Everything that used to be process-wide, so that several devices can
+ * be handled from one process. Interfaces found by probe_devices() point
+ * back to the session in dfu_if->session.
+ */
+struct dfu_session {
+	/* device selection */
+	char *match_path;
+	int match_vendor;
+	int match_product;
+	int match_vendor_dfu;
+	int match_product_dfu;
+	int match_config_index;
+	int match_iface_index;
+	int match_iface_alt_index;
+	int match_devnum;
+	const char *match_iface_alt_name;
+	const char *match_serial;
+	const char *match_serial_dfu;
+
+	struct dfu_if *dfu_root;
+	char path_buf[MAX_PATH_LEN];
+
+	/* what to do */
+	enum mode mode;
+	struct dfu_file file;
+	const char *dfuse_options;
+	const char *profile_cache;
+	const char *flash_ledger;
+	int stream;		/* download while reading the file */
+	struct dfu_preload *preload;	/* file loading, see dfu_preload_start() */
+
+	/* timeout of control requests, in ms */
+	int timeout;
+
+	/* DfuSe options and state */
+	struct {
+		unsigned int address;
+		unsigned int address_present;
+		unsigned int length;
+		int force;
+		int leave;
+		int unprotect;
+		int mass_erase;
+		int allow_mass_erase;
+		int will_reset;
+		int dry_run;
+		int delta;
+		int blank_check;
+		int sparse;
+		int spot_check;
+	} dfuse;
+
+	/* poll timeouts */
+	struct dfu_poller poller;
+	struct dfu_poll_profile poll_profile;
+	int poll_adaptive;
+
+	/* descriptors read from devices, see probe_devices() */
+	struct dfu_desc_cache *desc_cache;
+
+	/* what was last flashed to the device, see dfu_ledger_load() */
+	struct dfu_ledger ledger;
+};
+
+void dfu_session_init(struct dfu_session *s);
+void dfu_session_exit(struct dfu_session *s);
+
+#endif /* DFU_SESSION_H */
@@ -0,0 +1,844 @@
+/*
+ * Simulated DFU 1.1 / DfuSe 1.1a device
+ *
+ * A software model of a DFU device in DFU mode, plugged in as the
+ * transport of the DFU interfaces it creates instead of libusb. It
+ * follows the DFU 1.1 state machine, reports bwPollTimeout values and
+ * takes its busy time in real (monotonic) time, so the download and
+ * upload loops can be exercised and timed without hardware.
+ *
+ * An alternate setting whose name starts with '@' is a DfuSe 1.1a
+ * memory layout as per ST document UM0424, and the simulated device
+ * then keeps flash pages for the segments in it. Otherwise the device
+ * is a plain DFU 1.1 device which stores the downloaded image and
+ * hands it back on upload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#endif
+
+#include "portable.h"
+#include "dfu.h"
+#include "usb_dfu.h"
+#include "dfu_file.h"
+#include "dfu_sim.h"
+#include "dfuse_mem.h"
+#include "dfu_poll.h"
+
+#define MAX_SIM_ALTS 16
+#define MAX_SIM_DEVICES 64
+#define MAX_SIM_TRANSFERS 8
+
+/* Roughly the order of magnitude of an STM32 ROM bootloader */
+struct dfu_sim_timing dfu_sim_timing = {
+	/* dnload      */ { 5, 2 },
+	/* set_address */ { 5, 1 },
+	/* erase_page  */ { 50, 20 },
+	/* mass_erase  */ { 500, 200 },
+	/* manifest    */ { 0, 0 },
+	/* stall_when_busy */ 0
+};
+
+enum sim_op {
+	SIM_OP_NONE,
+	SIM_OP_WRITE,
+	SIM_OP_SET_ADDRESS,
+	SIM_OP_ERASE_PAGE,
+	SIM_OP_MASS_ERASE,
+	SIM_OP_UNPROTECT,
+	SIM_OP_LEAVE
+};
+
+struct sim_region {
+	unsigned int start;
+	unsigned int end;
+	int pagesize;
+	int memtype;
+	uint8_t *data;	/* allocated on first write, erased until then */
+};
+
+/* Shared by all simulated devices */
+struct dfu_sim_config {
+	char *alt_names[MAX_SIM_ALTS];
+	int num_alts;
+	int dfuse;
+	int num_devices;
+};
+
+/* One simulated device, only ever used by the thread flashing it */
+struct dfu_sim {
+	int dfuse;
+	int initialized;
+	int gone;
+
+	int state;
+	int status;
+	unsigned int poll_timeout;
+	unsigned long long busy_until;
+
+	enum sim_op op;
+	unsigned int op_address;
+	int op_length;
+	uint8_t *block;
+
+	unsigned int address;		/* DfuSe address pointer */
+	struct sim_region *regions;	/* DfuSe memory */
+	int num_regions;
+
+	uint8_t *image;			/* DFU 1.1 memory */
+	size_t image_size;
+	size_t image_alloc;
+	size_t upload_offset;
+
+	/* asynchronous transfers waiting for their callback */
+	struct dfu_transfer *completed[MAX_SIM_TRANSFERS];
+	int num_completed;
+
+	unsigned long long start_time;
+	struct dfu_sim_stats stats;
+};
+
+static struct dfu_sim_config sim_config = { { NULL }, 0, 0, 1 };
+static struct dfu_sim sims[MAX_SIM_DEVICES];
+
+static unsigned long long sim_now(void)
+{
+	return dfu_poll_now() / 1000;
+}
+
+static void sim_add_layout(struct dfu_sim *s, char *alt_name)
+{
+	struct memlayout *mem_layout;
+	int i;
+
+	mem_layout = parse_memory_layout(alt_name);
+	if (!mem_layout)
+		errx(EX_USAGE, "Invalid memory layout for simulated device: %s",
+		     alt_name);
+
+	for (i = 0; i < mem_layout->num_segments; i++) {
+		struct memsegment *seg = &mem_layout->segments[i];
+		struct sim_region *region;
+
+		s->regions = realloc(s->regions,
+				     (s->num_regions + 1) * sizeof(*s->regions));
+		if (!s->regions)
+			errx(EX_SOFTWARE, "Out of memory");
+		region = &s->regions[s->num_regions++];
+		region->start = seg->start;
+		region->end = seg->end;
+		region->pagesize = seg->pagesize;
+		region->memtype = seg->memtype;
+		region->data = NULL;
+	}
+	free_memory_layout(mem_layout);
+}
+
+static void sim_init(struct dfu_sim *s)
+{
+	int alt;
+
+	if (s->initialized)
+		return;
+	s->initialized = 1;
+	s->block = dfu_malloc(DFU_SIM_TRANSFER_SIZE);
+	s->dfuse = sim_config.dfuse;
+	if (s->dfuse) {
+		for (alt = 0; alt < sim_config.num_alts; alt++)
+			sim_add_layout(s, sim_config.alt_names[alt]);
+	}
+	s->state = DFU_STATE_dfuIDLE;
+	s->status = DFU_STATUS_OK;
+	s->start_time = sim_now();
+}
+
+static struct sim_region *sim_find_region(struct dfu_sim *s,
+					  unsigned int address)
+{
+	int i;
+
+	for (i = 0; i < s->num_regions; i++) {
+		if (s->regions[i].start <= address &&
+		    s->regions[i].end >= address)
+			return &s->regions[i];
+	}
+	return NULL;
+}
+
+static uint8_t *sim_region_data(struct sim_region *region)
+{
+	if (!region->data) {
+		size_t size = (size_t) region->end - region->start + 1;
+
+		region->data = dfu_malloc(size);
+		memset(region->data, 0xff, size);
+	}
+	return region->data;
+}
+
+static int sim_stall(struct dfu_sim *s, int status)
+{
+	s->state = DFU_STATE_dfuERROR;
+	s->status = status;
+	s->stats.stalls++;
+	return LIBUSB_ERROR_PIPE;
+}
+
+static void sim_set_busy(struct dfu_sim *s, const struct dfu_sim_busy *busy)
+{
+	s->busy_until = sim_now() + busy->actual;
+	s->poll_timeout = busy->reported;
+}
+
+/* Program a block into DfuSe memory, returns a DFU status */
+static int sim_write_block(struct dfu_sim *s)
+{
+	unsigned int address = s->op_address;
+	int i;
+
+	for (i = 0; i < s->op_length; i++, address++) {
+		struct sim_region *region;
+		uint8_t *cell;
+
+		region = sim_find_region(s, address);
+		if (!region || !(region->memtype & DFUSE_WRITEABLE))
+			return DFU_STATUS_errADDRESS;
+		cell = sim_region_data(region) + (address - region->start);
+		if (region->memtype & DFUSE_ERASABLE) {
+			/* flash programming can only clear bits */
+			*cell &= s->block[i];
+			if (*cell != s->block[i])
+				return DFU_STATUS_errVERIFY;
+		} else {
+			*cell = s->block[i];
+		}
+	}
+	s->stats.bytes_written += s->op_length;
+	return DFU_STATUS_OK;
+}
+
+static int sim_erase_page(struct dfu_sim *s, unsigned int address)
+{
+	struct sim_region *region;
+	unsigned int page;
+
+	region = sim_find_region(s, address);
+	if (!region || !(region->memtype & DFUSE_ERASABLE))
+		return DFU_STATUS_errTARGET;
+	page = (address - region->start) / region->pagesize * region->pagesize;
+	memset(sim_region_data(region) + page, 0xff, region->pagesize);
+	s->stats.erase_page++;
+	return DFU_STATUS_OK;
+}
+
+static void sim_mass_erase(struct dfu_sim *s)
+{
+	int i;
+
+	for (i = 0; i < s->num_regions; i++) {
+		struct sim_region *region = &s->regions[i];
+
+		if ((region->memtype & DFUSE_ERASABLE) && region->data)
+			memset(region->data, 0xff,
+			       (size_t) region->end - region->start + 1);
+	}
+	s->stats.mass_erase++;
+}
+
+static void sim_append_image(struct dfu_sim *s)
+{
+	if (s->image_size + s->op_length > s->image_alloc) {
+		s->image_alloc = 2 * (s->image_size + s->op_length);
+		s->image = realloc(s->image, s->image_alloc);
+		if (!s->image)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	memcpy(s->image + s->image_size, s->block, s->op_length);
+	s->image_size += s->op_length;
+	s->stats.bytes_written += s->op_length;
+}
+
+/* Carries out the operation latched by the last DNLOAD request,
+ * as the device does on the GETSTATUS request following it */
+static void sim_execute(struct dfu_sim *s)
+{
+	int status = DFU_STATUS_OK;
+
+	s->state = DFU_STATE_dfuDNBUSY;
+	switch (s->op) {
+	case SIM_OP_WRITE:
+		if (s->dfuse)
+			status = sim_write_block(s);
+		else
+			sim_append_image(s);
+		sim_set_busy(s, &dfu_sim_timing.dnload);
+		break;
+	case SIM_OP_SET_ADDRESS:
+		if (!sim_find_region(s, s->op_address))
+			status = DFU_STATUS_errADDRESS;
+		s->address = s->op_address;
+		s->stats.set_address++;
+		sim_set_busy(s, &dfu_sim_timing.set_address);
+		break;
+	case SIM_OP_ERASE_PAGE:
+		status = sim_erase_page(s, s->op_address);
+		sim_set_busy(s, &dfu_sim_timing.erase_page);
+		break;
+	case SIM_OP_MASS_ERASE:
+		sim_mass_erase(s);
+		sim_set_busy(s, &dfu_sim_timing.mass_erase);
+		break;
+	case SIM_OP_UNPROTECT:
+		sim_mass_erase(s);
+		sim_set_busy(s, &dfu_sim_timing.mass_erase);
+		s->gone = 1;
+		break;
+	case SIM_OP_LEAVE:
+		/* answers this request, then jumps to the application */
+		s->state = DFU_STATE_dfuMANIFEST;
+		s->poll_timeout = 0;
+		s->gone = 1;
+		break;
+	case SIM_OP_NONE:
+	default:
+		sim_set_busy(s, &dfu_sim_timing.set_address);
+		break;
+	}
+	s->op = SIM_OP_NONE;
+	if (status != DFU_STATUS_OK) {
+		s->state = DFU_STATE_dfuERROR;
+		s->status = status;
+		s->poll_timeout = 0;
+	}
+}
+
+static int sim_dfuse_command(struct dfu_sim *s, unsigned char *data,
+			     uint16_t length)
+{
+	if (length == 0)
+		return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+
+	if (length == 5)
+		s->op_address = data[1] | (data[2] << 8) | (data[3] << 16) |
+				((unsigned int) data[4] << 24);
+
+	if (data[0] == 0x00 && length == 1)
+		s->op = SIM_OP_NONE;	/* Get Commands */
+	else if (data[0] == 0x21 && length == 5)
+		s->op = SIM_OP_SET_ADDRESS;
+	else if (data[0] == 0x41 && length == 5)
+		s->op = SIM_OP_ERASE_PAGE;
+	else if (data[0] == 0x41 && length == 1)
+		s->op = SIM_OP_MASS_ERASE;
+	else if (data[0] == 0x92 && length == 1)
+		s->op = SIM_OP_UNPROTECT;
+	else
+		return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+
+	return length;
+}
+
+static int sim_dnload(struct dfu_sim *s, uint16_t wValue,
+		      unsigned char *data, uint16_t length)
+{
+	if ((s->state != DFU_STATE_dfuIDLE &&
+	     s->state != DFU_STATE_dfuDNLOAD_IDLE) ||
+	    length > DFU_SIM_TRANSFER_SIZE)
+		return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+
+	s->stats.dnload++;
+
+	if (s->dfuse) {
+		if (wValue == 0) {
+			if (sim_dfuse_command(s, data, length) < 0)
+				return LIBUSB_ERROR_PIPE;
+		} else if (wValue == 1) {
+			return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+		} else if (length == 0) {
+			s->op = SIM_OP_LEAVE;
+		} else {
+			s->op = SIM_OP_WRITE;
+			s->op_address = s->address +
+				(wValue - 2) * DFU_SIM_TRANSFER_SIZE;
+		}
+	} else {
+		if (length == 0) {
+			if (s->state == DFU_STATE_dfuIDLE)
+				return sim_stall(s, DFU_STATUS_errNOTDONE);
+			s->state = DFU_STATE_dfuMANIFEST_SYNC;
+			return 0;
+		}
+		if (s->state == DFU_STATE_dfuIDLE)
+			s->image_size = 0;
+		s->op = SIM_OP_WRITE;
+	}
+
+	if (s->op == SIM_OP_WRITE)
+		memcpy(s->block, data, length);
+	s->op_length = length;
+	s->state = DFU_STATE_dfuDNLOAD_SYNC;
+	return length;
+}
+
+static int sim_upload(struct dfu_sim *s, uint16_t wValue,
+		      unsigned char *data, uint16_t length)
+{
+	static const unsigned char commands[] = { 0x00, 0x21, 0x41, 0x92 };
+	int count;
+
+	if (s->state != DFU_STATE_dfuIDLE &&
+	    s->state != DFU_STATE_dfuUPLOAD_IDLE)
+		return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+
+	s->stats.upload++;
+
+	if (s->dfuse) {
+		unsigned int address;
+		int i;
+
+		if (wValue == 1)
+			return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+		if (wValue == 0) {
+			count = length < sizeof(commands) ? length : sizeof(commands);
+			memcpy(data, commands, count);
+			s->state = DFU_STATE_dfuUPLOAD_IDLE;
+			return count;
+		}
+		address = s->address + (wValue - 2) * DFU_SIM_TRANSFER_SIZE;
+		for (i = 0; i < length; i++, address++) {
+			struct sim_region *region;
+
+			region = sim_find_region(s, address);
+			if (!region || !(region->memtype & DFUSE_READABLE))
+				return sim_stall(s, DFU_STATUS_errADDRESS);
+			if (region->data)
+				data[i] = region->data[address - region->start];
+			else
+				data[i] = 0xff;
+		}
+		count = length;
+		s->state = DFU_STATE_dfuUPLOAD_IDLE;
+	} else {
+		if (s->state == DFU_STATE_dfuIDLE)
+			s->upload_offset = 0;
+		count = length;
+		if (s->image_size - s->upload_offset < (size_t) length)
+			count = (int) (s->image_size - s->upload_offset);
+		memcpy(data, s->image + s->upload_offset, count);
+		s->upload_offset += count;
+		/* a short frame ends the upload */
+		if (count < length)
+			s->state = DFU_STATE_dfuIDLE;
+		else
+			s->state = DFU_STATE_dfuUPLOAD_IDLE;
+	}
+	s->stats.bytes_read += count;
+	return count;
+}
+
+static int sim_get_status(struct dfu_sim *s, unsigned char *data,
+			  uint16_t length)
+{
+	int busy;
+
+	if (length < 6)
+		return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+
+	s->stats.get_status++;
+	busy = sim_now() < s->busy_until;
+
+	switch (s->state) {
+	case DFU_STATE_dfuDNLOAD_SYNC:
+		sim_execute(s);
+		break;
+	case DFU_STATE_dfuDNBUSY:
+	case DFU_STATE_dfuMANIFEST:
+		if (busy) {
+			s->stats.early_polls++;
+			if (dfu_sim_timing.stall_when_busy) {
+				s->stats.stalls++;
+				return LIBUSB_ERROR_PIPE;
+			}
+		} else {
+			/* manifestation tolerant */
+			if (s->state == DFU_STATE_dfuMANIFEST)
+				s->state = DFU_STATE_dfuIDLE;
+			else
+				s->state = DFU_STATE_dfuDNLOAD_IDLE;
+			s->poll_timeout = 0;
+		}
+		break;
+	case DFU_STATE_dfuMANIFEST_SYNC:
+		if (dfu_sim_timing.manifest.actual == 0) {
+			s->state = DFU_STATE_dfuIDLE;
+			s->poll_timeout = 0;
+		} else {
+			s->state = DFU_STATE_dfuMANIFEST;
+			sim_set_busy(s, &dfu_sim_timing.manifest);
+		}
+		break;
+	default:
+		s->poll_timeout = 0;
+		break;
+	}
+
+	data[0] = s->status;
+	data[1] = s->poll_timeout & 0xff;
+	data[2] = (s->poll_timeout >> 8) & 0xff;
+	data[3] = (s->poll_timeout >> 16) & 0xff;
+	data[4] = s->state;
+	data[5] = 0;
+	return 6;
+}
+
+static int sim_open(struct dfu_if *dif)
+{
+	struct dfu_sim *s = dif->transport_data;
+
+	if (s->gone)
+		return LIBUSB_ERROR_NO_DEVICE;
+	sim_init(s);
+	return 0;
+}
+
+static void sim_close(struct dfu_if *dif)
+{
+	(void) dif;
+}
+
+static int sim_claim_interface(struct dfu_if *dif)
+{
+	struct dfu_sim *s = dif->transport_data;
+
+	return s->gone ? LIBUSB_ERROR_NO_DEVICE : 0;
+}
+
+static int sim_release_interface(struct dfu_if *dif)
+{
+	(void) dif;
+	return 0;
+}
+
+static int sim_set_alt_setting(struct dfu_if *dif, int altsetting)
+{
+	struct dfu_sim *s = dif->transport_data;
+
+	if (s->gone)
+		return LIBUSB_ERROR_NO_DEVICE;
+	if (altsetting < 0 || altsetting >= sim_config.num_alts)
+		return LIBUSB_ERROR_NOT_FOUND;
+	return 0;
+}
+
+static int sim_reset_device(struct dfu_if *dif)
+{
+	struct dfu_sim *s = dif->transport_data;
+
+	if (s->gone)
+		return LIBUSB_ERROR_NOT_FOUND;
+	s->state = DFU_STATE_dfuIDLE;
+	s->status = DFU_STATUS_OK;
+	s->op = SIM_OP_NONE;
+	return 0;
+}
+
+static int sim_control_transfer(struct dfu_if *dif, uint8_t bmRequestType,
+				uint8_t bRequest, uint16_t wValue,
+				unsigned char *data, uint16_t wLength,
+				unsigned int timeout)
+{
+	struct dfu_sim *s = dif->transport_data;
+
+	(void) bmRequestType;
+	(void) timeout;
+
+	if (s->gone)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	switch (bRequest) {
+	case DFU_DETACH:
+		return 0;
+	case DFU_DNLOAD:
+		return sim_dnload(s, wValue, data, wLength);
+	case DFU_UPLOAD:
+		return sim_upload(s, wValue, data, wLength);
+	case DFU_GETSTATUS:
+		return sim_get_status(s, data, wLength);
+	case DFU_CLRSTATUS:
+		if (s->state != DFU_STATE_dfuERROR)
+			return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+		s->state = DFU_STATE_dfuIDLE;
+		s->status = DFU_STATUS_OK;
+		return 0;
+	case DFU_GETSTATE:
+		if (wLength < 1)
+			return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+		data[0] = s->state;
+		return 1;
+	case DFU_ABORT:
+		if (s->state != DFU_STATE_dfuIDLE &&
+		    s->state != DFU_STATE_dfuDNLOAD_SYNC &&
+		    s->state != DFU_STATE_dfuDNLOAD_IDLE &&
+		    s->state != DFU_STATE_dfuMANIFEST_SYNC &&
+		    s->state != DFU_STATE_dfuUPLOAD_IDLE)
+			return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+		s->state = DFU_STATE_dfuIDLE;
+		s->op = SIM_OP_NONE;
+		return 0;
+	default:
+		return sim_stall(s, DFU_STATUS_errSTALLEDPKT);
+	}
+}
+
+/* The request is carried out right away, the callback runs from the
+ * next sim_handle_events() call, as it would with libusb */
+static int sim_submit_transfer(struct dfu_transfer *xfer)
+{
+	struct dfu_sim *s = xfer->dif->transport_data;
+	struct libusb_control_setup *setup =
+		(struct libusb_control_setup *) xfer->buffer;
+
+	if (s->num_completed == MAX_SIM_TRANSFERS)
+		return LIBUSB_ERROR_BUSY;
+	xfer->result = sim_control_transfer(xfer->dif, setup->bmRequestType,
+		setup->bRequest, libusb_le16_to_cpu(setup->wValue),
+		xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+		libusb_le16_to_cpu(setup->wLength), xfer->timeout);
+	s->completed[s->num_completed++] = xfer;
+	return 0;
+}
+
+static void sim_free_transfer(struct dfu_transfer *xfer)
+{
+	(void) xfer;
+}
+
+static int sim_handle_events(struct dfu_if *dif, unsigned int timeout_ms)
+{
+	struct dfu_sim *s = dif->transport_data;
+	struct dfu_transfer *completed[MAX_SIM_TRANSFERS];
+	int num, i;
+
+	/* nothing in flight, nothing can happen */
+	if (s->num_completed == 0) {
+		milli_sleep(timeout_ms);
+		return 0;
+	}
+	/* callbacks may submit new transfers */
+	num = s->num_completed;
+	memcpy(completed, s->completed, num * sizeof(completed[0]));
+	s->num_completed = 0;
+	for (i = 0; i < num; i++)
+		completed[i]->callback(completed[i]);
+	return 0;
+}
+
+static const struct dfu_transport dfu_sim_transport = {
+	sim_open,
+	sim_close,
+	sim_claim_interface,
+	sim_release_interface,
+	sim_set_alt_setting,
+	sim_reset_device,
+	sim_control_transfer,
+	sim_submit_transfer,
+	sim_free_transfer,
+	sim_handle_events
+};
+
+void dfu_sim_add_alt(const char *alt_name)
+{
+	int dfuse = (alt_name[0] == '@');
+
+	if (sim_config.num_alts == MAX_SIM_ALTS)
+		errx(EX_USAGE, "Too many alternate settings for simulated device");
+	if (sim_config.num_alts > 0 && dfuse != sim_config.dfuse)
+		errx(EX_USAGE, "Cannot mix DfuSe and DFU alternate settings "
+		     "in simulated device");
+	sim_config.dfuse = dfuse;
+	sim_config.alt_names[sim_config.num_alts] = strdup(alt_name);
+	if (sim_config.alt_names[sim_config.num_alts] == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+	sim_config.num_alts++;
+}
+
+int dfu_sim_num_alts(void)
+{
+	return sim_config.num_alts;
+}
+
+const char *dfu_sim_alt_name(int altsetting)
+{
+	return sim_config.alt_names[altsetting];
+}
+
+void dfu_sim_set_num_devices(int num_devices)
+{
+	if (num_devices < 1 || num_devices > MAX_SIM_DEVICES)
+		errx(EX_USAGE, "Number of simulated devices must be 1 to %d",
+		     MAX_SIM_DEVICES);
+	sim_config.num_devices = num_devices;
+}
+
+int dfu_sim_num_devices(void)
+{
+	return sim_config.num_devices;
+}
+
+/* A single device keeps the plain serial number for compatibility,
+ * several are numbered from 1 */
+const char *dfu_sim_serial(int device, char *buf, size_t size)
+{
+	if (sim_config.num_devices == 1)
+		snprintf(buf, size, "%s", DFU_SIM_SERIAL);
+	else
+		snprintf(buf, size, "%s%d", DFU_SIM_SERIAL, device + 1);
+	return buf;
+}
+
+/* Bus 0 does not exist on real systems */
+const char *dfu_sim_path(int device, char *buf, size_t size)
+{
+	snprintf(buf, size, "0-%d", device + 1);
+	return buf;
+}
+
+struct dfu_if *dfu_sim_new_if(int device, int altsetting)
+{
+	struct dfu_sim *s = &sims[device];
+	struct dfu_if *pdfu;
+	char serial[32];
+
+	pdfu = dfu_malloc(sizeof(*pdfu));
+	memset(pdfu, 0, sizeof(*pdfu));
+
+	pdfu->func_dfu.bLength = USB_DT_DFU_SIZE;
+	pdfu->func_dfu.bDescriptorType = USB_DT_DFU;
+	pdfu->func_dfu.bmAttributes = USB_DFU_CAN_DOWNLOAD |
+				      USB_DFU_CAN_UPLOAD |
+				      USB_DFU_MANIFEST_TOL;
+	pdfu->func_dfu.wDetachTimeOut = libusb_cpu_to_le16(255);
+	pdfu->func_dfu.wTransferSize = libusb_cpu_to_le16(DFU_SIM_TRANSFER_SIZE);
+	pdfu->func_dfu.bcdDFUVersion =
+		libusb_cpu_to_le16(sim_config.dfuse ? 0x011a : 0x0110);
+	pdfu->transport = &dfu_sim_transport;
+	pdfu->transport_data = s;
+	pdfu->vendor = DFU_SIM_VENDOR;
+	pdfu->product = DFU_SIM_PRODUCT;
+	pdfu->bcdDevice = 0x0200;
+	pdfu->configuration = 1;
+	pdfu->interface = 0;
+	pdfu->altsetting = altsetting;
+	pdfu->devnum = device + 1;
+	pdfu->flags = DFU_IFF_DFU | DFU_IFF_ALT;
+	pdfu->bMaxPacketSize0 = 64;
+	pdfu->alt_name = strdup(sim_config.alt_names[altsetting]);
+	if (pdfu->alt_name == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+	pdfu->serial_name = strdup(dfu_sim_serial(device, serial,
+						  sizeof(serial)));
+	if (pdfu->serial_name == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+
+	return pdfu;
+}
+
+/* Summed up over all devices, elapsed time since the first one opened */
+void dfu_sim_get_stats(struct dfu_sim_stats *stats,
+		       unsigned long long *elapsed_ms)
+{
+	unsigned long long start = 0;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < sim_config.num_devices; i++) {
+		const struct dfu_sim *s = &sims[i];
+
+		if (!s->initialized)
+			continue;
+		stats->dnload += s->stats.dnload;
+		stats->upload += s->stats.upload;
+		stats->get_status += s->stats.get_status;
+		stats->early_polls += s->stats.early_polls;
+		stats->stalls += s->stats.stalls;
+		stats->set_address += s->stats.set_address;
+		stats->erase_page += s->stats.erase_page;
+		stats->mass_erase += s->stats.mass_erase;
+		stats->bytes_written += s->stats.bytes_written;
+		stats->bytes_read += s->stats.bytes_read;
+		if (start == 0 || s->start_time < start)
+			start = s->start_time;
+	}
+	*elapsed_ms = start ? sim_now() - start : 0;
+}
+
+void dfu_sim_print_stats(void)
+{
+	struct dfu_sim_stats st;
+	unsigned long long elapsed;
+	const char *what = "Simulated device";
+	int i;
+
+	for (i = 0; i < sim_config.num_devices; i++) {
+		if (sims[i].initialized)
+			break;
+	}
+	if (i == sim_config.num_devices)
+		return;
+	dfu_sim_get_stats(&st, &elapsed);
+	if (sim_config.num_devices > 1)
+		what = "Simulated devices";
+	_PRINTF("%s: %u DNLOAD, %u UPLOAD, %u GETSTATUS "
+		"(%u early, %u stalls)\n", what, st.dnload, st.upload,
+		st.get_status, st.early_polls, st.stalls);
+	_PRINTF("%s: %u SET_ADDRESS, %u ERASE_PAGE, "
+		"%u MASS_ERASE\n", what, st.set_address, st.erase_page,
+		st.mass_erase);
+	_PRINTF("%s: %llu bytes written, %llu bytes read "
+		"in %llu ms\n", what, st.bytes_written, st.bytes_read,
+		elapsed);
+}
+
+void dfu_sim_exit(void)
+{
+	int i, d;
+
+	for (d = 0; d < sim_config.num_devices; d++) {
+		struct dfu_sim *s = &sims[d];
+
+		for (i = 0; i < s->num_regions; i++)
+			free(s->regions[i].data);
+		free(s->regions);
+		free(s->image);
+		free(s->block);
+		memset(s, 0, sizeof(*s));
+	}
+	for (i = 0; i < sim_config.num_alts; i++)
+		free(sim_config.alt_names[i]);
+	memset(&sim_config, 0, sizeof(sim_config));
+	sim_config.num_devices = 1;
+}
@@ -0,0 +1,75 @@
+/*
+ * Simulated DFU 1.1 / DfuSe 1.1a device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_SIM_H
+#define DFU_SIM_H
+
+#include "dfu.h"
+
+#define DFU_SIM_VENDOR        0x0483
+#define DFU_SIM_PRODUCT       0xdf11
+#define DFU_SIM_TRANSFER_SIZE 2048
+#define DFU_SIM_SERIAL        "SIMULATED"
+
+/* Busy time of one operation: what the device reports in bwPollTimeout
+ * and how long it really takes, both in milliseconds */
+struct dfu_sim_busy {
+	unsigned int reported;
+	unsigned int actual;
+};
+
+struct dfu_sim_timing {
+	struct dfu_sim_busy dnload;	/* per data block */
+	struct dfu_sim_busy set_address;
+	struct dfu_sim_busy erase_page;
+	struct dfu_sim_busy mass_erase;
+	struct dfu_sim_busy manifest;
+	/* stall GETSTATUS requests arriving before the device is done,
+	 * like some STM32L4 bootloaders do */
+	int stall_when_busy;
+};
+
+struct dfu_sim_stats {
+	unsigned int dnload;
+	unsigned int upload;
+	unsigned int get_status;
+	unsigned int early_polls;
+	unsigned int stalls;
+	unsigned int set_address;
+	unsigned int erase_page;
+	unsigned int mass_erase;
+	unsigned long long bytes_written;
+	unsigned long long bytes_read;
+};
+
+extern struct dfu_sim_timing dfu_sim_timing;
+
+void dfu_sim_add_alt(const char *alt_name);
+int dfu_sim_num_alts(void);
+const char *dfu_sim_alt_name(int altsetting);
+void dfu_sim_set_num_devices(int num_devices);
+int dfu_sim_num_devices(void);
+const char *dfu_sim_serial(int device, char *buf, size_t size);
+const char *dfu_sim_path(int device, char *buf, size_t size);
+struct dfu_if *dfu_sim_new_if(int device, int altsetting);
+void dfu_sim_get_stats(struct dfu_sim_stats *stats,
+		       unsigned long long *elapsed_ms);
+void dfu_sim_print_stats(void);
+void dfu_sim_exit(void);
+
+#endif /* DFU_SIM_H */
@@ -38,6 +38,10 @@
 #include "usb_dfu.h"
 #include "dfu_file.h"
 #include "dfu_util.h"
+#include "dfu_preload.h"
+#include "dfu_sim.h"
+#include "dfu_poll.h"
+#include "dfuse_mem.h"
 #include "quirks.h"
 
 /*
@@ -74,22 +78,12 @@ static int find_descriptor(const uint8_t *desc_list, int list_len,
 	return -1;
 }
 
-/*
- * Get a string descriptor that's UTF-8 (or ASCII) encoded instead
- * of UTF-16 encoded like the USB specification mandates. Some
- * devices, like the GD32VF103, both violate the spec in this way
- * and store important information in the serial number field. This
- * function does NOT append a NUL terminator to its buffer, so you
- * must use the returned length to ensure you stay within bounds.
- */
-static int get_utf8_string_descriptor(libusb_device_handle *devh,
-    uint8_t desc_index, unsigned char *data, int length)
+/* Get the language IDs and pick the first one */
+static int get_langid(libusb_device_handle *devh, uint16_t *langid)
 {
 	unsigned char tbuf[255];
-	uint16_t langid;
-	int r, outlen;
+	int r;
 
-	/* get the language IDs and pick the first one */
 	r = libusb_get_string_descriptor(devh, 0, 0, tbuf, sizeof(tbuf));
 	if (r < 0) {
 		warnx("Failed to retrieve language identifiers");
@@ -99,7 +93,23 @@ static int get_utf8_string_descriptor(libusb_device_handle *devh,
 		warnx("Broken LANGID string descriptor");
 		return -1;
 	}
-	langid = tbuf[2] | (tbuf[3] << 8);
+	*langid = tbuf[2] | (tbuf[3] << 8);
+	return 0;
+}
+
+/*
+ * Get a string descriptor that's UTF-8 (or ASCII) encoded instead
+ * of UTF-16 encoded like the USB specification mandates. Some
+ * devices, like the GD32VF103, both violate the spec in this way
+ * and store important information in the serial number field. This
+ * function does NOT append a NUL terminator to its buffer, so you
+ * must use the returned length to ensure you stay within bounds.
+ */
+static int get_utf8_string_descriptor(libusb_device_handle *devh,
+    uint16_t langid, uint8_t desc_index, unsigned char *data, int length)
+{
+	unsigned char tbuf[255];
+	int r, outlen;
 
 	r = libusb_get_string_descriptor(devh, desc_index, langid, tbuf,
 					 sizeof(tbuf));
@@ -132,15 +142,14 @@ static int get_utf8_string_descriptor(libusb_device_handle *devh,
 /*
  * Similar to libusb_get_string_descriptor_ascii but will allow
  * truncated descriptors (descriptor length mismatch) seen on
- * e.g. the STM32F427 ROM bootloader.
+ * e.g. the STM32F427 ROM bootloader. Converts a descriptor
+ * fetched by get_utf8_string_descriptor().
  */
-static int get_string_descriptor_ascii(libusb_device_handle *devh,
-    uint8_t desc_index, unsigned char *data, int length)
+static int string_descriptor_ascii(const unsigned char *buf, int r,
+    unsigned char *data, int length)
 {
-	unsigned char buf[255];
-	int r, di, si;
+	int di, si;
 
-	r = get_utf8_string_descriptor(devh, desc_index, buf, sizeof(buf));
 	if (r < 0)
 		return r;
 
@@ -155,10 +164,256 @@ static int get_string_descriptor_ascii(libusb_device_handle *devh,
 	return di;
 }
 
-static void probe_configuration(libusb_device *dev, struct libusb_device_descriptor *desc)
-{
+/*
+ * Descriptors of a device read during the session. A device is opened
+ * once to read the LANGID and all the strings that probing can ask
+ * for, and later probes of the same enumeration of the device (same
+ * path, address and IDs) use what was read. A re-enumerated device
+ * gets a new address and thus a new entry.
+ *
+ * A device that cannot be opened is not tried again, except shortly
+ * after it showed up, when udev may not have set its permissions yet.
+ */
+#define DESC_OPEN_RETRY_MS 1000
+struct desc_string {
+	uint8_t index;
+	int len;		/* negative if it could not be read */
+	unsigned char data[MAX_DESC_STR_LEN];
+};
+
+struct dfu_desc_cache {
+	uint8_t busnum;
+	uint8_t devnum;
+	char path[MAX_PATH_LEN];
+	uint16_t vendor;
+	uint16_t product;
+	uint16_t bcdDevice;
+
+	unsigned long long first_seen;	/* in us, see dfu_poll_now() */
+	int open_error;
+
+	int strings_read;
+	struct desc_string *strings;
+	int num_strings;
+
+	int func_dfu_read;
+	int func_dfu_len;	/* negative if it could not be read */
 	struct usb_dfu_func_descriptor func_dfu;
+
+	struct dfu_desc_cache *next;
+};
+
+static struct dfu_desc_cache *desc_cache_get(struct dfu_session *s,
+    libusb_device *dev, const struct libusb_device_descriptor *desc)
+{
+	struct dfu_desc_cache *dc;
+	uint8_t busnum = libusb_get_bus_number(dev);
+	uint8_t devnum = libusb_get_device_address(dev);
+	const char *path = get_path(s, dev);
+
+	if (path == NULL)
+		path = "";
+	for (dc = s->desc_cache; dc != NULL; dc = dc->next) {
+		if (dc->busnum == busnum && dc->devnum == devnum &&
+		    dc->vendor == desc->idVendor &&
+		    dc->product == desc->idProduct &&
+		    dc->bcdDevice == desc->bcdDevice &&
+		    !strcmp(dc->path, path))
+			return dc;
+	}
+
+	dc = dfu_malloc(sizeof(*dc));
+	memset(dc, 0, sizeof(*dc));
+	dc->busnum = busnum;
+	dc->devnum = devnum;
+	snprintf(dc->path, sizeof(dc->path), "%s", path);
+	dc->vendor = desc->idVendor;
+	dc->product = desc->idProduct;
+	dc->bcdDevice = desc->bcdDevice;
+	dc->first_seen = dfu_poll_now();
+	dc->next = s->desc_cache;
+	s->desc_cache = dc;
+	return dc;
+}
+
+static void desc_cache_add_index(struct dfu_desc_cache *dc, uint8_t index)
+{
+	int i;
+
+	if (index == 0)
+		return;
+	for (i = 0; i < dc->num_strings; i++) {
+		if (dc->strings[i].index == index)
+			return;
+	}
+	dc->strings = realloc(dc->strings,
+			      (dc->num_strings + 1) * sizeof(*dc->strings));
+	if (dc->strings == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+	dc->strings[dc->num_strings].index = index;
+	dc->strings[dc->num_strings].len = LIBUSB_ERROR_NOT_FOUND;
+	dc->num_strings++;
+}
+
+static int desc_cache_open(struct dfu_desc_cache *dc, libusb_device *dev,
+    libusb_device_handle **devh)
+{
+	if (dc->open_error &&
+	    dfu_poll_now() - dc->first_seen > DESC_OPEN_RETRY_MS * 1000ULL)
+		return dc->open_error;
+	dc->open_error = libusb_open(dev, devh);
+	return dc->open_error;
+}
+
+/* Reads the serial number and the names of all DFU interfaces in one go */
+static int desc_cache_read_strings(struct dfu_desc_cache *dc,
+    libusb_device *dev, const struct libusb_device_descriptor *desc)
+{
 	libusb_device_handle *devh;
+	uint16_t langid;
+	int cfg_idx, intf_idx, alt_idx;
+	int ret, i;
+
+	if (dc->strings_read)
+		return 0;
+
+	desc_cache_add_index(dc, desc->iSerialNumber);
+	for (cfg_idx = 0; cfg_idx != desc->bNumConfigurations; cfg_idx++) {
+		struct libusb_config_descriptor *cfg;
+
+		if (libusb_get_config_descriptor(dev, cfg_idx, &cfg) != 0 || !cfg)
+			continue;
+		for (intf_idx = 0; intf_idx < cfg->bNumInterfaces; intf_idx++) {
+			const struct libusb_interface *uif = &cfg->interface[intf_idx];
+
+			for (alt_idx = 0; alt_idx < uif->num_altsetting; alt_idx++) {
+				const struct libusb_interface_descriptor *intf =
+				    &uif->altsetting[alt_idx];
+
+				if (intf->bInterfaceClass == 0xfe &&
+				    intf->bInterfaceSubClass == 1)
+					desc_cache_add_index(dc, intf->iInterface);
+			}
+		}
+		libusb_free_config_descriptor(cfg);
+	}
+
+	ret = desc_cache_open(dc, dev, &devh);
+	if (ret)
+		return ret;
+	/* from now on failures are remembered, not retried */
+	dc->strings_read = 1;
+	if (dc->num_strings > 0 && get_langid(devh, &langid) == 0) {
+		for (i = 0; i < dc->num_strings; i++) {
+			struct desc_string *ds = &dc->strings[i];
+
+			ds->len = get_utf8_string_descriptor(devh, langid,
+			    ds->index, ds->data, sizeof(ds->data));
+		}
+	}
+	libusb_close(devh);
+	return 0;
+}
+
+/* Raw string descriptor contents from the cache, see
+ * get_utf8_string_descriptor() */
+static int desc_cache_string(const struct dfu_desc_cache *dc, uint8_t index,
+    const unsigned char **data)
+{
+	int i;
+
+	for (i = 0; i < dc->num_strings; i++) {
+		if (dc->strings[i].index == index) {
+			*data = dc->strings[i].data;
+			return dc->strings[i].len;
+		}
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int desc_cache_string_ascii(const struct dfu_desc_cache *dc,
+    uint8_t index, unsigned char *data, int length)
+{
+	const unsigned char *raw = NULL;
+	int r;
+
+	r = desc_cache_string(dc, index, &raw);
+	return string_descriptor_ascii(raw, r, data, length);
+}
+
+/* Functional descriptor requested from the device directly */
+static int desc_cache_func_dfu(struct dfu_desc_cache *dc, libusb_device *dev,
+    struct usb_dfu_func_descriptor *func_dfu)
+{
+	libusb_device_handle *devh;
+
+	if (!dc->func_dfu_read) {
+		int ret = desc_cache_open(dc, dev, &devh);
+
+		if (ret)
+			return ret;
+		dc->func_dfu_len = libusb_get_descriptor(devh, USB_DT_DFU, 0,
+		    (void *)&dc->func_dfu, sizeof(dc->func_dfu));
+		libusb_close(devh);
+		dc->func_dfu_read = 1;
+	}
+	if (dc->func_dfu_len > -1)
+		*func_dfu = dc->func_dfu;
+	return dc->func_dfu_len;
+}
+
+static void free_desc_cache(struct dfu_session *s)
+{
+	struct dfu_desc_cache *dc;
+
+	while ((dc = s->desc_cache) != NULL) {
+		s->desc_cache = dc->next;
+		free(dc->strings);
+		free(dc);
+	}
+}
+
+/*
+ * Device selection runs in stages, cheapest first, and each one only
+ * looks at what passed the previous ones: the USB path, vendor/product
+ * IDs and device address are checked here on the device descriptor,
+ * the configuration, interface and alternate setting numbers on the
+ * configuration descriptor in probe_configuration(), and only then is
+ * the device opened to compare interface names and serial numbers.
+ * Other devices on the bus are thus never opened.
+ */
+static int match_device(struct dfu_session *s, libusb_device *dev,
+			const struct libusb_device_descriptor *desc)
+{
+	int runtime_ok, dfu_ok;
+
+	if (s->match_path != NULL) {
+		const char *path = get_path(s, dev);
+
+		if (path == NULL || strcmp(path, s->match_path) != 0)
+			return 0;
+	}
+
+	/* the device may match either as runtime or as DFU mode device */
+	runtime_ok = (s->match_vendor < 0 || s->match_vendor == desc->idVendor) &&
+	    (s->match_product < 0 || s->match_product == desc->idProduct);
+	dfu_ok = (s->match_vendor_dfu < 0 || s->match_vendor_dfu == desc->idVendor) &&
+	    (s->match_product_dfu < 0 || s->match_product_dfu == desc->idProduct);
+	if (!runtime_ok && !dfu_ok)
+		return 0;
+
+	if (s->match_devnum >= 0 && s->match_devnum != libusb_get_device_address(dev))
+		return 0;
+
+	return 1;
+}
+
+static void probe_configuration(struct dfu_session *s, libusb_context *ctx,
+				libusb_device *dev,
+				struct libusb_device_descriptor *desc)
+{
+	struct usb_dfu_func_descriptor func_dfu;
+	struct dfu_desc_cache *dc;
 	struct dfu_if *pdfu;
 	struct libusb_config_descriptor *cfg;
 	const struct libusb_interface_descriptor *intf;
@@ -171,6 +426,8 @@ static void probe_configuration(libusb_device *dev, struct libusb_device_descrip
 	int ret;
 	int has_dfu;
 
+	dc = desc_cache_get(s, dev, desc);
+
 	for (cfg_idx = 0; cfg_idx != desc->bNumConfigurations; cfg_idx++) {
 		memset(&func_dfu, 0, sizeof(func_dfu));
 		has_dfu = 0;
@@ -178,7 +435,7 @@ static void probe_configuration(libusb_device *dev, struct libusb_device_descrip
 		ret = libusb_get_config_descriptor(dev, cfg_idx, &cfg);
 		if (ret != 0)
 			return;
-		if (match_config_index > -1 && match_config_index != cfg->bConfigurationValue) {
+		if (s->match_config_index > -1 && s->match_config_index != cfg->bConfigurationValue) {
 			libusb_free_config_descriptor(cfg);
 			continue;
 		}
@@ -214,7 +471,9 @@ static void probe_configuration(libusb_device *dev, struct libusb_device_descrip
 				if (ret > -1)
 					goto found_dfu;
 
-				has_dfu = 1;
+				/* no need to ask an interface we will skip anyway */
+				if (s->match_iface_index < 0 || s->match_iface_index == intf_idx)
+					has_dfu = 1;
 			}
 		}
 		if (has_dfu) {
@@ -223,13 +482,8 @@ static void probe_configuration(libusb_device *dev, struct libusb_device_descrip
 			 * device directly This is not supported on
 			 * all devices for non-standard types
 			 */
-			if (libusb_open(dev, &devh) == 0) {
-				ret = libusb_get_descriptor(devh, USB_DT_DFU, 0,
-				    (void *)&func_dfu, sizeof(func_dfu));
-				libusb_close(devh);
-				if (ret > -1)
-					goto found_dfu;
-			}
+			if (desc_cache_func_dfu(dc, dev, &func_dfu) > -1)
+				goto found_dfu;
 			warnx("Device has DFU interface, "
 			    "but has no DFU functional descriptor");
 
@@ -259,7 +513,7 @@ found_dfu:
 		     intf_idx++) {
 			int multiple_alt;
 
-			if (match_iface_index > -1 && match_iface_index != intf_idx)
+			if (s->match_iface_index > -1 && s->match_iface_index != intf_idx)
 				continue;
 
 			uif = &cfg->interface[intf_idx];
@@ -300,25 +554,22 @@ found_dfu:
 					dfu_mode = 1;
 
 				if (dfu_mode &&
-				    match_iface_alt_index > -1 && match_iface_alt_index != intf->bAlternateSetting)
+				    s->match_iface_alt_index > -1 && s->match_iface_alt_index != intf->bAlternateSetting)
 					continue;
 
 				if (dfu_mode) {
-					if ((match_vendor_dfu >= 0 && match_vendor_dfu != desc->idVendor) ||
-					    (match_product_dfu >= 0 && match_product_dfu != desc->idProduct)) {
+					if ((s->match_vendor_dfu >= 0 && s->match_vendor_dfu != desc->idVendor) ||
+					    (s->match_product_dfu >= 0 && s->match_product_dfu != desc->idProduct)) {
 						continue;
 					}
 				} else {
-					if ((match_vendor >= 0 && match_vendor != desc->idVendor) ||
-					    (match_product >= 0 && match_product != desc->idProduct)) {
+					if ((s->match_vendor >= 0 && s->match_vendor != desc->idVendor) ||
+					    (s->match_product >= 0 && s->match_product != desc->idProduct)) {
 						continue;
 					}
 				}
 
-				if (match_devnum >= 0 && match_devnum != libusb_get_device_address(dev))
-					continue;
-
-				ret = libusb_open(dev, &devh);
+				ret = desc_cache_read_strings(dc, dev, desc);
 				if (ret) {
 					warnx("Cannot open DFU device %04x:%04x found on devnum %i (%s)",
 					      desc->idVendor, desc->idProduct, libusb_get_device_address(dev),
@@ -326,7 +577,7 @@ found_dfu:
 					break;
 				}
 				if (intf->iInterface != 0)
-					ret = get_string_descriptor_ascii(devh,
+					ret = desc_cache_string_ascii(dc,
 					    intf->iInterface, (void *)alt_name, MAX_DESC_STR_LEN);
 				else
 					ret = -1;
@@ -334,12 +585,17 @@ found_dfu:
 					strcpy(alt_name, "UNKNOWN");
 				if (desc->iSerialNumber != 0) {
 					if (quirks & QUIRK_UTF8_SERIAL) {
-						ret = get_utf8_string_descriptor(devh, desc->iSerialNumber,
-						    (void *)serial_name, MAX_DESC_STR_LEN - 1);
-						if (ret >= 0)
+						const unsigned char *raw = NULL;
+
+						ret = desc_cache_string(dc, desc->iSerialNumber, &raw);
+						if (ret > MAX_DESC_STR_LEN - 1)
+							ret = MAX_DESC_STR_LEN - 1;
+						if (ret >= 0) {
+							memcpy(serial_name, raw, ret);
 							serial_name[ret] = '\0';
+						}
 					} else {
-						ret = get_string_descriptor_ascii(devh, desc->iSerialNumber,
+						ret = desc_cache_string_ascii(dc, desc->iSerialNumber,
 						    (void *)serial_name, MAX_DESC_STR_LEN);
 					}
 				} else {
@@ -347,17 +603,16 @@ found_dfu:
 				}
 				if (ret < 1)
 					strcpy(serial_name, "UNKNOWN");
-				libusb_close(devh);
 
 				if (dfu_mode &&
-				    match_iface_alt_name != NULL && strcmp(alt_name, match_iface_alt_name))
+				    s->match_iface_alt_name != NULL && strcmp(alt_name, s->match_iface_alt_name))
 					continue;
 
 				if (dfu_mode) {
-					if (match_serial_dfu != NULL && strcmp(match_serial_dfu, serial_name))
+					if (s->match_serial_dfu != NULL && strcmp(s->match_serial_dfu, serial_name))
 						continue;
 				} else {
-					if (match_serial != NULL && strcmp(match_serial, serial_name))
+					if (s->match_serial != NULL && strcmp(s->match_serial, serial_name))
 						continue;
 				}
 
@@ -367,6 +622,9 @@ found_dfu:
 
 				pdfu->func_dfu = func_dfu;
 				pdfu->dev = libusb_ref_device(dev);
+				pdfu->transport = &dfu_libusb_transport;
+				pdfu->transport_data = ctx;
+				pdfu->session = s;
 				pdfu->quirks = quirks;
 				pdfu->vendor = desc->idVendor;
 				pdfu->product = desc->idProduct;
@@ -393,74 +651,209 @@ found_dfu:
 				pdfu->bMaxPacketSize0 = desc->bMaxPacketSize0;
 
 				/* queue into list */
-				pdfu->next = dfu_root;
-				dfu_root = pdfu;
+				pdfu->next = s->dfu_root;
+				s->dfu_root = pdfu;
 			}
 		}
 		libusb_free_config_descriptor(cfg);
 	}
 }
 
-#define MAX_PATH_LEN 20
-char path_buf[MAX_PATH_LEN];
-
-char *get_path(libusb_device *dev)
+char *get_path(struct dfu_session *s, libusb_device *dev)
 {
 #if (defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102) || (defined(LIBUSBX_API_VERSION) && LIBUSBX_API_VERSION >= 0x01000102)
 	uint8_t path[8];
 	int r,j;
 	r = libusb_get_port_numbers(dev, path, sizeof(path));
 	if (r > 0) {
-		sprintf(path_buf,"%d-%d",libusb_get_bus_number(dev),path[0]);
+		sprintf(s->path_buf,"%d-%d",libusb_get_bus_number(dev),path[0]);
 		for (j = 1; j < r; j++){
-			sprintf(path_buf+strlen(path_buf),".%d",path[j]);
+			sprintf(s->path_buf+strlen(s->path_buf),".%d",path[j]);
 		};
 	}
-	return path_buf;
+	return s->path_buf;
 #else
 # warning "libusb too old - building without USB path support!"
+	(void)s;
 	(void)dev;
 	return NULL;
 #endif
 }
 
-void probe_devices(libusb_context *ctx)
+/* The simulated devices are always in DFU mode */
+static void probe_simulated(struct dfu_session *s)
+{
+	struct dfu_if *pdfu;
+	char buf[32];
+	int dev, alt;
+
+	if ((s->match_vendor_dfu >= 0 && s->match_vendor_dfu != DFU_SIM_VENDOR) ||
+	    (s->match_product_dfu >= 0 && s->match_product_dfu != DFU_SIM_PRODUCT))
+		return;
+
+	for (dev = 0; dev < dfu_sim_num_devices(); dev++) {
+		if (s->match_serial_dfu != NULL &&
+		    strcmp(s->match_serial_dfu, dfu_sim_serial(dev, buf, sizeof(buf))))
+			continue;
+		if (s->match_path != NULL &&
+		    strcmp(s->match_path, dfu_sim_path(dev, buf, sizeof(buf))))
+			continue;
+		if (s->match_devnum >= 0 && s->match_devnum != dev + 1)
+			continue;
+
+		for (alt = 0; alt < dfu_sim_num_alts(); alt++) {
+			if (s->match_iface_alt_index > -1 && s->match_iface_alt_index != alt)
+				continue;
+			if (s->match_iface_alt_name != NULL &&
+			    strcmp(dfu_sim_alt_name(alt), s->match_iface_alt_name))
+				continue;
+
+			pdfu = dfu_sim_new_if(dev, alt);
+			pdfu->session = s;
+
+			/* queue into list */
+			pdfu->next = s->dfu_root;
+			s->dfu_root = pdfu;
+		}
+	}
+}
+
+void probe_devices(struct dfu_session *s, libusb_context *ctx)
 {
 	libusb_device **list;
 	ssize_t num_devs;
 	ssize_t i;
 
+	if (dfu_sim_num_alts()) {
+		probe_simulated(s);
+		return;
+	}
+
 	num_devs = libusb_get_device_list(ctx, &list);
 	for (i = 0; i < num_devs; ++i) {
 		struct libusb_device_descriptor desc;
 		struct libusb_device *dev = list[i];
 
-		if (match_path != NULL && strcmp(get_path(dev),match_path) != 0)
-			continue;
 		if (libusb_get_device_descriptor(dev, &desc))
 			continue;
-		probe_configuration(dev, &desc);
+		if (!match_device(s, dev, &desc))
+			continue;
+		probe_configuration(s, ctx, dev, &desc);
 	}
 	libusb_free_device_list(list, 1);
 }
 
-void disconnect_devices(void)
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+# define HAVE_LIBUSB_HOTPLUG 1
+
+static int LIBUSB_CALL wait_hotplug_cb(libusb_context *ctx, libusb_device *dev,
+				       libusb_hotplug_event event, void *user_data)
+{
+	int *arrived = user_data;
+
+	(void) ctx;
+	(void) dev;
+	(void) event;
+	*arrived = 1;
+	return 0;	/* stay registered */
+}
+#endif
+
+/*
+ * Probe until a matching device shows up, for at most timeout_ms or
+ * forever if negative. Where libusb supports hotplug, we sleep in the
+ * event handler and probe again as soon as any device arrives, with a
+ * short burst of quick probes after an arrival, since the device may
+ * not be ready (or accessible) right away. Otherwise we probe every
+ * WAIT_POLL_MS. Returns 0 if found, LIBUSB_ERROR_TIMEOUT if not.
+ */
+#define WAIT_POLL_MS 20
+#define WAIT_IDLE_MS 1000	/* re-probe now and then even with hotplug */
+#define WAIT_SETTLE_MS 500	/* quick probes after an arrival */
+
+int wait_devices(struct dfu_session *s, libusb_context *ctx, int timeout_ms)
+{
+	unsigned long long start = dfu_poll_now();
+	unsigned long long settle_until = 0;
+	int hotplug = 0;
+	int ret = 0;
+#ifdef HAVE_LIBUSB_HOTPLUG
+	libusb_hotplug_callback_handle handle;
+	int arrived = 0;
+
+	/* registered before probing, so no arrival can slip through */
+	if (ctx && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+	    libusb_hotplug_register_callback(ctx,
+		    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0,
+		    LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		    LIBUSB_HOTPLUG_MATCH_ANY, wait_hotplug_cb, &arrived,
+		    &handle) == LIBUSB_SUCCESS)
+		hotplug = 1;
+#endif
+
+	while (1) {
+		unsigned long long now;
+		unsigned int wait;
+
+		probe_devices(s, ctx);
+		if (s->dfu_root != NULL)
+			break;
+
+		now = dfu_poll_now();
+		if (timeout_ms >= 0 && now - start >= timeout_ms * 1000ULL) {
+			ret = LIBUSB_ERROR_TIMEOUT;
+			break;
+		}
+		wait = (hotplug && now >= settle_until) ? WAIT_IDLE_MS : WAIT_POLL_MS;
+		if (timeout_ms >= 0 &&
+		    start + timeout_ms * 1000ULL - now < wait * 1000ULL)
+			wait = (start + timeout_ms * 1000ULL - now + 999) / 1000;
+
+#ifdef HAVE_LIBUSB_HOTPLUG
+		if (hotplug) {
+			struct timeval tv;
+
+			tv.tv_sec = wait / 1000;
+			tv.tv_usec = (wait % 1000) * 1000;
+			arrived = 0;
+			libusb_handle_events_timeout_completed(ctx, &tv, &arrived);
+			if (arrived)
+				settle_until = dfu_poll_now() + WAIT_SETTLE_MS * 1000ULL;
+			continue;
+		}
+#endif
+		milli_sleep(wait);
+	}
+
+#ifdef HAVE_LIBUSB_HOTPLUG
+	if (hotplug)
+		libusb_hotplug_deregister_callback(ctx, handle);
+#endif
+	if (verbose > 1 && ret == 0)
+		_PRINTF("Device found after %llu ms%s\n",
+			(dfu_poll_now() - start) / 1000,
+			hotplug ? " (hotplug)" : "");
+	return ret;
+}
+
+void disconnect_devices(struct dfu_session *s)
 {
 	struct dfu_if *pdfu;
 	struct dfu_if *prev = NULL;
 
-	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next) {
+	for (pdfu = s->dfu_root; pdfu != NULL; pdfu = pdfu->next) {
 		free(prev);
 		libusb_unref_device(pdfu->dev);
 		free(pdfu->alt_name);
 		free(pdfu->serial_name);
+		free_memory_layout(pdfu->mem_layout);
 		prev = pdfu;
 	}
 	free(prev);
-	dfu_root = NULL;
+	s->dfu_root = NULL;
 }
 
-void print_dfu_if(struct dfu_if *dfu_if)
+void print_dfu_if(struct dfu_session *s, struct dfu_if *dfu_if)
 {
 	_PRINTF("Found %s: [%04x:%04x] ver=%04x, devnum=%u, cfg=%u, intf=%u, "
 	       "path=\"%s\", alt=%u, name=\"%s\", serial=\"%s\"\n",
@@ -468,16 +861,40 @@ void print_dfu_if(struct dfu_if *dfu_if)
 	       dfu_if->vendor, dfu_if->product,
 	       dfu_if->bcdDevice, dfu_if->devnum,
 	       dfu_if->configuration, dfu_if->interface,
-	       get_path(dfu_if->dev),
+	       dfu_if->dev ? get_path(s, dfu_if->dev) :
+	       dfu_sim_path(dfu_if->devnum - 1, s->path_buf, sizeof(s->path_buf)),
 	       dfu_if->altsetting, dfu_if->alt_name,
 	       dfu_if->serial_name);
 }
 
 /* Walk the device tree and print out DFU devices */
-void list_dfu_interfaces(void)
+void list_dfu_interfaces(struct dfu_session *s)
 {
 	struct dfu_if *pdfu;
 
-	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next)
-		print_dfu_if(pdfu);
+	for (pdfu = s->dfu_root; pdfu != NULL; pdfu = pdfu->next)
+		print_dfu_if(s, pdfu);
+}
+
+void dfu_session_init(struct dfu_session *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->match_vendor = -1;
+	s->match_product = -1;
+	s->match_vendor_dfu = -1;
+	s->match_product_dfu = -1;
+	s->match_config_index = -1;
+	s->match_iface_index = -1;
+	s->match_iface_alt_index = -1;
+	s->match_devnum = -1;
+	s->mode = MODE_NONE;
+	s->timeout = 5000;	/* 5 seconds - default */
+}
+
+void dfu_session_exit(struct dfu_session *s)
+{
+	dfu_preload_drop(s);
+	dfu_free_file(&s->file);
+	free_desc_cache(s);
+	dfu_ledger_free(&s->ledger);
 }
@@ -5,32 +5,13 @@
  * but 254 would even accommodate a UTF-8 encoding + NUL terminator */
 #define MAX_DESC_STR_LEN 254
 
-enum mode {
-	MODE_NONE,
-	MODE_VERSION,
-	MODE_LIST,
-	MODE_DETACH,
-	MODE_UPLOAD,
-	MODE_DOWNLOAD
-};
+#include "dfu_session.h"
 
-extern struct dfu_if *dfu_root;
-extern char *match_path;
-extern int match_vendor;
-extern int match_product;
-extern int match_vendor_dfu;
-extern int match_product_dfu;
-extern int match_config_index;
-extern int match_iface_index;
-extern int match_iface_alt_index;
-extern int match_devnum;
-extern const char *match_iface_alt_name;
-extern const char *match_serial;
-extern const char *match_serial_dfu;
-
-void probe_devices(libusb_context *);
-void disconnect_devices(void);
-void print_dfu_if(struct dfu_if *);
-void list_dfu_interfaces(void);
+void probe_devices(struct dfu_session *, libusb_context *);
+int wait_devices(struct dfu_session *, libusb_context *, int timeout_ms);
+void disconnect_devices(struct dfu_session *);
+char *get_path(struct dfu_session *, libusb_device *);
+void print_dfu_if(struct dfu_session *, struct dfu_if *);
+void list_dfu_interfaces(struct dfu_session *);
 
 #endif /* DFU_UTIL_H */
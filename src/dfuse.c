@@ -37,27 +37,19 @@
 #include "dfu_file.h"
 #include "dfuse.h"
 #include "dfuse_mem.h"
+#include "dfuse_erase.h"
+#include "dfu_poll.h"
+#include "dfu_session.h"
 #include "quirks.h"
 
-#define DFU_TIMEOUT 5000
-
 extern int verbose;
-static unsigned int last_erased_page = 1; /* non-aligned value, won't match */
-static unsigned int dfuse_address = 0;
-static unsigned int dfuse_address_present = 0;
-static unsigned int dfuse_length = 0;
-static int dfuse_force = 0;
-static int dfuse_leave = 0;
-static int dfuse_unprotect = 0;
-static int dfuse_mass_erase = 0;
-static int dfuse_will_reset = 0;
 
 static unsigned int quad2uint(unsigned char *p)
 {
 	return (*p + (*(p + 1) << 8) + (*(p + 2) << 16) + (*(p + 3) << 24));
 }
 
-static void dfuse_parse_options(const char *options)
+static void dfuse_parse_options(struct dfu_session *s, const char *options)
 {
 	char *end;
 	const char *endword;
@@ -71,8 +63,8 @@ static void dfuse_parse_options(const char *options)
 
 		number = strtoul(options, &end, 0);
 		if (end == endword) {
-			dfuse_address = number;
-			dfuse_address_present = 1;
+			s->dfuse.address = number;
+			s->dfuse.address_present = 1;
 		} else {
 			errx(EX_USAGE, "Invalid dfuse address: %s", options);
 		}
@@ -89,35 +81,65 @@ static void dfuse_parse_options(const char *options)
 			endword = options + strlen(options);
 
 		if (!strncmp(options, "force", endword - options)) {
-			dfuse_force++;
+			s->dfuse.force++;
 			options += 5;
 			continue;
 		}
 		if (!strncmp(options, "leave", endword - options)) {
-			dfuse_leave = 1;
+			s->dfuse.leave = 1;
 			options += 5;
 			continue;
 		}
 		if (!strncmp(options, "unprotect", endword - options)) {
-			dfuse_unprotect = 1;
+			s->dfuse.unprotect = 1;
 			options += 9;
 			continue;
 		}
 		if (!strncmp(options, "mass-erase", endword - options)) {
-			dfuse_mass_erase = 1;
+			s->dfuse.mass_erase = 1;
 			options += 10;
 			continue;
 		}
 		if (!strncmp(options, "will-reset", endword - options)) {
-			dfuse_will_reset = 1;
+			s->dfuse.will_reset = 1;
+			options += 10;
+			continue;
+		}
+		if (!strncmp(options, "allow-mass-erase", endword - options)) {
+			s->dfuse.allow_mass_erase = 1;
+			options += 16;
+			continue;
+		}
+		if (!strncmp(options, "blank-check", endword - options)) {
+			s->dfuse.blank_check = 1;
+			options += 11;
+			continue;
+		}
+		if (!strncmp(options, "sparse", endword - options)) {
+			s->dfuse.sparse = 1;
+			options += 6;
+			continue;
+		}
+		if (!strncmp(options, "spot-check", endword - options)) {
+			s->dfuse.spot_check = 1;
 			options += 10;
 			continue;
 		}
+		if (!strncmp(options, "delta", endword - options)) {
+			s->dfuse.delta = 1;
+			options += 5;
+			continue;
+		}
+		if (!strncmp(options, "dry-run", endword - options)) {
+			s->dfuse.dry_run = 1;
+			options += 7;
+			continue;
+		}
 
 		/* any valid number is interpreted as upload length */
 		number = strtoul(options, &end, 0);
 		if (end == endword) {
-			dfuse_length = number;
+			s->dfuse.length = number;
 		} else {
 			errx(EX_USAGE, "Invalid dfuse modifier: %s", options);
 		}
@@ -125,24 +147,30 @@ static void dfuse_parse_options(const char *options)
 	}
 }
 
+/*
+ * The memory layout of an alternate setting, parsed from its name the
+ * first time it is needed and kept with the interface until the device
+ * is disconnected. Returns NULL if it can't be parsed.
+ */
+static struct memlayout *dfuse_memory_layout(struct dfu_if *dif)
+{
+	if (dif->mem_layout == NULL) {
+		dif->mem_layout = parse_memory_layout(dif->alt_name);
+		if (dif->mem_layout && (dif->quirks & QUIRK_DFUSE_LAYOUT))
+			fixup_dfuse_layout(dif, dif->mem_layout);
+	}
+	return dif->mem_layout;
+}
+
 /* DFU_UPLOAD request for DfuSe 1.1a */
 static int dfuse_upload(struct dfu_if *dif, const unsigned short length,
 		 unsigned char *data, unsigned short transaction)
 {
 	int status;
 
-	status = libusb_control_transfer(dif->dev_handle,
-		 /* bmRequestType */	 LIBUSB_ENDPOINT_IN |
-					 LIBUSB_REQUEST_TYPE_CLASS |
-					 LIBUSB_RECIPIENT_INTERFACE,
-		 /* bRequest      */	 DFU_UPLOAD,
-		 /* wValue        */	 transaction,
-		 /* wIndex        */	 dif->interface,
-		 /* Data          */	 data,
-		 /* wLength       */	 length,
-					 DFU_TIMEOUT);
+	status = dfu_upload(dif, length, transaction, data);
 	if (status < 0) {
-		warnx("dfuse_upload: libusb_control_transfer returned %d (%s)",
+		warnx("dfuse_upload: control transfer returned %d (%s)",
 		      status, libusb_error_name(status));
 	}
 	return status;
@@ -154,21 +182,12 @@ static int dfuse_download(struct dfu_if *dif, const unsigned short length,
 {
 	int status;
 
-	status = libusb_control_transfer(dif->dev_handle,
-		 /* bmRequestType */	 LIBUSB_ENDPOINT_OUT |
-					 LIBUSB_REQUEST_TYPE_CLASS |
-					 LIBUSB_RECIPIENT_INTERFACE,
-		 /* bRequest      */	 DFU_DNLOAD,
-		 /* wValue        */	 transaction,
-		 /* wIndex        */	 dif->interface,
-		 /* Data          */	 data,
-		 /* wLength       */	 length,
-					 DFU_TIMEOUT);
+	status = dfu_download(dif, length, transaction, data);
 	if (status < 0) {
 		/* Silently fail on leave request on some unpredictable devices */
 		if ((dif->quirks & QUIRK_DFUSE_LEAVE) && !length && !data && transaction == 2)
 			return status;
-		warnx("dfuse_download: libusb_control_transfer returned %d (%s)",
+		warnx("dfuse_download: control transfer returned %d (%s)",
 		      status, libusb_error_name(status));
 	}
 	return status;
@@ -176,8 +195,8 @@ static int dfuse_download(struct dfu_if *dif, const unsigned short length,
 
 /* DfuSe only commands */
 /* Leaves the device in dfuDNLOAD-IDLE state */
-static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
-			  enum dfuse_command command)
+static int dfuse_special_command(struct dfu_session *s, struct dfu_if *dif,
+			  unsigned int address, enum dfuse_command command)
 {
 	const char* dfuse_command_name[] = { "SET_ADDRESS" , "ERASE_PAGE",
 					     "MASS_ERASE", "READ_UNPROTECT"};
@@ -189,15 +208,17 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 	int zerotimeouts = 0;
 	int polltimeout = 0;
 	int stalls = 0;
+	unsigned int wait;
+	struct dfu_poll_busy busy;
+	int page_size = 0;
 
 	if (command == ERASE_PAGE) {
 		struct memsegment *segment;
-		int page_size;
 
 		segment = find_segment(dif->mem_layout, address);
 		if (!segment || !(segment->memtype & DFUSE_ERASABLE)) {
-			errx(EX_USAGE, "Page at 0x%08x can not be erased",
-				address);
+			warnx("Page at 0x%08x can not be erased", address);
+			return -1;
 		}
 		page_size = segment->pagesize;
 		if (verbose)
@@ -206,7 +227,6 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 			       address & ~(page_size - 1));
 		buf[0] = 0x41;	/* Erase command */
 		length = 5;
-		last_erased_page = address & ~(page_size - 1);
 	} else if (command == SET_ADDRESS) {
 		if (verbose > 1)
 			_FPRINTF(stderr, "  Setting address pointer to 0x%08x\n",
@@ -229,21 +249,39 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 
 	ret = dfuse_download(dif, length, buf, 0);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error during special command \"%s\" download",
-			dfuse_command_name[command]);
+		warnx("Error during special command \"%s\" download",
+		      dfuse_command_name[command]);
+		return ret;
 	}
+	if (command == SET_ADDRESS)
+		dfu_poll_busy_init(&busy, s, DFU_POLL_SET_ADDRESS);
+	else if (command == ERASE_PAGE) {
+		dfu_poll_busy_init(&busy, s, DFU_POLL_ERASE_PAGE);
+		/* erasing takes longer the larger the page */
+		dfu_poll_busy_scale(&busy, (page_size + 1023) / 1024);
+	} else
+		dfu_poll_busy_init(&busy, s, DFU_POLL_MASS_ERASE);
+
 	do {
 		ret = dfu_get_status(dif, &dst);
+		if (ret == LIBUSB_ERROR_PIPE && dfu_poll_busy_early(&busy)) {
+			/* polled ahead of the reported timeout */
+			dst.bState = DFU_STATE_dfuDNBUSY;
+			dfu_poll_busy_stall(&busy);
+			if (verbose > 1)
+				_FPRINTF(stderr, "* Device stalled USB pipe while busy\n");
 		/* Workaround for some STM32L4 bootloaders that report a too
 		 * short poll timeout and may stall the pipe when we poll */
-		if (ret == LIBUSB_ERROR_PIPE && polltimeout != 0 && stalls < 3) {
+		} else if (ret == LIBUSB_ERROR_PIPE && polltimeout != 0 && stalls < 3) {
 			dst.bState = DFU_STATE_dfuDNBUSY;
 			stalls++;
+			dfu_poll_busy_stall(&busy);
 			if (verbose)
 				_FPRINTF(stderr, "* Device stalled USB pipe, reusing last poll timeout\n");
 		} else if (ret < 0) {
-			errx(EX_IOERR, "Error during special command \"%s\" get_status",
-			     dfuse_command_name[command]);
+			warnx("Error during special command \"%s\" get_status",
+			      dfuse_command_name[command]);
+			return ret;
 		} else {
 			polltimeout = dst.bwPollTimeout;
 		}
@@ -253,8 +291,9 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 				_FPRINTF(stderr, "DFU state(%u) = %s, status(%u) = %s\n", dst.bState,
 				       dfu_state_to_string(dst.bState), dst.bStatus,
 				       dfu_status_to_string(dst.bStatus));
-				errx(EX_PROTOCOL, "Wrong state after command \"%s\" download",
-				     dfuse_command_name[command]);
+				warnx("Wrong state after command \"%s\" download",
+				      dfuse_command_name[command]);
+				return -1;
 			}
 			/* STM32F405 lies about mass erase timeout */
 			if (command == MASS_ERASE && dst.bwPollTimeout == 100) {
@@ -263,53 +302,71 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 			}
 		}
 		/* wait while command is executed */
+		if (dst.bState == DFU_STATE_dfuDNBUSY && command != READ_UNPROTECT)
+			wait = dfu_poll_busy_next(&busy, polltimeout);
+		else
+			wait = polltimeout;
 		if (verbose > 1)
-			_FPRINTF(stderr, "   Poll timeout %i ms\n", polltimeout);
-		milli_sleep(polltimeout);
+			_FPRINTF(stderr, "   Poll timeout %i ms\n", wait);
+		dfu_poll_wait(dif, wait);
 		if (command == READ_UNPROTECT)
 			return ret;
 		/* Workaround for e.g. Black Magic Probe getting stuck */
 		if (dst.bwPollTimeout == 0) {
-			if (++zerotimeouts == 100)
-				errx(EX_IOERR, "Device stuck after special command request");
+			if (++zerotimeouts == 100) {
+				warnx("Device stuck after special command request");
+				return -1;
+			}
 		} else {
 			zerotimeouts = 0;
 		}
 	} while (dst.bState == DFU_STATE_dfuDNBUSY);
+	dfu_poll_busy_done(&busy);
 
 	if (dst.bStatus != DFU_STATUS_OK) {
-		errx(EX_IOERR, "%s not correctly executed",
-			dfuse_command_name[command]);
+		warnx("%s not correctly executed",
+		      dfuse_command_name[command]);
+		return -1;
 	}
 	return ret;
 }
 
 /* returns number of bytes sent */
-static int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
-		       int transaction)
+static int dfuse_dnload_chunk(struct dfu_session *s, struct dfu_if *dif,
+		       unsigned char *data, int size, int transaction)
 {
 	int bytes_sent;
 	struct dfu_status dst;
+	struct dfu_poll_busy busy;
 	int ret;
 
 	ret = dfuse_download(dif, size, size ? data : NULL, transaction);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error during download");
+		warnx("Error during download");
 		return ret;
 	}
 	bytes_sent = ret;
 
+	dfu_poll_busy_init(&busy, s, DFU_POLL_DNLOAD);
 	do {
 		ret = dfu_get_status(dif, &dst);
-		if (ret < 0) {
-			errx(EX_IOERR, "Error during download get_status");
+		if (ret == LIBUSB_ERROR_PIPE && dfu_poll_busy_early(&busy)) {
+			/* polled ahead of the reported timeout */
+			dst.bState = DFU_STATE_dfuDNBUSY;
+			dfu_poll_busy_stall(&busy);
+		} else if (ret < 0) {
+			warnx("Error during download get_status");
 			return ret;
 		}
-		milli_sleep(dst.bwPollTimeout);
+		if (dst.bState == DFU_STATE_dfuDNBUSY && !s->dfuse.will_reset)
+			dfu_poll_wait(dif, dfu_poll_busy_next(&busy, dst.bwPollTimeout));
+		else
+			dfu_poll_wait(dif, dst.bwPollTimeout);
 	} while (dst.bState != DFU_STATE_dfuDNLOAD_IDLE &&
 		 dst.bState != DFU_STATE_dfuERROR &&
 		 dst.bState != DFU_STATE_dfuMANIFEST &&
-		 !(dfuse_will_reset && (dst.bState == DFU_STATE_dfuDNBUSY)));
+		 !(s->dfuse.will_reset && (dst.bState == DFU_STATE_dfuDNBUSY)));
+	dfu_poll_busy_done(&busy);
 
 	if (dst.bState == DFU_STATE_dfuMANIFEST)
 			_PRINTF("Transitioning to dfuMANIFEST state\n");
@@ -324,10 +381,11 @@ static int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 	return bytes_sent;
 }
 
-static void dfuse_do_leave(struct dfu_if *dif)
+static void dfuse_do_leave(struct dfu_session *s, struct dfu_if *dif)
 {
-	if (dfuse_address_present)
-		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
+	if (s->dfuse.address_present &&
+	    dfuse_special_command(s, dif, s->dfuse.address, SET_ADDRESS) < 0)
+		return;
 	_PRINTF("Submitting leave request...\n");
 	if (dif->quirks & QUIRK_DFUSE_LEAVE) {
 		struct dfu_status dst;
@@ -336,12 +394,12 @@ static void dfuse_do_leave(struct dfu_if *dif)
 		/* Or it might leave after this request, with or without a response */
 		dfu_get_status(dif, &dst);
 	} else {
-		dfuse_dnload_chunk(dif, NULL, 0, 2);
+		dfuse_dnload_chunk(s, dif, NULL, 0, 2);
 	}
 }
 
-int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
-		    const char *dfuse_options)
+int dfuse_do_upload(struct dfu_session *s, struct dfu_if *dif, int xfer_size,
+		    int fd, const char *dfuse_options)
 {
 	int total_bytes = 0;
 	int upload_limit = 0;
@@ -352,27 +410,24 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 	buf = dfu_malloc(xfer_size);
 
 	if (dfuse_options)
-		dfuse_parse_options(dfuse_options);
-	if (dfuse_length)
-		upload_limit = dfuse_length;
-	if (dfuse_address_present) {
-		struct memsegment *mem_layout, *segment;
-
-		mem_layout = parse_memory_layout((char *)dif->alt_name);
-		if (!mem_layout)
+		dfuse_parse_options(s, dfuse_options);
+	if (s->dfuse.length)
+		upload_limit = s->dfuse.length;
+	if (s->dfuse.address_present) {
+		struct memsegment *segment;
+
+		if (!dfuse_memory_layout(dif))
 			errx(EX_IOERR, "Failed to parse memory layout");
-		if (dif->quirks & QUIRK_DFUSE_LAYOUT)
-			fixup_dfuse_layout(dif, &mem_layout);
 
-		segment = find_segment(mem_layout, dfuse_address);
-		if (!dfuse_force &&
+		segment = find_segment(dif->mem_layout, s->dfuse.address);
+		if (!s->dfuse.force &&
 		    (!segment || !(segment->memtype & DFUSE_READABLE)))
 			errx(EX_USAGE, "Page at 0x%08x is not readable",
-				dfuse_address);
+				s->dfuse.address);
 
 		if (!upload_limit) {
 			if (segment) {
-				upload_limit = segment->end - dfuse_address + 1;
+				upload_limit = segment->end - s->dfuse.address + 1;
 				_PRINTF("Limiting upload to end of memory segment, "
 				       "%i bytes\n", upload_limit);
 			} else {
@@ -381,8 +436,12 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 				_PRINTF("Limiting upload to %i bytes\n", upload_limit);
 			}
 		}
-		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
-		dfu_abort_to_idle(dif);
+		if (dfuse_special_command(s, dif, s->dfuse.address,
+					  SET_ADDRESS) < 0 ||
+		    dfu_abort_to_idle(dif) < 0) {
+			ret = -1;
+			goto out_free;
+		}
 	} else {
 		/* Boot loader decides the start address, unknown to us */
 		/* Use a short length to lower risk of running out of bounds */
@@ -424,9 +483,11 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 
 	dfu_progress_bar("Upload", total_bytes, total_bytes);
 
-	dfu_abort_to_idle(dif);
-	if (dfuse_leave)
-		dfuse_do_leave(dif);
+	ret = dfu_abort_to_idle(dif);
+	if (ret < 0)
+		goto out_free;
+	if (s->dfuse.leave)
+		dfuse_do_leave(s, dif);
 
  out_free:
 	free(buf);
@@ -434,90 +495,95 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 	return ret;
 }
 
-/* Writes an element of any size to the device, taking care of page erases */
+/*
+ * DfuSe devices write block wBlockNum to the address pointer plus
+ * (wBlockNum - 2) * wTransferSize, so a contiguous run of blocks only
+ * needs one SET_ADDRESS. This requires that we send blocks of exactly
+ * the transfer size of the device.
+ */
+static int dfuse_can_stream_blocks(struct dfu_if *dif, int xfer_size)
+{
+	if (dif->quirks & QUIRK_DFUSE_SET_ADDRESS)
+		return 0;
+	return xfer_size == libusb_le16_to_cpu(dif->func_dfu.wTransferSize);
+}
+
+/* Checks that all bytes are 0xff, four words at a time */
+static int dfuse_is_blank(const unsigned char *buf, unsigned int size)
+{
+	unsigned long w[4];
+	unsigned int i = 0;
+
+	/* memcpy() keeps this alignment and aliasing safe, and compiles
+	 * to plain loads */
+	for (; size - i >= sizeof(w); i += sizeof(w)) {
+		memcpy(w, buf + i, sizeof(w));
+		if ((w[0] & w[1] & w[2] & w[3]) != ~0UL)
+			return 0;
+	}
+	for (; i < size; i++) {
+		if (buf[i] != 0xff)
+			return 0;
+	}
+	return 1;
+}
+
+/* Writes an element of any size to the (erased) device, leaving out
+ * the pages of the plan found unchanged and, in sparse mode, blank
+ * chunks going to pages erased before. Chunks are aligned to the
+ * transfer size, so that an element starting mid-block only has a
+ * short first chunk and none of them straddles a page boundary. */
 /* returns 0 on success, otherwise -EINVAL */
-static int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddress,
+static int dfuse_dnload_element(struct dfu_session *s, struct dfu_if *dif,
+			 unsigned int dwElementAddress,
 			 unsigned int dwElementSize, unsigned char *data,
-			 int xfer_size)
+			 int xfer_size, struct dfuse_erase_plan *plan)
 {
 	int p;
 	int ret;
-	struct memsegment *segment;
-
-	/* Check at least that we can write to the last address */
-	segment =
-	    find_segment(dif->mem_layout, dwElementAddress + dwElementSize - 1);
-	if (!dfuse_force &&
-            (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
-		errx(EX_USAGE, "Last page at 0x%08x is not writeable",
-			dwElementAddress + dwElementSize - 1);
-	}
+	int stream;
+	unsigned short transaction;
 
 	if (!verbose)
-		dfu_progress_bar("Erase   ", 0, 1);
+		dfu_progress_bar("Download", 0, 1);
 
-	/* First pass: Erase involved pages if needed */
-	for (p = 0; p < (int)dwElementSize; p += xfer_size) {
-		int page_size;
-		unsigned int erase_address;
+	stream = dfuse_can_stream_blocks(dif, xfer_size);
+	transaction = 0;	/* address pointer not set */
+	for (p = 0; p < (int)dwElementSize; ) {
 		unsigned int address = dwElementAddress + p;
 		int chunk_size = xfer_size;
+		unsigned int skip;
 
-		segment = find_segment(dif->mem_layout, address);
-		if (!dfuse_force &&
-		    (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
-			errx(EX_USAGE, "Page at 0x%08x is not writeable",
-				address);
-		}
-		/* If the location is not in the memory map we skip erasing */
-		/* since we wouldn't know the correct page size for flash erase */
-		if (!segment)
-			continue;
-
-		page_size = segment->pagesize;
-
+		/* up to the next block boundary */
+		if (address % xfer_size)
+			chunk_size = xfer_size - address % xfer_size;
 		/* check if this is the last chunk */
 		if (p + chunk_size > (int)dwElementSize)
 			chunk_size = dwElementSize - p;
 
-		/* Erase only for flash memory downloads */
-		if ((segment->memtype & DFUSE_ERASABLE) && !dfuse_mass_erase) {
-			/* erase all involved pages */
-			for (erase_address = address;
-			     erase_address < address + chunk_size;
-			     erase_address += page_size)
-				if ((erase_address & ~(page_size - 1)) !=
-				    last_erased_page)
-					dfuse_special_command(dif,
-							      erase_address,
-							      ERASE_PAGE);
-
-			if (((address + chunk_size - 1) & ~(page_size - 1)) !=
-			    last_erased_page) {
-				if (verbose > 1)
-					_FPRINTF(stderr, " Chunk extends into next page,"
-					       " erase it as well\n");
-				dfuse_special_command(dif,
-						      address + chunk_size - 1,
-						      ERASE_PAGE);
-			}
-			if (!verbose)
-				dfu_progress_bar("Erase   ", p, dwElementSize);
+		skip = dfuse_erase_plan_skip(plan, dif, address, &chunk_size);
+		if (skip) {
+			if (skip > dwElementSize - p)
+				skip = dwElementSize - p;
+			if (verbose > 1)
+				_FPRINTF(stderr, " Skipping unchanged memory "
+				       "%08x-%08x\n", address, address + skip - 1);
+			plan->skipped += skip;
+			p += skip;
+			transaction = 0;
+			continue;
+		}
+		if (s->dfuse.sparse && dfuse_is_blank(data + p, chunk_size) &&
+		    dfuse_erase_plan_erased(plan, dif, address, chunk_size)) {
+			if (verbose > 1)
+				_FPRINTF(stderr, " Skipping blank chunk "
+				       "%08x-%08x\n", address,
+				       address + chunk_size - 1);
+			plan->sparse_skipped += chunk_size;
+			p += chunk_size;
+			transaction = 0;
+			continue;
 		}
-	}
-	if (!verbose)
-		dfu_progress_bar("Erase   ", dwElementSize, dwElementSize);
-	if (!verbose)
-		dfu_progress_bar("Download", 0, 1);
-
-	/* Second pass: Write data to (erased) pages */
-	for (p = 0; p < (int)dwElementSize; p += xfer_size) {
-		unsigned int address = dwElementAddress + p;
-		int chunk_size = xfer_size;
-
-		/* check if this is the last chunk */
-		if (p + chunk_size > (int)dwElementSize)
-			chunk_size = dwElementSize - p;
 
 		if (verbose) {
 			_FPRINTF(stderr, " Download from image offset "
@@ -528,41 +594,647 @@ static int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddres
 			dfu_progress_bar("Download", p, dwElementSize);
 		}
 		
-		dfuse_special_command(dif, address, SET_ADDRESS);
+		/* start of a run of blocks */
+		if (transaction == 0) {
+			if (dfuse_special_command(s, dif, address,
+						  SET_ADDRESS) < 0)
+				return -EINVAL;
+			/* transaction = 2 for no address offset */
+			transaction = 2;
+		}
 
-		/* transaction = 2 for no address offset */
-		ret = dfuse_dnload_chunk(dif, data + p, chunk_size, 2);
+		ret = dfuse_dnload_chunk(s, dif, data + p, chunk_size,
+					 transaction);
 		if (ret != chunk_size) {
-			errx(EX_IOERR, "Failed to write whole chunk: "
-				"%i of %i bytes", ret, chunk_size);
+			warnx("Failed to write whole chunk: "
+			      "%i of %i bytes", ret, chunk_size);
 			return -EINVAL;
 		}
+
+		p += chunk_size;
+
+		/* blocks after a short one are not at their block offset */
+		if (stream && chunk_size == xfer_size && transaction < 0xffff)
+			transaction++;
+		else
+			transaction = 0;
 	}
 	if (!verbose)
 		dfu_progress_bar("Download", dwElementSize, dwElementSize);
 	return 0;
 }
 
-static void
-dfuse_memcpy(unsigned char *dst, unsigned char **src, int *rem, int size)
+/* Steps over size bytes of a DfuSe file, returns where they start or
+ * NULL if the file ends before */
+static unsigned char *
+dfuse_take(unsigned char **src, unsigned int *rem, unsigned int size)
 {
+	unsigned char *start = *src;
+
 	if (size > *rem) {
-		errx(EX_NOINPUT, "Corrupt DfuSe file: "
-		    "Cannot read %d bytes from %d bytes", size, *rem);
+		warnx("Corrupt DfuSe file: "
+		      "Cannot read %u bytes from %u bytes", size, *rem);
+		return NULL;
 	}
-	if (dst != NULL)
-		memcpy(dst, *src, size);
 	(*src) += size;
 	(*rem) -= size;
+	return start;
+}
+
+/* An element to download, pointing into the loaded file */
+struct dfuse_element {
+	struct dfu_if *dif;	/* alternate setting, NULL if missing */
+	unsigned int address;
+	unsigned int size;
+	unsigned char *data;
+	int merged;		/* data allocated for merged elements */
+};
+
+struct dfuse_element_list {
+	struct dfuse_element *elements;
+	int num_elements;
+	int alloc;
+};
+
+static void dfuse_add_element(struct dfuse_element_list *list,
+			      struct dfu_if *dif, unsigned int address,
+			      unsigned int size, unsigned char *data)
+{
+	struct dfuse_element *el;
+
+	if (list->num_elements == list->alloc) {
+		list->alloc = list->alloc ? list->alloc * 2 : 8;
+		list->elements = realloc(list->elements,
+					 list->alloc * sizeof(*list->elements));
+		if (list->elements == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	el = &list->elements[list->num_elements++];
+	el->dif = dif;
+	el->address = address;
+	el->size = size;
+	el->data = data;
+	el->merged = 0;
+}
+
+static void dfuse_free_elements(struct dfuse_element_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->num_elements; i++) {
+		if (list->elements[i].merged)
+			free(list->elements[i].data);
+	}
+	free(list->elements);
+	memset(list, 0, sizeof(*list));
+}
+
+/* Element order for merging, see dfuse_merge_elements() */
+struct dfuse_element_order {
+	int target;		/* first element of the alternate setting */
+	int index;
+	unsigned int address;
+};
+
+static int element_order_compare(const void *a, const void *b)
+{
+	const struct dfuse_element_order *oa = a;
+	const struct dfuse_element_order *ob = b;
+
+	if (oa->target != ob->target)
+		return oa->target - ob->target;
+	if (oa->address != ob->address)
+		return oa->address < ob->address ? -1 : 1;
+	return oa->index - ob->index;
+}
+
+static int element_index_compare(const void *a, const void *b)
+{
+	return ((const struct dfuse_element_order *) a)->index -
+	    ((const struct dfuse_element_order *) b)->index;
+}
+
+/*
+ * Merges the elements of an alternate setting that touch or overlap
+ * into one element each, so that they are written as one run with full
+ * transfers and no short chunk at every element boundary. The chunks of
+ * a run are aligned by dfuse_dnload_element(); gaps between elements
+ * are not filled, as that would overwrite memory the file leaves alone. Where elements
+ * overlap, the later one in the file wins. Alternate settings keep the
+ * order in which they first appear in the file, and their elements end
+ * up in address order.
+ */
+static void dfuse_merge_elements(struct dfuse_element_list *list)
+{
+	struct dfuse_element_order *order;
+	struct dfuse_element_list merged;
+	int i, j, k;
+
+	if (list->num_elements < 2)
+		return;
+
+	order = dfu_malloc(list->num_elements * sizeof(*order));
+	for (i = 0; i < list->num_elements; i++) {
+		for (j = 0; j < i; j++) {
+			if (list->elements[j].dif == list->elements[i].dif)
+				break;
+		}
+		order[i].target = j;
+		order[i].index = i;
+		order[i].address = list->elements[i].address;
+	}
+	qsort(order, list->num_elements, sizeof(*order),
+	      element_order_compare);
+
+	memset(&merged, 0, sizeof(merged));
+	for (i = 0; i < list->num_elements; i = j) {
+		struct dfuse_element *first = &list->elements[order[i].index];
+		unsigned long long end;
+		unsigned char *data;
+
+		/* the run of elements that touch or overlap */
+		end = (unsigned long long) first->address + first->size;
+		for (j = i + 1; j < list->num_elements && first->dif; j++) {
+			const struct dfuse_element *el =
+			    &list->elements[order[j].index];
+
+			if (order[j].target != order[i].target ||
+			    el->address > end)
+				break;
+			if ((unsigned long long) el->address + el->size > end)
+				end = (unsigned long long) el->address + el->size;
+		}
+		if (j == i + 1) {
+			dfuse_add_element(&merged, first->dif, first->address,
+					  first->size, first->data);
+			continue;
+		}
+
+		data = dfu_malloc(end - first->address);
+		/* in file order, so that later elements win */
+		qsort(order + i, j - i, sizeof(*order), element_index_compare);
+		for (k = i; k < j; k++) {
+			const struct dfuse_element *el =
+			    &list->elements[order[k].index];
+
+			memcpy(data + (el->address - first->address), el->data,
+			       el->size);
+		}
+		dfuse_add_element(&merged, first->dif, first->address,
+				  end - first->address, data);
+		merged.elements[merged.num_elements - 1].merged = 1;
+	}
+	free(order);
+
+	if (merged.num_elements < list->num_elements)
+		_PRINTF("Merged %i elements into %i\n", list->num_elements,
+			merged.num_elements);
+	dfuse_free_elements(list);
+	*list = merged;
+}
+
+/* Reads size bytes of memory from address, returns 0 or < 0 on error */
+static int dfuse_read_memory(struct dfu_session *s, struct dfu_if *dif,
+			     unsigned int address, unsigned char *buf,
+			     unsigned int size, int xfer_size)
+{
+	unsigned int done = 0;
+	unsigned short transaction = 0;
+	int stream;
+	int ret = 0;
+
+	stream = dfuse_can_stream_blocks(dif, xfer_size);
+	while (done < size) {
+		int chunk_size = xfer_size;
+
+		if (size - done < (unsigned int) chunk_size)
+			chunk_size = size - done;
+		if (transaction == 0) {
+			/* no DNLOAD requests in dfuUPLOAD-IDLE */
+			if ((done > 0 && dfu_abort_to_idle(dif) < 0) ||
+			    dfuse_special_command(s, dif, address + done,
+						  SET_ADDRESS) < 0 ||
+			    dfu_abort_to_idle(dif) < 0)
+				return -EIO;
+			/* transaction = 2 for no address offset */
+			transaction = 2;
+		}
+		ret = dfuse_upload(dif, chunk_size, buf + done, transaction);
+		if (ret < 0)
+			break;
+		if (ret < chunk_size) {
+			ret = -EIO;
+			break;
+		}
+		done += chunk_size;
+		ret = 0;
+		if (stream && transaction < 0xffff)
+			transaction++;
+		else
+			transaction = 0;
+	}
+	if (dfu_abort_to_idle(dif) < 0)
+		ret = -EIO;
+	return ret;
+}
+
+/*
+ * The part of page that el writes to, from *start to *end, returns 0 if
+ * there is none
+ */
+static int dfuse_page_overlap(const struct dfuse_erase_page *page,
+			      const struct dfuse_element *el,
+			      unsigned long long *start,
+			      unsigned long long *end)
+{
+	unsigned long long page_end;
+
+	if (el->dif != page->dif)
+		return 0;
+	page_end = (unsigned long long) page->address + page->size;
+	*start = el->address > page->address ? el->address : page->address;
+	*end = (unsigned long long) el->address + el->size;
+	if (*end > page_end)
+		*end = page_end;
+	return *start < *end;
+}
+
+/*
+ * Reads back the parts of page that the elements write to and tells
+ * if the device holds the same data already
+ */
+static int dfuse_page_matches(struct dfu_session *s,
+			      const struct dfuse_erase_page *page,
+			      const struct dfuse_element_list *list,
+			      int xfer_size)
+{
+	struct memsegment *segment;
+	unsigned char *buf;
+	int same = 1;
+	int e;
+
+	segment = find_segment(page->dif->mem_layout, page->address);
+	if (!segment || !(segment->memtype & DFUSE_READABLE))
+		return 0;
+
+	buf = dfu_malloc(page->size);
+	for (e = 0; e < list->num_elements && same; e++) {
+		const struct dfuse_element *el = &list->elements[e];
+		unsigned long long start, end;
+
+		if (!dfuse_page_overlap(page, el, &start, &end))
+			continue;
+		if (dfuse_read_memory(s, page->dif, start, buf, end - start,
+				      xfer_size) < 0) {
+			warnx("Cannot read back page at 0x%08x", page->address);
+			same = 0;
+		} else if (memcmp(buf, el->data + (start - el->address),
+				  end - start)) {
+			same = 0;
+		}
+	}
+	free(buf);
+	return same;
+}
+
+/*
+ * Delta mode: reads back the parts of each page of dif to be erased
+ * that the elements write to, and marks the pages that already hold
+ * the same data as unchanged, so they are neither erased nor written.
+ */
+static void dfuse_delta_check(struct dfu_session *s, struct dfu_if *dif,
+			      struct dfuse_erase_plan *plan,
+			      const struct dfuse_element_list *list,
+			      int xfer_size)
+{
+	int i;
+
+	for (i = 0; i < plan->num_pages; i++) {
+		struct dfuse_erase_page *page = &plan->pages[i];
+
+		if (page->dif != dif || page->erased || page->unchanged)
+			continue;
+		if (dfuse_page_matches(s, page, list, xfer_size)) {
+			if (verbose)
+				_FPRINTF(stderr, "Page at 0x%08x is unchanged\n",
+					 page->address);
+			page->unchanged = 1;
+		}
+	}
+}
+
+/* Hashes what the elements put into each page, for the flash ledger */
+static void dfuse_hash_pages(struct dfuse_erase_plan *plan,
+			     const struct dfuse_element_list *list)
+{
+	int i, e, b;
+
+	for (i = 0; i < plan->num_pages; i++) {
+		struct dfuse_erase_page *page = &plan->pages[i];
+		unsigned long long hash = DFU_LEDGER_HASH_INIT;
+
+		for (e = 0; e < list->num_elements; e++) {
+			const struct dfuse_element *el = &list->elements[e];
+			unsigned long long start, end;
+			unsigned char range[8];
+
+			if (!dfuse_page_overlap(page, el, &start, &end))
+				continue;
+			/* where in the page, and how much */
+			for (b = 0; b < 4; b++) {
+				range[b] = (start - page->address) >> (8 * b);
+				range[4 + b] = (end - start) >> (8 * b);
+			}
+			hash = dfu_ledger_hash(hash, range, sizeof(range));
+			hash = dfu_ledger_hash(hash,
+					       el->data + (start - el->address),
+					       end - start);
+		}
+		page->hash = hash;
+	}
+}
+
+/*
+ * Flash ledger: marks the pages of dif that the ledger says already
+ * hold the image as unchanged. With spot-check, some of them are read
+ * back, and if any differs the ledger is not trusted any further.
+ */
+#define SPOT_CHECK_INTERVAL 8
+
+static void dfuse_ledger_check(struct dfu_session *s, struct dfu_if *dif,
+			       struct dfuse_erase_plan *plan,
+			       const struct dfuse_element_list *list,
+			       int xfer_size)
+{
+	const struct dfu_ledger_page *entry;
+	int i, found = 0;
+
+	for (i = 0; i < plan->num_pages; i++) {
+		struct dfuse_erase_page *page = &plan->pages[i];
+
+		if (page->dif != dif || page->erased || page->unchanged)
+			continue;
+		entry = dfu_ledger_find(&s->ledger, dif->altsetting,
+					page->address, page->size);
+		if (entry && entry->hash == page->hash) {
+			page->unchanged = 1;
+			page->from_ledger = 1;
+			found++;
+		}
+	}
+	if (!s->dfuse.spot_check || found == 0)
+		return;
+
+	for (i = 0, found = 0; i < plan->num_pages; i++) {
+		struct dfuse_erase_page *page = &plan->pages[i];
+
+		if (page->dif != dif || !page->from_ledger ||
+		    found++ % SPOT_CHECK_INTERVAL)
+			continue;
+		if (verbose)
+			_FPRINTF(stderr, "Spot checking page at 0x%08x\n",
+				 page->address);
+		page->unchanged = 0;
+		if (dfuse_page_matches(s, page, list, xfer_size)) {
+			page->unchanged = 1;
+			continue;
+		}
+		warnx("Page at 0x%08x does not match the flash ledger, "
+		      "not using it", page->address);
+		for (i = 0; i < plan->num_pages; i++) {
+			if (plan->pages[i].from_ledger) {
+				plan->pages[i].unchanged = 0;
+				plan->pages[i].from_ledger = 0;
+			}
+		}
+		dfu_ledger_free(&s->ledger);
+		s->ledger.loaded = 1;
+		return;
+	}
+}
+
+/*
+ * Blank check: reads a page before erasing it, in slices so that a page
+ * with data is given up on early, and tells if it is erased already.
+ * The check is dropped once its reads took longer than the erases they
+ * saved.
+ */
+#define BLANK_CHECK_SLICE_BLOCKS 4
+#define BLANK_CHECK_MIN_PAGES 4
+
+static int dfuse_page_is_blank(struct dfu_session *s, struct dfu_if *dif,
+			       struct dfuse_erase_plan *plan,
+			       const struct dfuse_erase_page *page,
+			       int xfer_size)
+{
+	struct memsegment *segment;
+	unsigned long long start;
+	unsigned char *buf;
+	unsigned int slice, done;
+	int blank = 1;
+
+	if (!plan->blank_check)
+		return 0;
+	segment = find_segment(dif->mem_layout, page->address);
+	if (!segment || !(segment->memtype & DFUSE_READABLE))
+		return 0;
+
+	start = dfu_poll_now();
+	slice = xfer_size * BLANK_CHECK_SLICE_BLOCKS;
+	buf = dfu_malloc(slice);
+	for (done = 0; done < page->size && blank; done += slice) {
+		if (page->size - done < slice)
+			slice = page->size - done;
+		if (dfuse_read_memory(s, dif, page->address + done, buf, slice,
+				      xfer_size) < 0 ||
+		    !dfuse_is_blank(buf, slice))
+			blank = 0;
+	}
+	free(buf);
+
+	plan->blank_checked++;
+	plan->blank_read_us += dfu_poll_now() - start;
+	if (blank) {
+		plan->blank_found++;
+		plan->blank_saved_us += dfuse_erase_page_cost(page,
+							     &s->poll_profile);
+	}
+	if (plan->blank_checked >= BLANK_CHECK_MIN_PAGES &&
+	    plan->blank_read_us > plan->blank_saved_us) {
+		if (verbose)
+			_FPRINTF(stderr, "Blank check takes longer than the "
+				 "erases it saves, stopping it\n");
+		plan->blank_check = 0;
+	}
+	return blank;
+}
+
+/* Erases the pages of the plan that are in the memory of dif,
+ * returns 0 or < 0 on error */
+static int dfuse_erase_pages(struct dfu_session *s, struct dfu_if *dif,
+			     struct dfuse_erase_plan *plan, int xfer_size)
+{
+	int i, done, total;
+
+	if (plan->mass_erase == dif) {
+		_PRINTF("Performing mass erase, this can take a moment\n");
+		if (dfuse_special_command(s, dif, 0, MASS_ERASE) < 0)
+			return -1;
+		for (i = 0; i < plan->num_pages; i++)
+			plan->pages[i].erased = 1;
+		plan->mass_erase = NULL;
+		return 0;
+	}
+
+	total = 0;
+	for (i = 0; i < plan->num_pages; i++) {
+		if (plan->pages[i].dif == dif && !plan->pages[i].erased &&
+		    !plan->pages[i].unchanged)
+			total++;
+	}
+	if (total == 0)
+		return 0;
+
+	if (!verbose)
+		dfu_progress_bar("Erase   ", 0, 1);
+	for (i = 0, done = 0; i < plan->num_pages; i++) {
+		struct dfuse_erase_page *page = &plan->pages[i];
+
+		if (page->dif != dif || page->erased || page->unchanged)
+			continue;
+		if (dfuse_page_is_blank(s, dif, plan, page, xfer_size)) {
+			if (verbose)
+				_FPRINTF(stderr, "Page at 0x%08x is blank\n",
+					 page->address);
+		} else if (dfuse_special_command(s, dif, page->address,
+						 ERASE_PAGE) < 0) {
+			return -1;
+		}
+		page->erased = 1;
+		if (!verbose)
+			dfu_progress_bar("Erase   ", ++done, total);
+	}
+	return 0;
+}
+
+/*
+ * Downloads all elements: the pages to erase are planned for the whole
+ * download first, then for each alternate setting in turn its pages
+ * are erased and its elements written. Elements of a missing alternate
+ * setting are skipped. active is the alternate setting that is already
+ * selected, or NULL.
+ */
+static int dfuse_dnload_elements(struct dfu_session *s, struct dfu_if *dif,
+				 struct dfu_if *active,
+				 struct dfuse_element_list *list,
+				 int xfer_size)
+{
+	struct dfuse_erase_plan plan;
+	struct dfuse_element *el;
+	int i;
+	int ret = 0;
+
+	dfuse_erase_plan_init(&plan);
+	for (i = 0; i < list->num_elements; i++) {
+		el = &list->elements[i];
+		if (el->dif && dfuse_erase_plan_add(&plan, el->dif, el->address,
+						    el->size, s->dfuse.force) < 0) {
+			dfuse_erase_plan_free(&plan);
+			return -1;
+		}
+	}
+	dfuse_erase_plan_finish(&plan);
+	plan.blank_check = s->dfuse.blank_check;
+	if (s->dfuse.mass_erase) {
+		/* a mass erase has taken care of everything */
+		for (i = 0; i < plan.num_pages; i++)
+			plan.pages[i].erased = 1;
+	} else if (s->dfuse.allow_mass_erase && !s->dfuse.delta &&
+		   s->ledger.num_pages == 0) {
+		dfuse_erase_plan_choose(&plan, &s->poll_profile);
+	}
+	if (s->ledger.loaded)
+		dfuse_hash_pages(&plan, list);
+	if ((verbose || s->dfuse.dry_run) && !s->dfuse.mass_erase)
+		dfuse_erase_plan_print(&plan);
+	if (s->dfuse.dry_run) {
+		_PRINTF("Dry run, not erasing or writing anything\n");
+		dfuse_erase_plan_free(&plan);
+		return 0;
+	}
+
+	for (i = 0; i < list->num_elements; i++) {
+		el = &list->elements[i];
+		if (!el->dif)
+			continue;
+		if (el->dif != active) {
+			active = el->dif;
+			active->dev_handle = dif->dev_handle;
+			_PRINTF("Setting Alternate Interface #%d ...\n",
+			       active->altsetting);
+			ret = dfu_set_alt_setting(active, active->altsetting);
+			if (ret < 0) {
+				warnx("Cannot set alternate interface: %s",
+				      libusb_error_name(ret));
+				break;
+			}
+		}
+		/* delta reads every page back, the ledger is not trusted */
+		if (s->dfuse.delta)
+			dfuse_delta_check(s, active, &plan, list, xfer_size);
+		else if (s->ledger.num_pages > 0)
+			dfuse_ledger_check(s, active, &plan, list, xfer_size);
+		ret = dfuse_erase_pages(s, active, &plan, xfer_size);
+		if (ret < 0)
+			break;
+		ret = dfuse_dnload_element(s, active, el->address, el->size,
+					   el->data, xfer_size, &plan);
+		if (ret != 0)
+			break;
+	}
+	if (s->dfuse.sparse)
+		_PRINTF("Sparse: %llu blank bytes not sent\n",
+			plan.sparse_skipped);
+	if (s->dfuse.blank_check)
+		_PRINTF("Blank check: %i of %i pages read were blank\n",
+			plan.blank_found, plan.blank_checked);
+	if (s->dfuse.delta) {
+		int unchanged = 0;
+
+		for (i = 0; i < plan.num_pages; i++)
+			unchanged += plan.pages[i].unchanged;
+		_PRINTF("Delta: %i of %i pages unchanged, %llu bytes skipped\n",
+			unchanged, plan.num_pages, plan.skipped);
+	}
+	if (s->ledger.loaded) {
+		int unchanged = 0;
+
+		for (i = 0; i < plan.num_pages; i++) {
+			const struct dfuse_erase_page *page = &plan.pages[i];
+
+			unchanged += page->from_ledger;
+			if (ret == 0)
+				dfu_ledger_set(&s->ledger,
+					       page->dif->altsetting,
+					       page->address, page->size,
+					       page->hash);
+		}
+		_PRINTF("Flash ledger: %i of %i pages unchanged\n",
+			unchanged, plan.num_pages);
+	}
+	dfuse_erase_plan_free(&plan);
+	return ret;
 }
 
 /* Download raw binary file to DfuSe device */
-static int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
-			struct dfu_file *file, unsigned int start_address)
+static int dfuse_do_bin_dnload(struct dfu_session *s, struct dfu_if *dif,
+			int xfer_size, struct dfu_file *file,
+			unsigned int start_address)
 {
 	unsigned int dwElementAddress;
 	unsigned int dwElementSize;
 	unsigned char *data;
+	struct dfuse_element_list list;
 	int ret;
 
 	dwElementAddress = start_address;
@@ -574,206 +1246,264 @@ static int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
 
 	data = file->firmware + file->size.prefix;
 
-	ret = dfuse_dnload_element(dif, dwElementAddress, dwElementSize, data,
-				   xfer_size);
+	memset(&list, 0, sizeof(list));
+	dfuse_add_element(&list, dif, dwElementAddress, dwElementSize, data);
+	ret = dfuse_dnload_elements(s, dif, dif, &list, xfer_size);
+	dfuse_free_elements(&list);
 	if (ret == 0)
 		_PRINTF("File downloaded successfully\n");
 
 	return ret;
 }
 
-/* Parse a DfuSe file and download contents to device */
-static int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
-			  struct dfu_file *file)
+/* Sizes of the DfuSe file headers, see UM0391 */
+#define DFUSE_PREFIX_SIZE 11
+#define DFUSE_TARGET_PREFIX_SIZE 274
+#define DFUSE_ELEMENT_HEADER_SIZE 8
+#define DFUSE_TARGET_NAME_SIZE 255
+
+/*
+ * Indexes a DfuSe file: the elements of all targets are added to list,
+ * pointing into the loaded file without copying anything. The whole
+ * file is checked before anything is sent to the device.
+ *
+ * returns 0 on success, -1 if the file is not a valid DfuSe file
+ */
+static int dfuse_index_file(struct dfu_session *s, struct dfu_if *dif,
+			     struct dfu_file *file,
+			     struct dfuse_element_list *list)
 {
-	uint8_t dfuprefix[11];
-	uint8_t targetprefix[274];
-	uint8_t elementheader[8];
+	unsigned char *dfuprefix;
+	unsigned char *targetprefix;
+	unsigned char *elementheader;
 	int image;
-	int element;
+	unsigned int element;
 	int bTargets;
 	int bAlternateSetting;
 	struct dfu_if *adif;
-	int dwNbElements;
+	unsigned int dwNbElements;
+	unsigned int dwTargetSize;
 	unsigned int dwElementAddress;
 	unsigned int dwElementSize;
-	uint8_t *data;
-	int ret;
-	int rem;
+	unsigned char *data;
+	unsigned int rem;
+	unsigned int target_start;
 	int bFirstAddressSaved = 0;
 
-	rem = file->size.total - file->size.prefix - file->size.suffix;
 	data = file->firmware + file->size.prefix;
 
-        /* Must be larger than a minimal DfuSe header and suffix */
-	if (rem < (int)(sizeof(dfuprefix) +
-	    sizeof(targetprefix) + sizeof(elementheader))) {
-		errx(EX_DATAERR, "File too small for a DfuSe file");
-        }
+	/* Must be larger than a minimal DfuSe header and suffix */
+	if (file->size.total - file->size.prefix - file->size.suffix <
+	    DFUSE_PREFIX_SIZE + DFUSE_TARGET_PREFIX_SIZE +
+	    DFUSE_ELEMENT_HEADER_SIZE) {
+		warnx("File too small for a DfuSe file");
+		return -1;
+	}
+	rem = file->size.total - file->size.prefix - file->size.suffix;
 
-	dfuse_memcpy(dfuprefix, &data, &rem, sizeof(dfuprefix));
+	dfuprefix = dfuse_take(&data, &rem, DFUSE_PREFIX_SIZE);
 
 	if (strncmp((char *)dfuprefix, "DfuSe", 5)) {
-		errx(EX_DATAERR, "No valid DfuSe signature");
-		return -EINVAL;
+		warnx("No valid DfuSe signature");
+		return -1;
 	}
 	if (dfuprefix[5] != 0x01) {
-		errx(EX_DATAERR, "DFU format revision %i not supported",
-			dfuprefix[5]);
-		return -EINVAL;
+		warnx("DFU format revision %i not supported", dfuprefix[5]);
+		return -1;
 	}
 	bTargets = dfuprefix[10];
 	_PRINTF("File contains %i DFU images\n", bTargets);
 
 	for (image = 1; image <= bTargets; image++) {
 		_PRINTF("Parsing DFU image %i\n", image);
-		dfuse_memcpy(targetprefix, &data, &rem, sizeof(targetprefix));
+		targetprefix = dfuse_take(&data, &rem,
+					  DFUSE_TARGET_PREFIX_SIZE);
+		if (!targetprefix)
+			return -1;
 		if (strncmp((char *)targetprefix, "Target", 6)) {
-			errx(EX_DATAERR, "No valid target signature");
-			return -EINVAL;
+			warnx("No valid target signature");
+			return -1;
 		}
 		bAlternateSetting = targetprefix[6];
 		if (targetprefix[7])
-			_PRINTF("Target name: %s\n", &targetprefix[11]);
+			_PRINTF("Target name: %.*s\n", DFUSE_TARGET_NAME_SIZE,
+				&targetprefix[11]);
 		else
 			_PRINTF("No target name\n");
-		dwNbElements = quad2uint((unsigned char *)targetprefix + 270);
+		dwTargetSize = quad2uint(targetprefix + 266);
+		dwNbElements = quad2uint(targetprefix + 270);
 		_PRINTF("Image for alternate setting %i, ", bAlternateSetting);
-		_PRINTF("(%i elements, ", dwNbElements);
-		_PRINTF("total size = %i)\n",
-		       quad2uint((unsigned char *)targetprefix + 266));
+		_PRINTF("(%u elements, ", dwNbElements);
+		_PRINTF("total size = %u)\n", dwTargetSize);
 
 		adif = dif;
 		while (adif) {
-			if (bAlternateSetting == adif->altsetting) {
-				adif->dev_handle = dif->dev_handle;
-				_PRINTF("Setting Alternate Interface #%d ...\n",
-				       adif->altsetting);
-				ret = libusb_set_interface_alt_setting(
-					  adif->dev_handle,
-					  adif->interface, adif->altsetting);
-				if (ret < 0) {
-					errx(EX_IOERR,
-					  "Cannot set alternate interface: %s",
-					  libusb_error_name(ret));
-				}
+			if (bAlternateSetting == adif->altsetting)
 				break;
-			}
 			adif = adif->next;
 		}
 		if (!adif)
 			warnx("No alternate setting %d (skipping elements)",
 			     bAlternateSetting);
 
+		target_start = rem;
 		for (element = 1; element <= dwNbElements; element++) {
-			_PRINTF("Parsing element %i, ", element);
-			dfuse_memcpy(elementheader, &data, &rem, sizeof(elementheader));
-			dwElementAddress =
-			    quad2uint((unsigned char *)elementheader);
-			dwElementSize =
-			    quad2uint((unsigned char *)elementheader + 4);
+			_PRINTF("Parsing element %u, ", element);
+			elementheader = dfuse_take(&data, &rem,
+						   DFUSE_ELEMENT_HEADER_SIZE);
+			if (!elementheader)
+				return -1;
+			dwElementAddress = quad2uint(elementheader);
+			dwElementSize = quad2uint(elementheader + 4);
 			_PRINTF("address = 0x%08x, ", dwElementAddress);
-			_PRINTF("size = %i\n", dwElementSize);
+			_PRINTF("size = %u\n", dwElementSize);
 
 			if (!bFirstAddressSaved) {
 				bFirstAddressSaved = 1;
-				dfuse_address = dwElementAddress;
+				s->dfuse.address = dwElementAddress;
+			}
+			/* sanity checks */
+			if (dwElementSize > rem) {
+				warnx("File too small for element size");
+				return -1;
+			}
+			if (dwElementSize > 0 &&
+			    dwElementAddress + (dwElementSize - 1) <
+			    dwElementAddress) {
+				warnx("Element at 0x%08x does not fit "
+				      "the address space", dwElementAddress);
+				return -1;
 			}
-			/* sanity check */
-			if ((int)dwElementSize > rem)
-				errx(EX_DATAERR, "File too small for element size");
-
-			if (adif)
-				ret = dfuse_dnload_element(adif, dwElementAddress,
-							   dwElementSize, data, xfer_size);
-			else
-				ret = 0;
-
-			/* advance read pointer */
-			dfuse_memcpy(NULL, &data, &rem, dwElementSize);
 
-			if (ret != 0)
-				return ret;
+			dfuse_add_element(list, adif, dwElementAddress,
+					  dwElementSize,
+					  dfuse_take(&data, &rem,
+						     dwElementSize));
 		}
+		if (target_start - rem != dwTargetSize)
+			warnx("Size of image %i is %u, not %u as its "
+			      "header says", image, target_start - rem,
+			      dwTargetSize);
 	}
 
 	if (rem != 0)
-		warnx("%d bytes leftover", rem);
+		warnx("%u bytes leftover", rem);
 
 	_PRINTF("Done parsing DfuSe file\n");
-
 	return 0;
 }
 
-int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
-		    const char *dfuse_options)
+/* Refuses the commands that wipe the device unless forced */
+static void dfuse_check_force(const struct dfu_session *s)
+{
+	if (s->dfuse.unprotect && !s->dfuse.force) {
+		errx(EX_USAGE, "The read unprotect command "
+			"will erase the flash memory"
+			"and can only be used with force\n");
+	}
+	if (s->dfuse.mass_erase && !s->dfuse.force) {
+		errx(EX_USAGE, "The mass erase command "
+			"can only be used with force");
+	}
+}
+
+/*
+ * Checks the DfuSe options without a device, so that usage errors
+ * are reported once before several devices are flashed
+ */
+void dfuse_check_options(const char *dfuse_options)
+{
+	struct dfu_session scratch;
+
+	dfu_session_init(&scratch);
+	dfuse_parse_options(&scratch, dfuse_options);
+	dfuse_check_force(&scratch);
+}
+
+int dfuse_do_dnload(struct dfu_session *s, struct dfu_if *dif, int xfer_size,
+		    struct dfu_file *file, const char *dfuse_options)
 {
 	int ret;
 	struct dfu_if *adif;
+	struct dfuse_element_list list;
 
 	if (dfuse_options)
-		dfuse_parse_options(dfuse_options);
+		dfuse_parse_options(s, dfuse_options);
+	dfuse_check_force(s);
 
 	adif = dif;
 	while (adif) {
-		adif->mem_layout = parse_memory_layout((char *)adif->alt_name);
-		if (!adif->mem_layout)
-			errx(EX_IOERR,
-			     "Failed to parse memory layout for alternate interface %i",
-			     adif->altsetting);
-		if (adif->quirks & QUIRK_DFUSE_LAYOUT)
-			fixup_dfuse_layout(adif, &(adif->mem_layout));
+		if (!dfuse_memory_layout(adif)) {
+			warnx("Failed to parse memory layout for alternate interface %i",
+			      adif->altsetting);
+			return -1;
+		}
 		adif = adif->next;
 	}
 
-	if (dfuse_unprotect) {
-		if (!dfuse_force) {
-			errx(EX_USAGE, "The read unprotect command "
-				"will erase the flash memory"
-				"and can only be used with force\n");
+	/* check the whole file before the device is unprotected or erased */
+	memset(&list, 0, sizeof(list));
+	if (file->name && s->dfuse.address_present) {
+		if (file->bcdDFU == 0x11a) {
+			warnx("This is a DfuSe file, not "
+			      "meant for raw download");
+			return -1;
+		}
+	} else if (file->name) {
+		if (file->bcdDFU != 0x11a) {
+			warnx("Only DfuSe file version 1.1a is supported");
+			warnx("(for raw binary download, use the "
+			      "--dfuse-address option)");
+			return -1;
+		}
+		if (dfuse_index_file(s, dif, file, &list) < 0) {
+			dfuse_free_elements(&list);
+			return -1;
+		}
+		dfuse_merge_elements(&list);
+	}
+
+	if (s->dfuse.unprotect) {
+		dfuse_free_elements(&list);
+		if (s->dfuse.dry_run) {
+			_PRINTF("Dry run, not unprotecting\n");
+			return 0;
 		}
-		ret = dfuse_special_command(dif, 0, READ_UNPROTECT);
+		ret = dfuse_special_command(s, dif, 0, READ_UNPROTECT);
 		_PRINTF("Device disconnects, erases flash and resets now\n");
 		return ret;
 	}
-	if (dfuse_mass_erase) {
-		if (!dfuse_force) {
-			errx(EX_USAGE, "The mass erase command "
-				"can only be used with force");
+	if (s->dfuse.mass_erase) {
+		if (s->dfuse.dry_run) {
+			_PRINTF("Dry run, not performing mass erase\n");
+		} else {
+			/* nothing the ledger knows about is left */
+			if (s->flash_ledger) {
+				dfu_ledger_free(&s->ledger);
+				s->ledger.loaded = 1;
+			}
+			_PRINTF("Performing mass erase, this can take a moment\n");
+			if (dfuse_special_command(s, dif, 0, MASS_ERASE) < 0) {
+				dfuse_free_elements(&list);
+				return -1;
+			}
 		}
-		_PRINTF("Performing mass erase, this can take a moment\n");
-		ret = dfuse_special_command(dif, 0, MASS_ERASE);
 	}
 	if (!file->name) {
 		_PRINTF("DfuSe command mode\n");
 		ret = 0;
-	} else if (dfuse_address_present) {
-		if (file->bcdDFU == 0x11a) {
-			errx(EX_USAGE, "This is a DfuSe file, not "
-				"meant for raw download");
-		}
-		ret = dfuse_do_bin_dnload(dif, xfer_size, file, dfuse_address);
+	} else if (s->dfuse.address_present) {
+		ret = dfuse_do_bin_dnload(s, dif, xfer_size, file, s->dfuse.address);
 	} else {
-		if (file->bcdDFU != 0x11a) {
-			warnx("Only DfuSe file version 1.1a is supported");
-			errx(EX_USAGE, "(for raw binary download, use the "
-			     "--dfuse-address option)");
-		}
-		ret = dfuse_do_dfuse_dnload(dif, xfer_size, file);
+		ret = dfuse_dnload_elements(s, dif, NULL, &list, xfer_size);
 	}
+	dfuse_free_elements(&list);
 
-	adif = dif;
-	while (adif) {
-		free_segment_list(adif->mem_layout);
-		adif = adif->next;
-	}
-
-	if (!dfuse_will_reset) {
-		dfu_abort_to_idle(dif);
-	}
+	if (!s->dfuse.will_reset && dfu_abort_to_idle(dif) < 0)
+		ret = -1;
 
-	if (dfuse_leave)
-		dfuse_do_leave(dif);
+	if (s->dfuse.leave && !s->dfuse.dry_run)
+		dfuse_do_leave(s, dif);
 
 	return ret;
 }
@@ -25,10 +25,13 @@
 
 enum dfuse_command { SET_ADDRESS, ERASE_PAGE, MASS_ERASE, READ_UNPROTECT };
 
-int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
-		    const char *dfuse_options);
-int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
-		    const char *dfuse_options);
+struct dfu_session;
+
+int dfuse_do_upload(struct dfu_session *s, struct dfu_if *dif, int xfer_size,
+		    int fd, const char *dfuse_options);
+int dfuse_do_dnload(struct dfu_session *s, struct dfu_if *dif, int xfer_size,
+		    struct dfu_file *file, const char *dfuse_options);
+void dfuse_check_options(const char *dfuse_options);
 int dfuse_multiple_alt(struct dfu_if *dfu_root);
 
 #endif /* DFUSE_H */
@@ -0,0 +1,355 @@
+/*
+ * Erase planning for DfuSe downloads
+ *
+ * All elements of a download are walked against the memory layout of
+ * their alternate setting before anything is written, giving the set
+ * of pages to erase. Each page is erased once, in address order, no
+ * matter how many elements touch it or in which order they come in
+ * the file.
+ *
+ * If allowed, the planned page erases are weighed against a single mass
+ * erase of the memory, using the busy times measured for the device in
+ * this session or saved in the profile cache.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfuse_mem.h"
+#include "dfuse_erase.h"
+#include "dfu_poll.h"
+
+/*
+ * Page erase time used as long as the device has not been seen erasing
+ * pages, in the range of STM32F4 sectors, and the time taken by the
+ * requests around each erase.
+ */
+#define ERASE_PAGE_US_PER_KB 20000
+#define ERASE_REQUEST_US 2000
+
+void dfuse_erase_plan_init(struct dfuse_erase_plan *plan)
+{
+	memset(plan, 0, sizeof(*plan));
+}
+
+static void plan_add_page(struct dfuse_erase_plan *plan, struct dfu_if *dif,
+			  unsigned int address, unsigned int size)
+{
+	struct dfuse_erase_page *page;
+
+	if (plan->num_pages == plan->alloc) {
+		plan->alloc = plan->alloc ? plan->alloc * 2 : 64;
+		plan->pages = realloc(plan->pages,
+				      plan->alloc * sizeof(*plan->pages));
+		if (plan->pages == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	page = &plan->pages[plan->num_pages++];
+	page->dif = dif;
+	page->address = address;
+	page->size = size;
+	page->erased = 0;
+	page->unchanged = 0;
+	page->from_ledger = 0;
+	page->hash = 0;
+}
+
+/*
+ * Adds the erasable pages covering size bytes from address. Checks that
+ * the whole range is writeable unless forced; memory that is not in the
+ * layout is not erased since we wouldn't know its page size. The range
+ * is walked a segment at a time.
+ *
+ * returns 0, or -1 if the range is not writeable
+ */
+int dfuse_erase_plan_add(struct dfuse_erase_plan *plan, struct dfu_if *dif,
+			 unsigned int address, unsigned int size, int force)
+{
+	unsigned long long addr = address;
+	unsigned long long end = (unsigned long long) address + size;
+	struct memsegment *segment;
+
+	if (size == 0)
+		return 0;
+
+	/* Check at least that we can write to the last address */
+	segment = find_segment(dif->mem_layout, end - 1);
+	if (!force && (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
+		warnx("Last page at 0x%08x is not writeable",
+		      (unsigned int) (end - 1));
+		return -1;
+	}
+
+	while (addr < end) {
+		unsigned long long page, run_end;
+
+		segment = find_segment(dif->mem_layout, addr);
+		if (!force &&
+		    (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
+			warnx("Page at 0x%08x is not writeable",
+			      (unsigned int) addr);
+			return -1;
+		}
+		if (!segment) {
+			segment = find_next_segment(dif->mem_layout, addr);
+			if (!segment)
+				break;
+			addr = segment->start;
+			continue;
+		}
+
+		run_end = (unsigned long long) segment->end + 1;
+		if (run_end > end)
+			run_end = end;
+		if (segment->pagesize > 0 &&
+		    (segment->memtype & DFUSE_ERASABLE)) {
+			page = segment->start + (addr - segment->start) /
+			    segment->pagesize * segment->pagesize;
+			for (; page < run_end; page += segment->pagesize)
+				plan_add_page(plan, dif, page,
+					      segment->pagesize);
+		}
+		addr = (unsigned long long) segment->end + 1;
+	}
+	return 0;
+}
+
+static int page_compare(const void *a, const void *b)
+{
+	const struct dfuse_erase_page *pa = a;
+	const struct dfuse_erase_page *pb = b;
+
+	if (pa->address != pb->address)
+		return pa->address < pb->address ? -1 : 1;
+	return pa->dif->altsetting - pb->dif->altsetting;
+}
+
+/* Sorts the pages in address order and drops the duplicates */
+void dfuse_erase_plan_finish(struct dfuse_erase_plan *plan)
+{
+	int i, n;
+
+	if (plan->num_pages == 0)
+		return;
+
+	qsort(plan->pages, plan->num_pages, sizeof(*plan->pages), page_compare);
+	plan->bytes = plan->pages[0].size;
+	for (i = 1, n = 1; i < plan->num_pages; i++) {
+		if (plan->pages[i].address == plan->pages[n - 1].address &&
+		    plan->pages[i].dif == plan->pages[n - 1].dif)
+			continue;
+		plan->pages[n++] = plan->pages[i];
+		plan->bytes += plan->pages[i].size;
+	}
+	plan->num_pages = n;
+}
+
+/*
+ * The page of dif that contains address, or else the first page of dif
+ * above it, or NULL if there is none.
+ */
+struct dfuse_erase_page *dfuse_erase_plan_lookup(
+	const struct dfuse_erase_plan *plan, struct dfu_if *dif,
+	unsigned int address)
+{
+	struct dfuse_erase_page *found = NULL;
+	int lo = 0, hi = plan->num_pages;
+	int i;
+
+	/* first page starting above address */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (plan->pages[mid].address <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* pages of one alternate setting don't overlap */
+	for (i = lo - 1; i >= 0; i--) {
+		if (plan->pages[i].dif == dif) {
+			if (address - plan->pages[i].address < plan->pages[i].size)
+				return &plan->pages[i];
+			break;
+		}
+	}
+	for (i = lo; i < plan->num_pages; i++) {
+		if (plan->pages[i].dif == dif) {
+			found = &plan->pages[i];
+			break;
+		}
+	}
+	return found;
+}
+
+static struct dfuse_erase_page *next_page(const struct dfuse_erase_plan *plan,
+					 const struct dfuse_erase_page *page)
+{
+	unsigned int end = page->address + page->size;
+
+	if (end == 0)	/* at the top of the address space */
+		return NULL;
+	return dfuse_erase_plan_lookup(plan, page->dif, end);
+}
+
+/*
+ * For writing a chunk of *chunk_size bytes at address, skipping pages
+ * found unchanged: returns the number of bytes to skip if address is in
+ * such a page, or else 0 after shortening the chunk to end where the
+ * next one starts.
+ */
+unsigned int dfuse_erase_plan_skip(const struct dfuse_erase_plan *plan,
+				   struct dfu_if *dif, unsigned int address,
+				   int *chunk_size)
+{
+	struct dfuse_erase_page *page;
+
+	page = dfuse_erase_plan_lookup(plan, dif, address);
+	if (page && page->address <= address) {
+		if (page->unchanged)
+			return page->address + page->size - address;
+		page = next_page(plan, page);
+	}
+	while (page && page->address - address < (unsigned int) *chunk_size) {
+		if (page->unchanged) {
+			*chunk_size = page->address - address;
+			break;
+		}
+		page = next_page(plan, page);
+	}
+	return 0;
+}
+
+/* Tells if all of size bytes from address are in pages erased so far */
+int dfuse_erase_plan_erased(const struct dfuse_erase_plan *plan,
+			    struct dfu_if *dif, unsigned int address,
+			    unsigned int size)
+{
+	unsigned long long end = (unsigned long long) address + size;
+	unsigned long long next = address;
+	struct dfuse_erase_page *page;
+
+	page = dfuse_erase_plan_lookup(plan, dif, address);
+	while (next < end) {
+		if (!page || page->address > next || !page->erased ||
+		    page->unchanged)
+			return 0;
+		next = (unsigned long long) page->address + page->size;
+		page = next_page(plan, page);
+	}
+	return 1;
+}
+
+/* Estimated time to erase a page, in us, from the time per KB learned
+ * on the device or else a typical one */
+unsigned long long dfuse_erase_page_cost(const struct dfuse_erase_page *page,
+					 const struct dfu_poll_profile *profile)
+{
+	const struct dfu_poll_learned *l = &profile->cmd[DFU_POLL_ERASE_PAGE];
+	unsigned long long kb = (page->size + 1023ULL) / 1024;
+
+	if (l->samples > 0)
+		return kb * l->busy_us + ERASE_REQUEST_US;
+	return kb * ERASE_PAGE_US_PER_KB + ERASE_REQUEST_US;
+}
+
+/* Estimated time to erase the planned pages one by one, in us */
+static unsigned long long page_erase_cost(const struct dfuse_erase_plan *plan,
+					  const struct dfu_poll_profile *profile)
+{
+	unsigned long long cost = 0;
+	int i;
+
+	for (i = 0; i < plan->num_pages; i++)
+		cost += dfuse_erase_page_cost(&plan->pages[i], profile);
+	return cost;
+}
+
+/*
+ * Picks a mass erase when it is known to be quicker than erasing the
+ * planned pages. This is only possible when all pages are in the
+ * memory of one alternate setting, and only once a mass erase has been
+ * timed on the device; a mass erase is never guessed to be cheaper.
+ */
+void dfuse_erase_plan_choose(struct dfuse_erase_plan *plan,
+			     const struct dfu_poll_profile *profile)
+{
+	const struct dfu_poll_learned *l = &profile->cmd[DFU_POLL_MASS_ERASE];
+	unsigned long long pages_us, mass_us;
+	int i;
+
+	plan->mass_erase = NULL;
+	if (plan->num_pages == 0)
+		return;
+	for (i = 1; i < plan->num_pages; i++) {
+		if (plan->pages[i].dif != plan->pages[0].dif)
+			return;
+	}
+
+	pages_us = page_erase_cost(plan, profile);
+	if (l->samples == 0) {
+		if (verbose)
+			_PRINTF("Erase estimate: %llu ms for %i pages, "
+				"mass erase not timed yet\n",
+				pages_us / 1000, plan->num_pages);
+		return;
+	}
+	mass_us = l->busy_us + ERASE_REQUEST_US;
+	if (verbose)
+		_PRINTF("Erase estimate: %llu ms for %i pages, "
+			"%llu ms for mass erase\n", pages_us / 1000,
+			plan->num_pages, mass_us / 1000);
+	if (mass_us < pages_us)
+		plan->mass_erase = plan->pages[0].dif;
+}
+
+void dfuse_erase_plan_print(const struct dfuse_erase_plan *plan)
+{
+	int i;
+
+	if (plan->mass_erase) {
+		_PRINTF("Erase plan: mass erase of alt %i instead of %i pages\n",
+			plan->mass_erase->altsetting, plan->num_pages);
+		return;
+	}
+	_PRINTF("Erase plan: %i pages, %llu bytes\n", plan->num_pages,
+		plan->bytes);
+	for (i = 0; i < plan->num_pages; i++) {
+		const struct dfuse_erase_page *page = &plan->pages[i];
+
+		_PRINTF("  alt %i: page 0x%08x-0x%08x (%u bytes)\n",
+			page->dif->altsetting, page->address,
+			page->address + page->size - 1, page->size);
+	}
+}
+
+void dfuse_erase_plan_free(struct dfuse_erase_plan *plan)
+{
+	free(plan->pages);
+	memset(plan, 0, sizeof(*plan));
+}
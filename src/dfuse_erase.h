@@ -0,0 +1,72 @@
+/*
+ * Erase planning for DfuSe downloads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFUSE_ERASE_H
+#define DFUSE_ERASE_H
+
+#include "dfu.h"
+#include "dfu_poll.h"
+
+struct dfuse_erase_page {
+	struct dfu_if *dif;		/* alternate setting of the memory */
+	unsigned int address;		/* start of the page */
+	unsigned int size;
+	int erased;
+	int unchanged;			/* delta: already holds the image */
+	int from_ledger;		/* unchanged as told by the ledger */
+	unsigned long long hash;	/* of what the image puts in it */
+};
+
+struct dfuse_erase_plan {
+	struct dfuse_erase_page *pages;	/* in address order once finished */
+	int num_pages;
+	int alloc;
+	unsigned long long bytes;
+	struct dfu_if *mass_erase;	/* erase it all at once instead */
+	unsigned long long skipped;	/* bytes not written, see delta */
+	unsigned long long sparse_skipped; /* blank bytes not sent */
+
+	/* blank check, until it costs more than it saves */
+	int blank_check;
+	int blank_checked;		/* pages read */
+	int blank_found;		/* of which already erased */
+	unsigned long long blank_read_us;
+	unsigned long long blank_saved_us;
+};
+
+void dfuse_erase_plan_init(struct dfuse_erase_plan *plan);
+int dfuse_erase_plan_add(struct dfuse_erase_plan *plan, struct dfu_if *dif,
+			 unsigned int address, unsigned int size, int force);
+void dfuse_erase_plan_finish(struct dfuse_erase_plan *plan);
+unsigned long long dfuse_erase_page_cost(const struct dfuse_erase_page *page,
+					 const struct dfu_poll_profile *profile);
+void dfuse_erase_plan_choose(struct dfuse_erase_plan *plan,
+			     const struct dfu_poll_profile *profile);
+struct dfuse_erase_page *dfuse_erase_plan_lookup(
+	const struct dfuse_erase_plan *plan, struct dfu_if *dif,
+	unsigned int address);
+unsigned int dfuse_erase_plan_skip(const struct dfuse_erase_plan *plan,
+				   struct dfu_if *dif, unsigned int address,
+				   int *chunk_size);
+int dfuse_erase_plan_erased(const struct dfuse_erase_plan *plan,
+			    struct dfu_if *dif, unsigned int address,
+			    unsigned int size);
+void dfuse_erase_plan_print(const struct dfuse_erase_plan *plan);
+void dfuse_erase_plan_free(struct dfuse_erase_plan *plan);
+
+#endif /* DFUSE_ERASE_H */
@@ -32,108 +32,167 @@
 #include "dfu_file.h"
 #include "dfuse_mem.h"
 
-int add_segment(struct memsegment **segment_list, struct memsegment segment)
+/*
+ * Inserts a segment, keeping them in address order. Layouts normally
+ * list their segments in address order, so this is an append.
+ */
+int add_segment(struct memlayout *layout, struct memsegment segment)
 {
-	struct memsegment *new_element;
-
-	new_element = dfu_malloc(sizeof(struct memsegment));
-	*new_element = segment;
-	new_element->next = NULL;
-
-	if (*segment_list == NULL)
-		/* list can be empty on first call */
-		*segment_list = new_element;
-	else {
-		struct memsegment *next_element;
-
-		/* find last element in list */
-		next_element = *segment_list;
-		while (next_element->next != NULL)
-			next_element = next_element->next;
-		next_element->next = new_element;
+	int i;
+
+	if (layout->num_segments == layout->alloc) {
+		layout->alloc = layout->alloc ? layout->alloc * 2 : 8;
+		layout->segments = realloc(layout->segments,
+			layout->alloc * sizeof(*layout->segments));
+		if (layout->segments == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
 	}
+	i = layout->num_segments;
+	while (i > 0 && layout->segments[i - 1].start > segment.start) {
+		layout->segments[i] = layout->segments[i - 1];
+		i--;
+	}
+	layout->segments[i] = segment;
+	layout->num_segments++;
 	return 0;
 }
 
-struct memsegment *find_segment(struct memsegment *segment_list,
-				unsigned int address)
+/* Index of the first segment starting above address */
+static int segment_above(const struct memlayout *layout, unsigned int address)
 {
-	while (segment_list != NULL) {
-		if (segment_list->start <= address &&
-		    segment_list->end >= address)
-			return segment_list;
-		segment_list = segment_list->next;
+	int lo = 0, hi = layout->num_segments;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (layout->segments[mid].start <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
+
+/* The segment containing address, segments are not expected to overlap */
+struct memsegment *find_segment(const struct memlayout *layout,
+				unsigned int address)
+{
+	int i;
+
+	if (layout == NULL)
+		return NULL;
+	i = segment_above(layout, address) - 1;
+	if (i >= 0 && layout->segments[i].end >= address)
+		return &layout->segments[i];
 	return NULL;
 }
 
-void free_segment_list(struct memsegment *segment_list)
+/* The first segment starting above address, or NULL if there is none */
+struct memsegment *find_next_segment(const struct memlayout *layout,
+				     unsigned int address)
 {
-	struct memsegment *next_element;
+	int i;
 
-	while (segment_list->next != NULL) {
-		next_element = segment_list->next;
-		free(segment_list);
-		segment_list = next_element;
-	}
-	free(segment_list);
+	if (layout == NULL)
+		return NULL;
+	i = segment_above(layout, address);
+	if (i < layout->num_segments)
+		return &layout->segments[i];
+	return NULL;
 }
 
-/* Parse memory map from interface descriptor string
- * encoded as per ST document UM0424 section 4.3.2.
+void free_memory_layout(struct memlayout *layout)
+{
+	if (layout == NULL)
+		return;
+	free(layout->segments);
+	free(layout);
+}
+
+/*
+ * Reads a number in the given base at *p, moving *p past it. Returns
+ * -1 if there is none, or if it doesn't fit an unsigned int.
  */
-struct memsegment *parse_memory_layout(char *intf_desc)
+static int parse_number(const char **p, int base, unsigned int *value)
 {
+	unsigned long number;
+	char *end;
 
-	char multiplier, memtype;
+	errno = 0;
+	number = strtoul(*p, &end, base);
+	if (end == *p || errno == ERANGE || number > 0xffffffffUL)
+		return -1;
+	*value = number;
+	*p = end;
+	return 0;
+}
+
+/* Parse memory map from interface descriptor string
+ * encoded as per ST document UM0424 section 4.3.2:
+ *   @name/0xaddress/count*size<multiplier><type>,.../0xaddress/...
+ * in a single pass over the string.
+ */
+struct memlayout *parse_memory_layout(const char *intf_desc)
+{
+	const char *p = intf_desc;
+	const char *name;
+	int name_len;
 	unsigned int address;
-	int sectors, size;
-	char *name, *typestring;
-	int ret;
 	int count = 0;
-	char separator;
-	int scanned;
-	struct memsegment *segment_list = NULL;
+	struct memlayout *layout;
 	struct memsegment segment;
 
-	name = dfu_malloc(strlen(intf_desc));
-
-	ret = sscanf(intf_desc, "@%[^/]%n", name, &scanned);
-	if (ret < 1) {
-		free(name);
-		warnx("Could not read name, sscanf returned %d", ret);
+	if (*p != '@' || p[1] == '/' || p[1] == '\0') {
+		warnx("Could not read name of memory layout");
 		return NULL;
 	}
-	_PRINTF("DfuSe interface name: \"%s\"\n", name);
+	name = ++p;
+	while (*p != '/' && *p != '\0')
+		p++;
+	name_len = p - name;
+	_PRINTF("DfuSe interface name: \"%.*s\"\n", name_len, name);
 
-	intf_desc += scanned;
-	typestring = dfu_malloc(strlen(intf_desc));
+	layout = dfu_malloc(sizeof(*layout));
+	memset(layout, 0, sizeof(*layout));
 
-	while (ret = sscanf(intf_desc, "/0x%x/%n", &address, &scanned),
-	       ret > 0) {
+	/* per address */
+	while (p[0] == '/' && p[1] == '0' && (p[2] == 'x' || p[2] == 'X')) {
+		p += 3;
+		if (parse_number(&p, 16, &address) < 0 || *p != '/')
+			break;
+		p++;
 
-		intf_desc += scanned;
-		while (ret = sscanf(intf_desc, "%d*%d%c%[^,/]%n",
-				    &sectors, &size, &multiplier, typestring,
-				    &scanned), ret > 2) {
-			intf_desc += scanned;
+		/* per segment */
+		while (1) {
+			unsigned int sectors, size;
+			const char *type;
+			char multiplier, memtype;
+			int type_len;
 
+			if (parse_number(&p, 10, &sectors) < 0 || *p != '*')
+				break;
+			p++;
+			if (parse_number(&p, 10, &size) < 0 || *p == '\0')
+				break;
+			multiplier = *p++;
+			type = p;
+			while (*p != ',' && *p != '/' && *p != '\0')
+				p++;
+			type_len = p - type;
 			count++;
+
 			memtype = 0;
-			if (ret == 4) {
-				if (strlen(typestring) == 1
-				    && typestring[0] != '/')
-					memtype = typestring[0];
-				else {
-					warnx("Parsing type identifier '%s' "
-						"failed for segment %i",
-						typestring, count);
-					continue;
-				}
+			if (type_len == 1) {
+				memtype = type[0];
+			} else if (type_len > 1) {
+				warnx("Parsing type identifier '%.*s' "
+					"failed for segment %i",
+					type_len, type, count);
+				goto next;
 			}
 
 			/* Quirk for STM32F4 devices */
-			if (strcmp(name, "Device Feature") == 0)
+			if (name_len == 14 && !strncmp(name, "Device Feature", 14))
 				memtype = 'e';
 
 			switch (multiplier) {
@@ -169,14 +228,14 @@ struct memsegment *parse_memory_layout(char *intf_desc)
 
 			if (!memtype) {
 				warnx("No valid type for segment %d\n", count);
-				continue;
+				goto next;
 			}
 
 			segment.start = address;
 			segment.end = address + sectors * size - 1;
 			segment.pagesize = size;
 			segment.memtype = memtype & 7;
-			add_segment(&segment_list, segment);
+			add_segment(layout, segment);
 
 			if (verbose)
 				_PRINTF("Memory segment at 0x%08x %3d x %4d = "
@@ -187,17 +246,17 @@ struct memsegment *parse_memory_layout(char *intf_desc)
 				       memtype & DFUSE_WRITEABLE ? "w" : "");
 
 			address += sectors * size;
-
-			separator = *intf_desc;
-			if (separator == ',')
-				intf_desc += 1;
-			else
+next:
+			if (*p != ',')
 				break;
+			p++;
 		}	/* while per segment */
 
 	}		/* while per address */
-	free(name);
-	free(typestring);
 
-	return segment_list;
+	if (layout->num_segments == 0) {
+		free_memory_layout(layout);
+		return NULL;
+	}
+	return layout;
 }
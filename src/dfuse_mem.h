@@ -30,15 +30,25 @@ struct memsegment {
 	unsigned int end;
 	int pagesize;
 	int memtype;
-	struct memsegment *next;
 };
 
-int add_segment(struct memsegment **list, struct memsegment new_element);
+/* Memory map of an alternate setting, segments in address order */
+struct memlayout {
+	struct memsegment *segments;
+	int num_segments;
+	int alloc;
+};
+
+int add_segment(struct memlayout *layout, struct memsegment new_element);
+
+struct memsegment *find_segment(const struct memlayout *layout,
+				unsigned int address);
 
-struct memsegment *find_segment(struct memsegment *list, unsigned int address);
+struct memsegment *find_next_segment(const struct memlayout *layout,
+				     unsigned int address);
 
-void free_segment_list(struct memsegment *list);
+void free_memory_layout(struct memlayout *layout);
 
-struct memsegment *parse_memory_layout(char *intf_desc_str);
+struct memlayout *parse_memory_layout(const char *intf_desc_str);
 
 #endif /* DFUSE_MEM_H */
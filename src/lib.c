@@ -51,6 +51,11 @@
 #include "dfu_load.h"
 #include "dfu_util.h"
 #include "dfuse.h"
+#include "dfu_sim.h"
+#include "dfu_poll.h"
+#include "dfu_profile.h"
+#include "dfu_multi.h"
+#include "dfu_preload.h"
 #include "../include/dart-sdk/dart_api_dl.c"
 
 #ifdef __APPLE__
@@ -59,21 +64,6 @@
 
 int verbose = 0;
 
-struct dfu_if *dfu_root = NULL;
-
-char *match_path = NULL;
-int match_vendor = -1;
-int match_product = -1;
-int match_vendor_dfu = -1;
-int match_product_dfu = -1;
-int match_config_index = -1;
-int match_iface_index = -1;
-int match_iface_alt_index = -1;
-int match_devnum = -1;
-const char *match_iface_alt_name = NULL;
-const char *match_serial = NULL;
-const char *match_serial_dfu = NULL;
-
 static int parse_match_value(const char *str, int default_value)
 {
   char *remainder;
@@ -94,22 +84,22 @@ static int parse_match_value(const char *str, int default_value)
   return value;
 }
 
-static void parse_vendprod(const char *str)
+static void parse_vendprod(struct dfu_session *s, const char *str)
 {
   const char *comma;
   const char *colon;
 
   /* Default to match any DFU device in runtime or DFU mode */
-  match_vendor = -1;
-  match_product = -1;
-  match_vendor_dfu = -1;
-  match_product_dfu = -1;
+  s->match_vendor = -1;
+  s->match_product = -1;
+  s->match_vendor_dfu = -1;
+  s->match_product_dfu = -1;
 
   comma = strchr(str, ',');
   if (comma == str) {
     /* DFU mode vendor/product being specified without any runtime
      * vendor/product specification, so don't match any runtime device */
-    match_vendor = match_product = 0x10000;
+    s->match_vendor = s->match_product = 0x10000;
   } else {
     colon = strchr(str, ':');
     if (colon != NULL) {
@@ -118,14 +108,14 @@ static void parse_vendprod(const char *str)
         colon = NULL;
       }
     }
-    match_vendor = parse_match_value(str, match_vendor);
-    match_product = parse_match_value(colon, match_product);
+    s->match_vendor = parse_match_value(str, s->match_vendor);
+    s->match_product = parse_match_value(colon, s->match_product);
     if (comma != NULL) {
       /* Both runtime and DFU mode vendor/product specifications are
        * available, so default DFU mode match components to the given
        * runtime match components */
-      match_vendor_dfu = match_vendor;
-      match_product_dfu = match_product;
+      s->match_vendor_dfu = s->match_vendor;
+      s->match_product_dfu = s->match_product;
     }
   }
   if (comma != NULL) {
@@ -134,25 +124,25 @@ static void parse_vendprod(const char *str)
     if (colon != NULL) {
       ++colon;
     }
-    match_vendor_dfu = parse_match_value(comma, match_vendor_dfu);
-    match_product_dfu = parse_match_value(colon, match_product_dfu);
+    s->match_vendor_dfu = parse_match_value(comma, s->match_vendor_dfu);
+    s->match_product_dfu = parse_match_value(colon, s->match_product_dfu);
   }
 }
 
-static void parse_serial(char *str)
+static void parse_serial(struct dfu_session *s, char *str)
 {
   char *comma;
 
-  match_serial = str;
+  s->match_serial = str;
   comma = strchr(str, ',');
   if (comma == NULL) {
-    match_serial_dfu = match_serial;
+    s->match_serial_dfu = s->match_serial;
   } else {
     *comma++ = 0;
-    match_serial_dfu = comma;
+    s->match_serial_dfu = comma;
   }
-  if (*match_serial == 0) match_serial = NULL;
-  if (*match_serial_dfu == 0) match_serial_dfu = NULL;
+  if (*s->match_serial == 0) s->match_serial = NULL;
+  if (*s->match_serial_dfu == 0) s->match_serial_dfu = NULL;
 }
 
 static void print_version(void)
@@ -164,16 +154,28 @@ static void print_version(void)
          "Please report bugs to " PACKAGE_BUGREPORT "\n\n");
 }
 
-static enum mode mode = MODE_NONE;
-static struct dfu_file file;
-static const char *dfuse_options = NULL;
+static struct dfu_session session;
+static int session_ready = 0;
+static struct dfu_multi_target *targets = NULL;
+static int num_targets = 0;
+static int jobs = 0;
+
+static struct dfu_session *lib_session(void)
+{
+  if (!session_ready) {
+    dfu_session_init(&session);
+    session_ready = 1;
+  }
+  return &session;
+}
 
 LIBDFU_EXPORT int libdfu_execute()
 {
   int expected_size = 0;
   unsigned int transfer_size = 0;
+  unsigned int profile_transfer_size = 0;
   struct dfu_status status;
-  libusb_context *ctx;
+  libusb_context *ctx = NULL;
   char *end;
   int final_reset = 0;
   int wait_device = 0;
@@ -183,13 +185,13 @@ LIBDFU_EXPORT int libdfu_execute()
   int detach_delay = 5;
   uint16_t runtime_vendor;
   uint16_t runtime_product;
-
+  struct dfu_session *s = lib_session();
 
   /* make sure all prints are flushed */
   setvbuf(stdout, NULL, _IONBF, 0);
 
   print_version();
-  if (mode == MODE_VERSION) {
+  if (s->mode == MODE_VERSION) {
     return EX_OK;
   }
 
@@ -203,144 +205,193 @@ LIBDFU_EXPORT int libdfu_execute()
 #else
   warnx("libusb version is ancient");
 #endif
-  if (mode == MODE_NONE && !dfuse_options) {
+  if (s->mode == MODE_NONE && !s->dfuse_options) {
     _FPRINTF(stderr, "You need to specify one of -D or -U\n");
     return EX_USAGE;
   }
 
-  if (match_config_index == 0) {
+  if (s->match_config_index == 0) {
     /* Handle "-c 0" (unconfigured device) as don't care */
-    match_config_index = -1;
+    s->match_config_index = -1;
   }
 
-  if (mode == MODE_DOWNLOAD) {
-    dfu_load_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
+  if (s->mode == MODE_DOWNLOAD) {
+    if (s->stream) {
+      dfu_stream_file(&s->file);
+    } else if (s->match_vendor >= 0 && s->match_product >= 0 &&
+               !num_targets) {
+      /* the file IDs are not needed for matching, so load
+       * it while the device is brought up */
+      dfu_preload_start(s);
+    } else {
+      dfu_map_file(&s->file, MAYBE_SUFFIX, MAYBE_PREFIX);
+    }
     /* If the user didn't specify product and/or vendor IDs to match,
      * use any IDs from the file suffix for device matching */
-    if (match_vendor < 0 && file.idVendor != 0xffff) {
-      match_vendor = file.idVendor;
-      _PRINTF("Match vendor ID from file: %04x\n", match_vendor);
+    if (s->match_vendor < 0 && s->file.idVendor != 0xffff) {
+      s->match_vendor = s->file.idVendor;
+      _PRINTF("Match vendor ID from file: %04x\n", s->match_vendor);
     }
-    if (match_product < 0 && file.idProduct != 0xffff) {
-      match_product = file.idProduct;
-      _PRINTF("Match product ID from file: %04x\n", match_product);
+    if (s->match_product < 0 && s->file.idProduct != 0xffff) {
+      s->match_product = s->file.idProduct;
+      _PRINTF("Match product ID from file: %04x\n", s->match_product);
     }
-  } else if (mode == MODE_NONE && dfuse_options) {
+  } else if (s->mode == MODE_NONE && s->dfuse_options) {
     /* for DfuSe special commands, match any device */
-    mode = MODE_DOWNLOAD;
-    file.idVendor = 0xffff;
-    file.idProduct = 0xffff;
+    s->mode = MODE_DOWNLOAD;
+    s->file.idVendor = 0xffff;
+    s->file.idProduct = 0xffff;
+  }
+
+  if (num_targets && s->mode != MODE_DOWNLOAD) {
+    _FPRINTF(stderr, "Multiple targets are only supported for download\n");
+    return EX_USAGE;
+  }
+  if (num_targets && s->stream) {
+    _FPRINTF(stderr, "Streaming is not supported with multiple targets\n");
+    return EX_USAGE;
   }
 
   if (wait_device) {
     _PRINTF("Waiting for device, exit with ctrl-C\n");
   }
 
-  ret = libusb_init(&ctx);
-  if (ret)
-    errx(EX_IOERR, "unable to initialize libusb: %s", libusb_error_name(ret));
+  if (dfu_sim_num_alts()) {
+    _PRINTF("Using simulated DFU device\n");
+  } else if (!num_targets) {
+    /* with several targets, each worker has a context of its own */
+    ret = libusb_init(&ctx);
+    if (ret)
+      errx(EX_IOERR, "unable to initialize libusb: %s", libusb_error_name(ret));
 
-  if (verbose > 2) {
+    if (verbose > 2) {
 #if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000106
-    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
+      libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
 #else
-    libusb_set_debug(ctx, 255);
+      libusb_set_debug(ctx, 255);
 #endif
+    }
+  }
+  if (num_targets) {
+    struct dfu_multi multi;
+
+    multi.tmpl = s;
+    multi.targets = targets;
+    multi.num_targets = num_targets;
+    multi.jobs = jobs;
+    multi.transfer_size = transfer_size;
+    multi.final_reset = final_reset;
+    multi.wait_device = wait_device;
+    multi.detach_delay = detach_delay;
+    ret = dfu_multi_run(&multi);
+
+    if (dfu_sim_num_alts()) {
+      dfu_sim_print_stats();
+      dfu_sim_exit();
+    }
+    return ret;
   }
-probe:
-  probe_devices(ctx);
 
-  if (mode == MODE_LIST) {
-    list_dfu_interfaces();
-    disconnect_devices();
-    libusb_exit(ctx);
+  if (wait_device && s->mode != MODE_LIST)
+    wait_devices(s, ctx, -1);
+  else
+    probe_devices(s, ctx);
+
+  if (s->mode == MODE_LIST) {
+    list_dfu_interfaces(s);
+    disconnect_devices(s);
+    dfu_session_exit(s);
+    if (ctx)
+      libusb_exit(ctx);
     return EX_OK;
   }
 
-  if (dfu_root == NULL) {
-    if (wait_device) {
-      milli_sleep(20);
-      goto probe;
-    } else {
-      warnx("No DFU capable USB device available");
+  if (s->dfu_root == NULL) {
+    warnx("No DFU capable USB device available");
+    dfu_session_exit(s);
+    if (ctx)
       libusb_exit(ctx);
-      return EX_IOERR;
+    return EX_IOERR;
+  }
+  if (s->dfu_root->next != NULL) {
+    /* a DfuSe file may be meant for all the alternate settings */
+    dfu_preload_wait(s);
+    if (s->file.bcdDFU == 0x11a && dfuse_multiple_alt(s->dfu_root)) {
+      _PRINTF("Multiple alternate interfaces for DfuSe file\n");
+    } else {
+      /* We cannot safely support more than one DFU capable device
+       * with same vendor/product ID, since during DFU we need to do
+       * a USB bus reset, after which the target device will get a
+       * new address */
+      errx(EX_IOERR, "More than one DFU capable USB device found! "
+                     "Try `--list' and specify the serial number "
+                     "or disconnect all but one device\n");
     }
-  } else if (file.bcdDFU == 0x11a && dfuse_multiple_alt(dfu_root)) {
-    _PRINTF("Multiple alternate interfaces for DfuSe file\n");
-  } else if (dfu_root->next != NULL) {
-    /* We cannot safely support more than one DFU capable device
-     * with same vendor/product ID, since during DFU we need to do
-     * a USB bus reset, after which the target device will get a
-     * new address */
-    errx(EX_IOERR, "More than one DFU capable USB device found! "
-                   "Try `--list' and specify the serial number "
-                   "or disconnect all but one device\n");
   }
 
   /* We have exactly one device. Its libusb_device is now in dfu_root->dev */
 
   _PRINTF("Opening DFU capable USB device...\n");
-  ret = libusb_open(dfu_root->dev, &dfu_root->dev_handle);
-  if (ret || !dfu_root->dev_handle)
+  ret = dfu_open(s->dfu_root);
+  if (ret)
     errx(EX_IOERR, "Cannot open device: %s", libusb_error_name(ret));
 
-  _PRINTF("Device ID %04x:%04x\n", dfu_root->vendor, dfu_root->product);
+  _PRINTF("Device ID %04x:%04x\n", s->dfu_root->vendor, s->dfu_root->product);
 
   /* If first interface is DFU it is likely not proper run-time */
-  if (dfu_root->interface > 0)
+  if (s->dfu_root->interface > 0)
     _PRINTF("Run-Time device");
   else
     _PRINTF("Device");
   _PRINTF(" DFU version %04x\n",
-         libusb_le16_to_cpu(dfu_root->func_dfu.bcdDFUVersion));
+         libusb_le16_to_cpu(s->dfu_root->func_dfu.bcdDFUVersion));
 
   if (verbose) {
-    _PRINTF("DFU attributes: (0x%02x)", dfu_root->func_dfu.bmAttributes);
-    if (dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_DOWNLOAD)
+    _PRINTF("DFU attributes: (0x%02x)", s->dfu_root->func_dfu.bmAttributes);
+    if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_DOWNLOAD)
       _PRINTF(" bitCanDnload");
-    if (dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_UPLOAD)
+    if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_UPLOAD)
       _PRINTF(" bitCanUpload");
-    if (dfu_root->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
+    if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
       _PRINTF(" bitManifestationTolerant");
-    if (dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH)
+    if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH)
       _PRINTF(" bitWillDetach");
     _PRINTF("\n");
-    _PRINTF("Detach timeout %d ms\n", libusb_le16_to_cpu(dfu_root->func_dfu.wDetachTimeOut));
+    _PRINTF("Detach timeout %d ms\n", libusb_le16_to_cpu(s->dfu_root->func_dfu.wDetachTimeOut));
   }
 
   /* Transition from run-Time mode to DFU mode */
-  if (!(dfu_root->flags & DFU_IFF_DFU)) {
+  if (!(s->dfu_root->flags & DFU_IFF_DFU)) {
     int err;
     /* In the 'first round' during runtime mode, there can only be one
     * DFU Interface descriptor according to the DFU Spec. */
 
     /* FIXME: check if the selected device really has only one */
 
-    runtime_vendor = dfu_root->vendor;
-    runtime_product = dfu_root->product;
+    runtime_vendor = s->dfu_root->vendor;
+    runtime_product = s->dfu_root->product;
 
     _PRINTF("Claiming USB DFU (Run-Time) Interface...\n");
-    ret = libusb_claim_interface(dfu_root->dev_handle, dfu_root->interface);
+    ret = dfu_claim_interface(s->dfu_root);
     if (ret < 0) {
       errx(EX_IOERR, "Cannot claim interface %d: %s",
-           dfu_root->interface, libusb_error_name(ret));
+           s->dfu_root->interface, libusb_error_name(ret));
     }
 
     /* Needed for some devices where the DFU interface is not the first,
      * and should also be safe if there are multiple alt settings.
      * Otherwise skip the request since it might not be supported
      * by the device and the USB stack may or may not recover */
-    if (dfu_root->interface > 0 || dfu_root->flags & DFU_IFF_ALT) {
+    if (s->dfu_root->interface > 0 || s->dfu_root->flags & DFU_IFF_ALT) {
       _PRINTF("Setting Alternate Interface zero...\n");
-      ret = libusb_set_interface_alt_setting(dfu_root->dev_handle, dfu_root->interface, 0);
+      ret = dfu_set_alt_setting(s->dfu_root, 0);
       if (ret < 0) {
         errx(EX_IOERR, "Cannot set alternate interface zero: %s", libusb_error_name(ret));
       }
     }
 
     _PRINTF("Determining device status...\n");
-    err = dfu_get_status(dfu_root, &status);
+    err = dfu_get_status(s->dfu_root, &status);
     if (err == LIBUSB_ERROR_PIPE) {
       _PRINTF("Device does not implement get_status, assuming appIDLE\n");
       status.bStatus = DFU_STATUS_OK;
@@ -354,22 +405,21 @@ probe:
              dfu_state_to_string(status.bState), status.bStatus,
              dfu_status_to_string(status.bStatus));
     }
-    milli_sleep(status.bwPollTimeout);
+    dfu_poll_wait(s->dfu_root, status.bwPollTimeout);
 
     switch (status.bState) {
       case DFU_STATE_appIDLE:
       case DFU_STATE_appDETACH:
         _PRINTF("Device really in Run-Time Mode, send DFU "
                "detach request...\n");
-        if (dfu_detach(dfu_root->dev_handle,
-                       dfu_root->interface, 1000) < 0) {
+        if (dfu_detach(s->dfu_root, 1000) < 0) {
           warnx("error detaching");
         }
-        if (dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH) {
+        if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH) {
           _PRINTF("Device will detach and reattach...\n");
         } else {
           _PRINTF("Resetting USB...\n");
-          ret = libusb_reset_device(dfu_root->dev_handle);
+          ret = dfu_reset_device(s->dfu_root);
           if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND)
             errx(EX_IOERR, "error resetting "
                            "after detach: %s", libusb_error_name(ret));
@@ -377,54 +427,51 @@ probe:
         break;
       case DFU_STATE_dfuERROR:
         _PRINTF("dfuERROR, clearing status\n");
-        if (dfu_clear_status(dfu_root->dev_handle,
-                             dfu_root->interface) < 0) {
+        if (dfu_clear_status(s->dfu_root) < 0) {
           errx(EX_IOERR, "error clear_status");
         }
         /* fall through */
       default:
         warnx("WARNING: Device already in DFU mode? (bState=%d %s)",
               status.bState, dfu_state_to_string(status.bState));
-        libusb_release_interface(dfu_root->dev_handle,
-                                 dfu_root->interface);
+        dfu_release_interface(s->dfu_root);
         goto dfustate;
     }
-    libusb_release_interface(dfu_root->dev_handle,
-                             dfu_root->interface);
-    libusb_close(dfu_root->dev_handle);
-    dfu_root->dev_handle = NULL;
+    dfu_release_interface(s->dfu_root);
+    dfu_close(s->dfu_root);
 
     /* keeping handles open might prevent re-enumeration */
-    disconnect_devices();
+    disconnect_devices(s);
 
-    if (mode == MODE_DETACH) {
-      libusb_exit(ctx);
+    if (s->mode == MODE_DETACH) {
+      dfu_session_exit(s);
+      if (ctx)
+        libusb_exit(ctx);
       return EX_OK;
     }
 
-    milli_sleep(detach_delay * 1000);
-
     /* Change match vendor and product to impossible values to force
      * only DFU mode matches in the following probe */
-    match_vendor = match_product = 0x10000;
+    s->match_vendor = s->match_product = 0x10000;
 
-    probe_devices(ctx);
+    /* give the device up to detach_delay to come back */
+    wait_devices(s, ctx, detach_delay * 1000);
 
-    if (dfu_root == NULL) {
+    if (s->dfu_root == NULL) {
       errx(EX_IOERR, "Lost device after RESET?");
-    } else if (dfu_root->next != NULL) {
+    } else if (s->dfu_root->next != NULL) {
       errx(EX_IOERR, "More than one DFU capable USB device found! "
                      "Try `--list' and specify the serial number "
                      "or disconnect all but one device");
     }
 
     /* Check for DFU mode device */
-    if (!(dfu_root->flags | DFU_IFF_DFU))
+    if (!(s->dfu_root->flags | DFU_IFF_DFU))
       errx(EX_PROTOCOL, "Device is not in DFU mode");
 
     _PRINTF("Opening DFU USB Device...\n");
-    ret = libusb_open(dfu_root->dev, &dfu_root->dev_handle);
-    if (ret || !dfu_root->dev_handle) {
+    ret = dfu_open(s->dfu_root);
+    if (ret) {
       errx(EX_IOERR, "Cannot open device");
     }
   } else {
@@ -432,27 +479,27 @@ probe:
      * procedure */
     /* If a match vendor/product was specified, use that as the runtime
      * vendor/product, otherwise use the DFU mode vendor/product */
-    runtime_vendor = match_vendor < 0 ? dfu_root->vendor : match_vendor;
-    runtime_product = match_product < 0 ? dfu_root->product : match_product;
+    runtime_vendor = s->match_vendor < 0 ? s->dfu_root->vendor : s->match_vendor;
+    runtime_product = s->match_product < 0 ? s->dfu_root->product : s->match_product;
   }
 
 dfustate:
 #if 0
-  _PRINTF("Setting Configuration %u...\n", dfu_root->configuration);
-	ret = libusb_set_configuration(dfu_root->dev_handle, dfu_root->configuration);
+  _PRINTF("Setting Configuration %u...\n", s->dfu_root->configuration);
+	ret = libusb_set_configuration(s->dfu_root->dev_handle, s->dfu_root->configuration);
 	if (ret < 0) {
 		errx(EX_IOERR, "Cannot set configuration: %s", libusb_error_name(ret));
 	}
 #endif
   _PRINTF("Claiming USB DFU Interface...\n");
-  ret = libusb_claim_interface(dfu_root->dev_handle, dfu_root->interface);
+  ret = dfu_claim_interface(s->dfu_root);
   if (ret < 0) {
     errx(EX_IOERR, "Cannot claim interface - %s", libusb_error_name(ret));
   }
 
-  if (dfu_root->flags & DFU_IFF_ALT) {
-    _PRINTF("Setting Alternate Interface #%d ...\n", dfu_root->altsetting);
-    ret = libusb_set_interface_alt_setting(dfu_root->dev_handle, dfu_root->interface, dfu_root->altsetting);
+  if (s->dfu_root->flags & DFU_IFF_ALT) {
+    _PRINTF("Setting Alternate Interface #%d ...\n", s->dfu_root->altsetting);
+    ret = dfu_set_alt_setting(s->dfu_root, s->dfu_root->altsetting);
     if (ret < 0) {
       errx(EX_IOERR, "Cannot set alternate interface: %s", libusb_error_name(ret));
     }
@@ -460,7 +507,7 @@ dfustate:
 
 status_again:
   _PRINTF("Determining device status...\n");
-  ret = dfu_get_status(dfu_root, &status );
+  ret = dfu_get_status(s->dfu_root, &status );
   if (ret < 0) {
     errx(EX_IOERR, "error get_status: %s", libusb_error_name(ret));
   }
@@ -468,7 +515,7 @@ status_again:
          dfu_state_to_string(status.bState), status.bStatus,
          dfu_status_to_string(status.bStatus));
 
-  milli_sleep(status.bwPollTimeout);
+  dfu_poll_wait(s->dfu_root, status.bwPollTimeout);
 
   switch (status.bState) {
     case DFU_STATE_appIDLE:
@@ -477,7 +524,7 @@ status_again:
       break;
     case DFU_STATE_dfuERROR:
       _PRINTF("Clearing status\n");
-      if (dfu_clear_status(dfu_root->dev_handle, dfu_root->interface) < 0) {
+      if (dfu_clear_status(s->dfu_root) < 0) {
         errx(EX_IOERR, "error clear_status");
       }
       goto status_again;
@@ -485,7 +532,7 @@ status_again:
     case DFU_STATE_dfuDNLOAD_IDLE:
     case DFU_STATE_dfuUPLOAD_IDLE:
       _PRINTF("Aborting previous incomplete transfer\n");
-      if (dfu_abort(dfu_root->dev_handle, dfu_root->interface) < 0) {
+      if (dfu_abort(s->dfu_root) < 0) {
         errx(EX_IOERR, "can't send DFU_ABORT");
       }
       goto status_again;
@@ -499,32 +546,40 @@ status_again:
     _PRINTF("WARNING: DFU Status: '%s'\n",
            dfu_status_to_string(status.bStatus));
     /* Clear our status & try again. */
-    if (dfu_clear_status(dfu_root->dev_handle, dfu_root->interface) < 0)
+    if (dfu_clear_status(s->dfu_root) < 0)
       errx(EX_IOERR, "USB communication error");
-    if (dfu_get_status(dfu_root, &status) < 0)
+    if (dfu_get_status(s->dfu_root, &status) < 0)
       errx(EX_IOERR, "USB communication error");
     if (DFU_STATUS_OK != status.bStatus)
       errx(EX_PROTOCOL, "Status is not OK: %d", status.bStatus);
 
-    milli_sleep(status.bwPollTimeout);
+    dfu_poll_wait(s->dfu_root, status.bwPollTimeout);
   }
 
   _PRINTF("DFU mode device DFU version %04x\n",
-         libusb_le16_to_cpu(dfu_root->func_dfu.bcdDFUVersion));
+         libusb_le16_to_cpu(s->dfu_root->func_dfu.bcdDFUVersion));
 
-  if (dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a))
+  if (s->dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a))
     dfuse_device = 1;
-  else if (dfuse_options)
+  else if (s->dfuse_options)
     _PRINTF("Warning: DfuSe option used on non-DfuSe device\n");
 
   /* Get from device or user, warn if overridden */
-  int func_dfu_transfer_size = libusb_le16_to_cpu(dfu_root->func_dfu.wTransferSize);
+  if (s->profile_cache)
+    dfu_profile_load(s, &profile_transfer_size);
+  if (s->flash_ledger && s->mode == MODE_DOWNLOAD)
+    dfu_ledger_load(s);
+  int func_dfu_transfer_size = libusb_le16_to_cpu(s->dfu_root->func_dfu.wTransferSize);
   if (func_dfu_transfer_size) {
     _PRINTF("Device returned transfer size %i\n", func_dfu_transfer_size);
     if (!transfer_size)
       transfer_size = func_dfu_transfer_size;
     else
       _PRINTF("Warning: Overriding device-reported transfer size\n");
+  } else if (!transfer_size && profile_transfer_size) {
+    /* the profile only stands in for a size the device doesn't report */
+    transfer_size = profile_transfer_size;
+    _PRINTF("Using transfer size %i from profile\n", transfer_size);
   } else {
     if (!transfer_size)
       errx(EX_USAGE, "Transfer size must be specified");
@@ -538,25 +593,25 @@ status_again:
 	}
 #endif /* __linux__ */
 
-  if (transfer_size < dfu_root->bMaxPacketSize0) {
-    transfer_size = dfu_root->bMaxPacketSize0;
+  if (transfer_size < s->dfu_root->bMaxPacketSize0) {
+    transfer_size = s->dfu_root->bMaxPacketSize0;
     _PRINTF("Adjusted transfer size to %i\n", transfer_size);
   }
 
-  switch (mode) {
+  switch (s->mode) {
     case MODE_UPLOAD:
       /* open for "exclusive" writing */
-      fd = open(file.name, O_WRONLY | O_BINARY | O_CREAT | O_EXCL | O_TRUNC, 0666);
+      fd = open(s->file.name, O_WRONLY | O_BINARY | O_CREAT | O_EXCL | O_TRUNC, 0666);
       if (fd < 0) {
-        warn("Cannot open file %s for writing", file.name);
+        warn("Cannot open file %s for writing", s->file.name);
         ret = EX_CANTCREAT;
         break;
       }
 
-      if (dfuse_device || dfuse_options) {
-        ret = dfuse_do_upload(dfu_root, transfer_size, fd, dfuse_options);
+      if (dfuse_device || s->dfuse_options) {
+        ret = dfuse_do_upload(s, s->dfu_root, transfer_size, fd, s->dfuse_options);
       } else {
-        ret = dfuload_do_upload(dfu_root, transfer_size, expected_size, fd);
+        ret = dfuload_do_upload(s->dfu_root, transfer_size, expected_size, fd);
       }
       close(fd);
       if (ret < 0)
@@ -566,20 +621,28 @@ status_again:
       break;
 
     case MODE_DOWNLOAD:
-      if (((file.idVendor  != 0xffff && file.idVendor  != runtime_vendor) ||
-          (file.idProduct != 0xffff && file.idProduct != runtime_product)) &&
-          ((file.idVendor  != 0xffff && file.idVendor  != dfu_root->vendor) ||
-              (file.idProduct != 0xffff && file.idProduct != dfu_root->product))) {
+      dfu_preload_wait(s);
+      if (((s->file.idVendor  != 0xffff && s->file.idVendor  != runtime_vendor) ||
+          (s->file.idProduct != 0xffff && s->file.idProduct != runtime_product)) &&
+          ((s->file.idVendor  != 0xffff && s->file.idVendor  != s->dfu_root->vendor) ||
+              (s->file.idProduct != 0xffff && s->file.idProduct != s->dfu_root->product))) {
         errx(EX_USAGE, "Error: File ID %04x:%04x does "
                        "not match device (%04x:%04x or %04x:%04x)",
-             file.idVendor, file.idProduct,
+             s->file.idVendor, s->file.idProduct,
              runtime_vendor, runtime_product,
-             dfu_root->vendor, dfu_root->product);
+             s->dfu_root->vendor, s->dfu_root->product);
+      }
+      if (s->stream && (dfuse_device || s->dfuse_options)) {
+        /* DfuSe files are indexed and checked before downloading */
+        _PRINTF("DfuSe device, reading all of %s first\n", s->file.name);
+        dfu_map_file(&s->file, MAYBE_SUFFIX, MAYBE_PREFIX);
       }
-      if (dfuse_device || dfuse_options || file.bcdDFU == 0x11a) {
-        ret = dfuse_do_dnload(dfu_root, transfer_size, &file, dfuse_options);
+      if (dfuse_device || s->dfuse_options || s->file.bcdDFU == 0x11a) {
+        ret = dfuse_do_dnload(s, s->dfu_root, transfer_size, &s->file, s->dfuse_options);
+      } else if (s->stream) {
+        ret = dfuload_do_dnload_stream(s, s->dfu_root, transfer_size, &s->file);
       } else {
-        ret = dfuload_do_dnload(dfu_root, transfer_size, &file);
+        ret = dfuload_do_dnload(s, s->dfu_root, transfer_size, &s->file);
       }
       if (ret < 0)
         ret = EX_IOERR;
@@ -587,7 +650,7 @@ status_again:
         ret = EX_OK;
       break;
     case MODE_DETACH:
-      ret = dfu_detach(dfu_root->dev_handle, dfu_root->interface, 1000);
+      ret = dfu_detach(s->dfu_root, 1000);
       if (ret < 0) {
         warnx("can't detach");
         /* allow combination with final_reset */
@@ -595,55 +658,132 @@ status_again:
       }
       break;
     default:
-      warnx("Unsupported mode: %u", mode);
+      warnx("Unsupported mode: %u", s->mode);
       ret = EX_SOFTWARE;
       break;
   }
 
+  if (!ret && s->profile_cache &&
+      (s->mode == MODE_UPLOAD || s->mode == MODE_DOWNLOAD))
+    dfu_profile_save(s, transfer_size);
+  if (!ret && s->flash_ledger && s->mode == MODE_DOWNLOAD)
+    dfu_ledger_save(s);
+
   if (!ret && final_reset) {
-    ret = dfu_detach(dfu_root->dev_handle, dfu_root->interface, 1000);
+    ret = dfu_detach(s->dfu_root, 1000);
     if (ret < 0) {
       /* Even if detach failed, just carry on to leave the
                            device in a known state */
       warnx("can't detach");
     }
     _PRINTF("Resetting USB to switch back to Run-Time mode\n");
-    ret = libusb_reset_device(dfu_root->dev_handle);
+    ret = dfu_reset_device(s->dfu_root);
     if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
       warnx("error resetting after download: %s", libusb_error_name(ret));
       ret = EX_IOERR;
     }
   }
 
-  libusb_close(dfu_root->dev_handle);
-  dfu_root->dev_handle = NULL;
+  dfu_close(s->dfu_root);
+
+  if (verbose)
+    dfu_poll_print_stats(s);
 
-  disconnect_devices();
-  libusb_exit(ctx);
+  if (dfu_sim_num_alts()) {
+    dfu_sim_print_stats();
+    dfu_sim_exit();
+  }
+
+  disconnect_devices(s);
+  dfu_session_exit(s);
+  if (ctx)
+    libusb_exit(ctx);
   return ret;
 }
 
 LIBDFU_EXPORT void libdfu_set_download(const char *filename)
 {
-  mode = MODE_DOWNLOAD;
-  memset(&file, 0, sizeof(file));
-  file.name = filename;
+  struct dfu_session *s = lib_session();
+
+  s->mode = MODE_DOWNLOAD;
+  dfu_free_file(&s->file);
+  memset(&s->file, 0, sizeof(s->file));
+  s->file.name = filename;
 }
 
 LIBDFU_EXPORT void libdfu_set_altsetting(int alt)
 {
-  match_iface_alt_index = alt;
+  struct dfu_session *s = lib_session();
+
+  s->match_iface_alt_index = alt;
 }
 
 LIBDFU_EXPORT void libdfu_set_vendprod(int vendor, int product)
 {
-  match_vendor = vendor;
-  match_product = product;
+  struct dfu_session *s = lib_session();
+
+  s->match_vendor = vendor;
+  s->match_product = product;
 }
 
 LIBDFU_EXPORT void libdfu_set_dfuse_options(const char *dfuse_opts)
 {
-  dfuse_options = strdup(dfuse_opts);
+  struct dfu_session *s = lib_session();
+
+  s->dfuse_options = strdup(dfuse_opts);
+}
+
+LIBDFU_EXPORT void libdfu_set_simulate(const char *alt_name)
+{
+  dfu_sim_add_alt(alt_name);
+}
+
+LIBDFU_EXPORT void libdfu_set_adaptive_poll(int enable)
+{
+  struct dfu_session *s = lib_session();
+
+  s->poll_adaptive = enable;
+}
+
+LIBDFU_EXPORT void libdfu_set_profile_cache(const char *path)
+{
+  struct dfu_session *s = lib_session();
+
+  s->profile_cache = path ? strdup(path) : NULL;
+}
+
+LIBDFU_EXPORT void libdfu_set_flash_ledger(const char *path)
+{
+  struct dfu_session *s = lib_session();
+
+  s->flash_ledger = path ? strdup(path) : NULL;
+}
+
+LIBDFU_EXPORT void libdfu_set_stream(int enable)
+{
+  struct dfu_session *s = lib_session();
+
+  s->stream = enable;
+}
+
+LIBDFU_EXPORT void libdfu_set_targets(const char *list)
+{
+  if (targets)
+    dfu_multi_free_targets(targets, num_targets);
+  targets = NULL;
+  num_targets = 0;
+  if (list)
+    num_targets = dfu_multi_parse_targets(list, &targets);
+}
+
+LIBDFU_EXPORT void libdfu_set_jobs(int max_jobs)
+{
+  jobs = max_jobs;
+}
+
+LIBDFU_EXPORT void libdfu_set_simulate_devices(int num_devices)
+{
+  dfu_sim_set_num_devices(num_devices);
 }
 
 static void (*libdfu_stderr_callback)(const char *) = NULL;
@@ -667,16 +807,17 @@ LIBDFU_EXPORT void libdfu_set_progress_callback(void (*callback)(const char *, i
   libdfu_progress_callback = callback;
 }
 
+/* Messages are formatted on the stack, since workers flashing several
+ * targets print at the same time */
+#define LIB_MSG_LEN 4096
+
 void lib_printf(const char* format, ...)
 {
   if (libdfu_stdout_callback != NULL) {
-    static char* data = NULL;
-    if (data == NULL) {
-      data = malloc(4096);
-    }
+    char data[LIB_MSG_LEN];
     va_list args;
     va_start(args, format);
-    vsnprintf(data, 4096, format, args);
+    vsnprintf(data, sizeof(data), format, args);
     va_end(args);
     libdfu_stdout_callback(data);
   }
@@ -685,14 +826,11 @@ void lib_printf(const char* format, ...)
 void lib_fprintf(FILE* stream, const char* format, ...)
 {
   if (libdfu_stderr_callback != NULL) {
-    static char* data = NULL;
-    if (data == NULL) {
-      data = malloc(4096);
-    }
+    char data[LIB_MSG_LEN];
     va_list args;
-        va_start(args, format);
-    vsnprintf(data, 4096, format, args);
-        va_end(args);
+    va_start(args, format);
+    vsnprintf(data, sizeof(data), format, args);
+    va_end(args);
     libdfu_stderr_callback(data);
   }
 }
@@ -44,24 +44,14 @@
 #include "dfu_load.h"
 #include "dfu_util.h"
 #include "dfuse.h"
+#include "dfu_sim.h"
+#include "dfu_poll.h"
+#include "dfu_profile.h"
+#include "dfu_multi.h"
+#include "dfu_preload.h"
 
 int verbose = 0;
 
-struct dfu_if *dfu_root = NULL;
-
-char *match_path = NULL;
-int match_vendor = -1;
-int match_product = -1;
-int match_vendor_dfu = -1;
-int match_product_dfu = -1;
-int match_config_index = -1;
-int match_iface_index = -1;
-int match_iface_alt_index = -1;
-int match_devnum = -1;
-const char *match_iface_alt_name = NULL;
-const char *match_serial = NULL;
-const char *match_serial_dfu = NULL;
-
 static int parse_match_value(const char *str, int default_value)
 {
 	char *remainder;
@@ -82,22 +72,22 @@ static int parse_match_value(const char *str, int default_value)
 	return value;
 }
 
-static void parse_vendprod(const char *str)
+static void parse_vendprod(struct dfu_session *s, const char *str)
 {
 	const char *comma;
 	const char *colon;
 
 	/* Default to match any DFU device in runtime or DFU mode */
-	match_vendor = -1;
-	match_product = -1;
-	match_vendor_dfu = -1;
-	match_product_dfu = -1;
+	s->match_vendor = -1;
+	s->match_product = -1;
+	s->match_vendor_dfu = -1;
+	s->match_product_dfu = -1;
 
 	comma = strchr(str, ',');
 	if (comma == str) {
 		/* DFU mode vendor/product being specified without any runtime
 		 * vendor/product specification, so don't match any runtime device */
-		match_vendor = match_product = 0x10000;
+		s->match_vendor = s->match_product = 0x10000;
 	} else {
 		colon = strchr(str, ':');
 		if (colon != NULL) {
@@ -106,14 +96,14 @@ static void parse_vendprod(const char *str)
 				colon = NULL;
 			}
 		}
-		match_vendor = parse_match_value(str, match_vendor);
-		match_product = parse_match_value(colon, match_product);
+		s->match_vendor = parse_match_value(str, s->match_vendor);
+		s->match_product = parse_match_value(colon, s->match_product);
 		if (comma != NULL) {
 			/* Both runtime and DFU mode vendor/product specifications are
 			 * available, so default DFU mode match components to the given
 			 * runtime match components */
-			match_vendor_dfu = match_vendor;
-			match_product_dfu = match_product;
+			s->match_vendor_dfu = s->match_vendor;
+			s->match_product_dfu = s->match_product;
 		}
 	}
 	if (comma != NULL) {
@@ -122,25 +112,25 @@ static void parse_vendprod(const char *str)
 		if (colon != NULL) {
 			++colon;
 		}
-		match_vendor_dfu = parse_match_value(comma, match_vendor_dfu);
-		match_product_dfu = parse_match_value(colon, match_product_dfu);
+		s->match_vendor_dfu = parse_match_value(comma, s->match_vendor_dfu);
+		s->match_product_dfu = parse_match_value(colon, s->match_product_dfu);
 	}
 }
 
-static void parse_serial(char *str)
+static void parse_serial(struct dfu_session *s, char *str)
 {
 	char *comma;
 
-	match_serial = str;
+	s->match_serial = str;
 	comma = strchr(str, ',');
 	if (comma == NULL) {
-		match_serial_dfu = match_serial;
+		s->match_serial_dfu = s->match_serial;
 	} else {
 		*comma++ = 0;
-		match_serial_dfu = comma;
+		s->match_serial_dfu = comma;
 	}
-	if (*match_serial == 0) match_serial = NULL;
-	if (*match_serial_dfu == 0) match_serial_dfu = NULL;
+	if (*s->match_serial == 0) s->match_serial = NULL;
+	if (*s->match_serial_dfu == 0) s->match_serial_dfu = NULL;
 }
 
 static int parse_number(char *str, char *nmb)
@@ -171,7 +161,8 @@ static void help(void)
 		"  -v --verbose\t\t\tPrint verbose debug statements\n"
 		"  -l --list\t\t\tList currently attached DFU capable devices\n");
 	_FPRINTF(stderr, "  -e --detach\t\t\tDetach currently attached DFU capable devices\n"
-		"  -E --detach-delay seconds\tTime to wait before reopening a device after detach\n"
+		"  -E --detach-delay seconds\tMaximum time to wait for a device to return\n"
+		"\t\t\t\tafter detach\n"
 		"  -d --device <vendor>:<product>[,<vendor_dfu>:<product_dfu>]\n"
 		"\t\t\t\tSpecify Vendor/Product ID(s) of DFU device\n"
 		"  -n --devnum <dnum>\t\tMatch given device number (devnum from --list)\n"
@@ -194,11 +185,32 @@ static void help(void)
 		"\t\t\t\tAdd more DfuSe options separated with ':'\n"
 		"\t\tleave\t\tLeave DFU mode (jump to application)\n"
 		"\t\tmass-erase\tErase the whole device (requires \"force\")\n"
+		"\t\tallow-mass-erase\tMass erase instead of erasing pages\n"
+		"\t\t\t\twhen known to be quicker\n"
 		"\t\tunprotect\tErase read protected device (requires \"force\")\n"
 		"\t\twill-reset\tExpect device to reset (e.g. option bytes write)\n"
+		"\t\tdelta\t\tOnly erase and write pages that differ\n"
+		"\t\tblank-check\tDo not erase pages that are blank\n"
+		"\t\tsparse\t\tDo not send blank chunks to erased pages\n"
+		"\t\tspot-check\tRead back some pages the flash ledger skips\n"
+		"\t\tdry-run\t\tShow the erase plan, do not erase or write\n"
 		"\t\tforce\t\tYou really know what you are doing!\n"
 		"\t\t<length>\tLength of firmware to upload from device\n"
 		);
+	_FPRINTF(stderr, "  --simulate <alt_name>\t\tUse a simulated DFU device instead of USB,\n"
+		"\t\t\t\tadding an alternate setting with this name\n"
+		"\t\t\t\t(a DfuSe memory layout if starting with '@')\n"
+		"  --adaptive-poll\t\tPoll busy device before the reported timeout,\n"
+		"\t\t\t\tbased on the busy times measured so far\n"
+		"  --profile-cache <file>\tLoad and store device timing profiles in <file>\n"
+		"  --flash-ledger <file>\tRecord what was flashed to each device in <file>\n"
+		"\t\t\t\tand only write the pages that changed\n"
+		"  --stream\t\t\tDownload while reading the file (or stdin if \"-\"),\n"
+		"\t\t\t\tnot loading all of it first (not for DfuSe)\n"
+		"  --targets <serial|path>[,...]\tDownload to all these devices at once\n"
+		"  --jobs <number>\t\tNumber of devices flashed in parallel\n"
+		"\t\t\t\t(default: all targets)\n"
+		"  --simulate-devices <number>\tNumber of simulated devices\n");
 }
 
 static void print_version(void)
@@ -210,6 +222,18 @@ static void print_version(void)
 	       "Please report bugs to " PACKAGE_BUGREPORT "\n\n");
 }
 
+/* Options without a short form */
+enum {
+	OPT_SIMULATE = 0x100,
+	OPT_ADAPTIVE_POLL,
+	OPT_PROFILE_CACHE,
+	OPT_FLASH_LEDGER,
+	OPT_STREAM,
+	OPT_TARGETS,
+	OPT_JOBS,
+	OPT_SIMULATE_DEVICES
+};
+
 static struct option opts[] = {
 	{ "help", 0, 0, 'h' },
 	{ "version", 0, 0, 'V' },
@@ -234,6 +258,14 @@ static struct option opts[] = {
 	{ "dfuse-address", 1, 0, 's' },
 	{ "devnum",1, 0, 'n' },
 	{ "wait", 1, 0, 'w' },
+	{ "simulate", 1, 0, OPT_SIMULATE },
+	{ "adaptive-poll", 0, 0, OPT_ADAPTIVE_POLL },
+	{ "profile-cache", 1, 0, OPT_PROFILE_CACHE },
+	{ "flash-ledger", 1, 0, OPT_FLASH_LEDGER },
+	{ "stream", 0, 0, OPT_STREAM },
+	{ "targets", 1, 0, OPT_TARGETS },
+	{ "jobs", 1, 0, OPT_JOBS },
+	{ "simulate-devices", 1, 0, OPT_SIMULATE_DEVICES },
 	{ 0, 0, 0, 0 }
 };
 
@@ -241,22 +273,25 @@ int main(int argc, char **argv)
 {
 	int expected_size = 0;
 	unsigned int transfer_size = 0;
-	enum mode mode = MODE_NONE;
+	struct dfu_session session;
+	struct dfu_session *s = &session;
 	struct dfu_status status;
-	libusb_context *ctx;
-	struct dfu_file file;
+	libusb_context *ctx = NULL;
 	char *end;
 	int final_reset = 0;
 	int wait_device = 0;
 	int ret;
 	int dfuse_device = 0;
 	int fd;
-	const char *dfuse_options = NULL;
+	unsigned int profile_transfer_size = 0;
 	int detach_delay = 5;
 	uint16_t runtime_vendor;
 	uint16_t runtime_product;
+	struct dfu_multi_target *targets = NULL;
+	int num_targets = 0;
+	int jobs = 0;
 
-	memset(&file, 0, sizeof(file));
+	dfu_session_init(s);
 
 	/* make sure all prints are flushed */
 	setvbuf(stdout, NULL, _IONBF, 0);
@@ -274,75 +309,99 @@ int main(int argc, char **argv)
 			exit(EX_OK);
 			break;
 		case 'V':
-			mode = MODE_VERSION;
+			s->mode = MODE_VERSION;
 			break;
 		case 'v':
 			verbose++;
 			break;
 		case 'l':
-			mode = MODE_LIST;
+			s->mode = MODE_LIST;
 			break;
 		case 'e':
-			mode = MODE_DETACH;
+			s->mode = MODE_DETACH;
 			break;
 		case 'E':
 			detach_delay = parse_number("detach-delay", optarg);
 			break;
 		case 'd':
-			parse_vendprod(optarg);
+			parse_vendprod(s, optarg);
 			break;
 		case 'p':
 #if (defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102) || (defined(LIBUSBX_API_VERSION) && LIBUSBX_API_VERSION >= 0x01000102)
-			match_path = optarg;
+			s->match_path = optarg;
 #else
 			errx(EX_SOFTWARE, "This dfu-util was built without USB path support");
 #endif
 			break;
 		case 'c':
 			/* Configuration */
-			match_config_index = parse_number("cfg", optarg);
+			s->match_config_index = parse_number("cfg", optarg);
 			break;
 		case 'i':
 			/* Interface */
-			match_iface_index = parse_number("intf", optarg);
+			s->match_iface_index = parse_number("intf", optarg);
 			break;
 		case 'a':
 			/* Interface Alternate Setting */
-			match_iface_alt_index = strtoul(optarg, &end, 0);
+			s->match_iface_alt_index = strtoul(optarg, &end, 0);
 			if (*end) {
-				match_iface_alt_name = optarg;
-				match_iface_alt_index = -1;
+				s->match_iface_alt_name = optarg;
+				s->match_iface_alt_index = -1;
 			}
 			break;
 		case 'n':
-			match_devnum = atoi(optarg);
+			s->match_devnum = atoi(optarg);
 			break;
 		case 'S':
-			parse_serial(optarg);
+			parse_serial(s, optarg);
 			break;
 		case 't':
 			transfer_size = parse_number("transfer-size", optarg);
 			break;
 		case 'U':
-			mode = MODE_UPLOAD;
-			file.name = optarg;
+			s->mode = MODE_UPLOAD;
+			s->file.name = optarg;
 			break;
 		case 'Z':
 			expected_size = parse_number("upload-size", optarg);
 			break;
 		case 'D':
-			mode = MODE_DOWNLOAD;
-			file.name = optarg;
+			s->mode = MODE_DOWNLOAD;
+			s->file.name = optarg;
 			break;
 		case 'R':
 			final_reset = 1;
 			break;
 		case 's':
-			dfuse_options = optarg;
+			s->dfuse_options = optarg;
 			break;
 		case 'w':
 			wait_device = 1;
 			break;
+		case OPT_SIMULATE:
+			dfu_sim_add_alt(optarg);
+			break;
+		case OPT_ADAPTIVE_POLL:
+			s->poll_adaptive = 1;
+			break;
+		case OPT_PROFILE_CACHE:
+			s->profile_cache = optarg;
+			break;
+		case OPT_FLASH_LEDGER:
+			s->flash_ledger = optarg;
+			break;
+		case OPT_STREAM:
+			s->stream = 1;
+			break;
+		case OPT_TARGETS:
+			num_targets = dfu_multi_parse_targets(optarg, &targets);
+			break;
+		case OPT_JOBS:
+			jobs = parse_number("jobs", optarg);
+			break;
+		case OPT_SIMULATE_DEVICES:
+			dfu_sim_set_num_devices(parse_number("simulate-devices", optarg));
+			break;
 		default:
 			help();
 			exit(EX_USAGE);
@@ -356,7 +415,7 @@ int main(int argc, char **argv)
 	}
 
 	print_version();
-	if (mode == MODE_VERSION) {
+	if (s->mode == MODE_VERSION) {
 		exit(EX_OK);
 	}
 
@@ -371,145 +430,191 @@ int main(int argc, char **argv)
 	warnx("libusb version is ancient");
 #endif
 
-	if (mode == MODE_NONE && !dfuse_options) {
+	if (s->mode == MODE_NONE && !s->dfuse_options) {
 		_FPRINTF(stderr, "You need to specify one of -D or -U\n");
 		help();
 		exit(EX_USAGE);
 	}
 
-	if (match_config_index == 0) {
+	if (s->match_config_index == 0) {
 		/* Handle "-c 0" (unconfigured device) as don't care */
-		match_config_index = -1;
+		s->match_config_index = -1;
 	}
 
-	if (mode == MODE_DOWNLOAD) {
-		dfu_load_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
+	if (s->mode == MODE_DOWNLOAD) {
+		if (s->stream) {
+			dfu_stream_file(&s->file);
+		} else if (s->match_vendor >= 0 && s->match_product >= 0 &&
+			   !num_targets) {
+			/* the file IDs are not needed for matching, so load
+			 * it while the device is brought up */
+			dfu_preload_start(s);
+		} else {
+			dfu_map_file(&s->file, MAYBE_SUFFIX, MAYBE_PREFIX);
+		}
 		/* If the user didn't specify product and/or vendor IDs to match,
 		 * use any IDs from the file suffix for device matching */
-		if (match_vendor < 0 && file.idVendor != 0xffff) {
-			match_vendor = file.idVendor;
-			_PRINTF("Match vendor ID from file: %04x\n", match_vendor);
+		if (s->match_vendor < 0 && s->file.idVendor != 0xffff) {
+			s->match_vendor = s->file.idVendor;
+			_PRINTF("Match vendor ID from file: %04x\n", s->match_vendor);
 		}
-		if (match_product < 0 && file.idProduct != 0xffff) {
-			match_product = file.idProduct;
-			_PRINTF("Match product ID from file: %04x\n", match_product);
+		if (s->match_product < 0 && s->file.idProduct != 0xffff) {
+			s->match_product = s->file.idProduct;
+			_PRINTF("Match product ID from file: %04x\n", s->match_product);
 		}
-	} else if (mode == MODE_NONE && dfuse_options) {
+	} else if (s->mode == MODE_NONE && s->dfuse_options) {
 		/* for DfuSe special commands, match any device */
-		mode = MODE_DOWNLOAD;
-		file.idVendor = 0xffff;
-		file.idProduct = 0xffff;
+		s->mode = MODE_DOWNLOAD;
+		s->file.idVendor = 0xffff;
+		s->file.idProduct = 0xffff;
 	}
 
+	if (num_targets && s->mode != MODE_DOWNLOAD)
+		errx(EX_USAGE, "Multiple targets are only supported for download");
+	if (num_targets && s->stream)
+		errx(EX_USAGE, "Streaming is not supported with multiple targets");
+
 	if (wait_device) {
 		_PRINTF("Waiting for device, exit with ctrl-C\n");
 	}
 
-	ret = libusb_init(&ctx);
-	if (ret)
-		errx(EX_IOERR, "unable to initialize libusb: %s", libusb_error_name(ret));
+	if (dfu_sim_num_alts()) {
+		_PRINTF("Using simulated DFU device\n");
+	} else if (!num_targets) {
+		/* with several targets, each worker has a context of its own */
+		ret = libusb_init(&ctx);
+		if (ret)
+			errx(EX_IOERR, "unable to initialize libusb: %s", libusb_error_name(ret));
 
-	if (verbose > 2) {
+		if (verbose > 2) {
 #if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000106
-		libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
+			libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
 #else
-		libusb_set_debug(ctx, 255);
+			libusb_set_debug(ctx, 255);
 #endif
+		}
+	}
+	if (num_targets) {
+		struct dfu_multi multi;
+
+		multi.tmpl = s;
+		multi.targets = targets;
+		multi.num_targets = num_targets;
+		multi.jobs = jobs;
+		multi.transfer_size = transfer_size;
+		multi.final_reset = final_reset;
+		multi.wait_device = wait_device;
+		multi.detach_delay = detach_delay;
+		ret = dfu_multi_run(&multi);
+		dfu_multi_free_targets(targets, num_targets);
+
+		if (dfu_sim_num_alts()) {
+			dfu_sim_print_stats();
+			dfu_sim_exit();
+		}
+		return ret;
 	}
-probe:
-	probe_devices(ctx);
 
-	if (mode == MODE_LIST) {
-		list_dfu_interfaces();
-		disconnect_devices();
-		libusb_exit(ctx);
+	if (wait_device && s->mode != MODE_LIST)
+		wait_devices(s, ctx, -1);
+	else
+		probe_devices(s, ctx);
+
+	if (s->mode == MODE_LIST) {
+		list_dfu_interfaces(s);
+		disconnect_devices(s);
+		dfu_session_exit(s);
+		if (ctx)
+			libusb_exit(ctx);
 		return EX_OK;
 	}
 
-	if (dfu_root == NULL) {
-		if (wait_device) {
-			milli_sleep(20);
-			goto probe;
-		} else {
-			warnx("No DFU capable USB device available");
+	if (s->dfu_root == NULL) {
+		warnx("No DFU capable USB device available");
+		dfu_session_exit(s);
+		if (ctx)
 			libusb_exit(ctx);
-			return EX_IOERR;
+		return EX_IOERR;
+	}
+	if (s->dfu_root->next != NULL) {
+		/* a DfuSe file may be meant for all the alternate settings */
+		dfu_preload_wait(s);
+		if (s->file.bcdDFU == 0x11a && dfuse_multiple_alt(s->dfu_root)) {
+			_PRINTF("Multiple alternate interfaces for DfuSe file\n");
+		} else {
+			/* We cannot safely support more than one DFU capable device
+			 * with same vendor/product ID, since during DFU we need to do
+			 * a USB bus reset, after which the target device will get a
+			 * new address */
+			errx(EX_IOERR, "More than one DFU capable USB device found! "
+			       "Try `--list' and specify the serial number "
+			       "or disconnect all but one device\n");
 		}
-	} else if (file.bcdDFU == 0x11a && dfuse_multiple_alt(dfu_root)) {
-		_PRINTF("Multiple alternate interfaces for DfuSe file\n");
-	} else if (dfu_root->next != NULL) {
-		/* We cannot safely support more than one DFU capable device
-		 * with same vendor/product ID, since during DFU we need to do
-		 * a USB bus reset, after which the target device will get a
-		 * new address */
-		errx(EX_IOERR, "More than one DFU capable USB device found! "
-		       "Try `--list' and specify the serial number "
-		       "or disconnect all but one device\n");
 	}
 
 	/* We have exactly one device. Its libusb_device is now in dfu_root->dev */
 
 	_PRINTF("Opening DFU capable USB device...\n");
-	ret = libusb_open(dfu_root->dev, &dfu_root->dev_handle);
-	if (ret || !dfu_root->dev_handle)
+	ret = dfu_open(s->dfu_root);
+	if (ret)
 		errx(EX_IOERR, "Cannot open device: %s", libusb_error_name(ret));
 
-	_PRINTF("Device ID %04x:%04x\n", dfu_root->vendor, dfu_root->product);
+	_PRINTF("Device ID %04x:%04x\n", s->dfu_root->vendor, s->dfu_root->product);
 
 	/* If first interface is DFU it is likely not proper run-time */
-	if (dfu_root->interface > 0)
+	if (s->dfu_root->interface > 0)
 		_PRINTF("Run-Time device");
 	else
 		_PRINTF("Device");
 	_PRINTF(" DFU version %04x\n",
-	       libusb_le16_to_cpu(dfu_root->func_dfu.bcdDFUVersion));
+	       libusb_le16_to_cpu(s->dfu_root->func_dfu.bcdDFUVersion));
 
 	if (verbose) {
-		_PRINTF("DFU attributes: (0x%02x)", dfu_root->func_dfu.bmAttributes);
-		if (dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_DOWNLOAD)
+		_PRINTF("DFU attributes: (0x%02x)", s->dfu_root->func_dfu.bmAttributes);
+		if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_DOWNLOAD)
 			_PRINTF(" bitCanDnload");
-		if (dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_UPLOAD)
+		if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_UPLOAD)
 			_PRINTF(" bitCanUpload");
-		if (dfu_root->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
+		if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
 			_PRINTF(" bitManifestationTolerant");
-		if (dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH)
+		if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH)
 			_PRINTF(" bitWillDetach");
 		_PRINTF("\n");
-		_PRINTF("Detach timeout %d ms\n", libusb_le16_to_cpu(dfu_root->func_dfu.wDetachTimeOut));
+		_PRINTF("Detach timeout %d ms\n", libusb_le16_to_cpu(s->dfu_root->func_dfu.wDetachTimeOut));
 	}
 
 	/* Transition from run-Time mode to DFU mode */
-	if (!(dfu_root->flags & DFU_IFF_DFU)) {
+	if (!(s->dfu_root->flags & DFU_IFF_DFU)) {
 		int err;
 		/* In the 'first round' during runtime mode, there can only be one
 		* DFU Interface descriptor according to the DFU Spec. */
 
 		/* FIXME: check if the selected device really has only one */
 
-		runtime_vendor = dfu_root->vendor;
-		runtime_product = dfu_root->product;
+		runtime_vendor = s->dfu_root->vendor;
+		runtime_product = s->dfu_root->product;
 
 		_PRINTF("Claiming USB DFU (Run-Time) Interface...\n");
-		ret = libusb_claim_interface(dfu_root->dev_handle, dfu_root->interface);
+		ret = dfu_claim_interface(s->dfu_root);
 		if (ret < 0) {
 			errx(EX_IOERR, "Cannot claim interface %d: %s",
-				dfu_root->interface, libusb_error_name(ret));
+				s->dfu_root->interface, libusb_error_name(ret));
 		}
 
 		/* Needed for some devices where the DFU interface is not the first,
 		 * and should also be safe if there are multiple alt settings.
 		 * Otherwise skip the request since it might not be supported
 		 * by the device and the USB stack may or may not recover */
-		if (dfu_root->interface > 0 || dfu_root->flags & DFU_IFF_ALT) {
+		if (s->dfu_root->interface > 0 || s->dfu_root->flags & DFU_IFF_ALT) {
 			_PRINTF("Setting Alternate Interface zero...\n");
-			ret = libusb_set_interface_alt_setting(dfu_root->dev_handle, dfu_root->interface, 0);
+			ret = dfu_set_alt_setting(s->dfu_root, 0);
 			if (ret < 0) {
 				errx(EX_IOERR, "Cannot set alternate interface zero: %s", libusb_error_name(ret));
 			}
 		}
 
 		_PRINTF("Determining device status...\n");
-		err = dfu_get_status(dfu_root, &status);
+		err = dfu_get_status(s->dfu_root, &status);
 		if (err == LIBUSB_ERROR_PIPE) {
 			_PRINTF("Device does not implement get_status, assuming appIDLE\n");
 			status.bStatus = DFU_STATUS_OK;
@@ -523,22 +628,21 @@ probe:
 			       dfu_state_to_string(status.bState), status.bStatus,
 			       dfu_status_to_string(status.bStatus));
 		}
-		milli_sleep(status.bwPollTimeout);
+		dfu_poll_wait(s->dfu_root, status.bwPollTimeout);
 
 		switch (status.bState) {
 		case DFU_STATE_appIDLE:
 		case DFU_STATE_appDETACH:
 			_PRINTF("Device really in Run-Time Mode, send DFU "
 			       "detach request...\n");
-			if (dfu_detach(dfu_root->dev_handle,
-				       dfu_root->interface, 1000) < 0) {
+			if (dfu_detach(s->dfu_root, 1000) < 0) {
 				warnx("error detaching");
 			}
-			if (dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH) {
+			if (s->dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH) {
 				_PRINTF("Device will detach and reattach...\n");
 			} else {
 				_PRINTF("Resetting USB...\n");
-				ret = libusb_reset_device(dfu_root->dev_handle);
+				ret = dfu_reset_device(s->dfu_root);
 				if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND)
 					errx(EX_IOERR, "error resetting "
 						"after detach: %s", libusb_error_name(ret));
@@ -546,54 +650,51 @@ probe:
 			break;
 		case DFU_STATE_dfuERROR:
 			_PRINTF("dfuERROR, clearing status\n");
-			if (dfu_clear_status(dfu_root->dev_handle,
-					     dfu_root->interface) < 0) {
+			if (dfu_clear_status(s->dfu_root) < 0) {
 				errx(EX_IOERR, "error clear_status");
 			}
 			/* fall through */
 		default:
 			warnx("WARNING: Device already in DFU mode? (bState=%d %s)",
 			      status.bState, dfu_state_to_string(status.bState));
-			libusb_release_interface(dfu_root->dev_handle,
-			    dfu_root->interface);
+			dfu_release_interface(s->dfu_root);
 			goto dfustate;
 		}
-		libusb_release_interface(dfu_root->dev_handle,
-					 dfu_root->interface);
-		libusb_close(dfu_root->dev_handle);
-		dfu_root->dev_handle = NULL;
+		dfu_release_interface(s->dfu_root);
+		dfu_close(s->dfu_root);
 
 		/* keeping handles open might prevent re-enumeration */
-		disconnect_devices();
+		disconnect_devices(s);
 
-		if (mode == MODE_DETACH) {
-			libusb_exit(ctx);
+		if (s->mode == MODE_DETACH) {
+			dfu_session_exit(s);
+			if (ctx)
+				libusb_exit(ctx);
 			return EX_OK;
 		}
 
-		milli_sleep(detach_delay * 1000);
-
 		/* Change match vendor and product to impossible values to force
 		 * only DFU mode matches in the following probe */
-		match_vendor = match_product = 0x10000;
+		s->match_vendor = s->match_product = 0x10000;
 
-		probe_devices(ctx);
+		/* give the device up to detach_delay to come back */
+		wait_devices(s, ctx, detach_delay * 1000);
 
-		if (dfu_root == NULL) {
+		if (s->dfu_root == NULL) {
 			errx(EX_IOERR, "Lost device after RESET?");
-		} else if (dfu_root->next != NULL) {
+		} else if (s->dfu_root->next != NULL) {
 			errx(EX_IOERR, "More than one DFU capable USB device found! "
 				"Try `--list' and specify the serial number "
 				"or disconnect all but one device");
 		}
 
 		/* Check for DFU mode device */
-		if (!(dfu_root->flags | DFU_IFF_DFU))
+		if (!(s->dfu_root->flags | DFU_IFF_DFU))
 			errx(EX_PROTOCOL, "Device is not in DFU mode");
 
 		_PRINTF("Opening DFU USB Device...\n");
-		ret = libusb_open(dfu_root->dev, &dfu_root->dev_handle);
-		if (ret || !dfu_root->dev_handle) {
+		ret = dfu_open(s->dfu_root);
+		if (ret) {
 			errx(EX_IOERR, "Cannot open device");
 		}
 	} else {
@@ -601,27 +702,27 @@ probe:
 		 * procedure */
 		/* If a match vendor/product was specified, use that as the runtime
 		 * vendor/product, otherwise use the DFU mode vendor/product */
-		runtime_vendor = match_vendor < 0 ? dfu_root->vendor : match_vendor;
-		runtime_product = match_product < 0 ? dfu_root->product : match_product;
+		runtime_vendor = s->match_vendor < 0 ? s->dfu_root->vendor : s->match_vendor;
+		runtime_product = s->match_product < 0 ? s->dfu_root->product : s->match_product;
 	}
 
 dfustate:
 #if 0
-	_PRINTF("Setting Configuration %u...\n", dfu_root->configuration);
-	ret = libusb_set_configuration(dfu_root->dev_handle, dfu_root->configuration);
+	_PRINTF("Setting Configuration %u...\n", s->dfu_root->configuration);
+	ret = libusb_set_configuration(s->dfu_root->dev_handle, s->dfu_root->configuration);
 	if (ret < 0) {
 		errx(EX_IOERR, "Cannot set configuration: %s", libusb_error_name(ret));
 	}
 #endif
 	_PRINTF("Claiming USB DFU Interface...\n");
-	ret = libusb_claim_interface(dfu_root->dev_handle, dfu_root->interface);
+	ret = dfu_claim_interface(s->dfu_root);
 	if (ret < 0) {
 		errx(EX_IOERR, "Cannot claim interface - %s", libusb_error_name(ret));
 	}
 
-	if (dfu_root->flags & DFU_IFF_ALT) {
-		_PRINTF("Setting Alternate Interface #%d ...\n", dfu_root->altsetting);
-		ret = libusb_set_interface_alt_setting(dfu_root->dev_handle, dfu_root->interface, dfu_root->altsetting);
+	if (s->dfu_root->flags & DFU_IFF_ALT) {
+		_PRINTF("Setting Alternate Interface #%d ...\n", s->dfu_root->altsetting);
+		ret = dfu_set_alt_setting(s->dfu_root, s->dfu_root->altsetting);
 		if (ret < 0) {
 			errx(EX_IOERR, "Cannot set alternate interface: %s", libusb_error_name(ret));
 		}
@@ -629,7 +730,7 @@ dfustate:
 
 status_again:
 	_PRINTF("Determining device status...\n");
-	ret = dfu_get_status(dfu_root, &status );
+	ret = dfu_get_status(s->dfu_root, &status );
 	if (ret < 0) {
 		errx(EX_IOERR, "error get_status: %s", libusb_error_name(ret));
 	}
@@ -637,7 +738,7 @@ status_again:
 	       dfu_state_to_string(status.bState), status.bStatus,
 	       dfu_status_to_string(status.bStatus));
 
-	milli_sleep(status.bwPollTimeout);
+	dfu_poll_wait(s->dfu_root, status.bwPollTimeout);
 
 	switch (status.bState) {
 	case DFU_STATE_appIDLE:
@@ -646,7 +747,7 @@ status_again:
 		break;
 	case DFU_STATE_dfuERROR:
 		_PRINTF("Clearing status\n");
-		if (dfu_clear_status(dfu_root->dev_handle, dfu_root->interface) < 0) {
+		if (dfu_clear_status(s->dfu_root) < 0) {
 			errx(EX_IOERR, "error clear_status");
 		}
 		goto status_again;
@@ -654,7 +755,7 @@ status_again:
 	case DFU_STATE_dfuDNLOAD_IDLE:
 	case DFU_STATE_dfuUPLOAD_IDLE:
 		_PRINTF("Aborting previous incomplete transfer\n");
-		if (dfu_abort(dfu_root->dev_handle, dfu_root->interface) < 0) {
+		if (dfu_abort(s->dfu_root) < 0) {
 			errx(EX_IOERR, "can't send DFU_ABORT");
 		}
 		goto status_again;
@@ -668,32 +769,40 @@ status_again:
 		_PRINTF("WARNING: DFU Status: '%s'\n",
 			dfu_status_to_string(status.bStatus));
 		/* Clear our status & try again. */
-		if (dfu_clear_status(dfu_root->dev_handle, dfu_root->interface) < 0)
+		if (dfu_clear_status(s->dfu_root) < 0)
 			errx(EX_IOERR, "USB communication error");
-		if (dfu_get_status(dfu_root, &status) < 0)
+		if (dfu_get_status(s->dfu_root, &status) < 0)
 			errx(EX_IOERR, "USB communication error");
 		if (DFU_STATUS_OK != status.bStatus)
 			errx(EX_PROTOCOL, "Status is not OK: %d", status.bStatus);
 
-		milli_sleep(status.bwPollTimeout);
+		dfu_poll_wait(s->dfu_root, status.bwPollTimeout);
 	}
 
 	_PRINTF("DFU mode device DFU version %04x\n",
-	       libusb_le16_to_cpu(dfu_root->func_dfu.bcdDFUVersion));
+	       libusb_le16_to_cpu(s->dfu_root->func_dfu.bcdDFUVersion));
 
-	if (dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a))
+	if (s->dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a))
 		dfuse_device = 1;
-	else if (dfuse_options)
+	else if (s->dfuse_options)
 		_PRINTF("Warning: DfuSe option used on non-DfuSe device\n");
 
+	if (s->profile_cache)
+		dfu_profile_load(s, &profile_transfer_size);
+	if (s->flash_ledger && s->mode == MODE_DOWNLOAD)
+		dfu_ledger_load(s);
 	/* Get from device or user, warn if overridden */
-	int func_dfu_transfer_size = libusb_le16_to_cpu(dfu_root->func_dfu.wTransferSize);
+	int func_dfu_transfer_size = libusb_le16_to_cpu(s->dfu_root->func_dfu.wTransferSize);
 	if (func_dfu_transfer_size) {
 		_PRINTF("Device returned transfer size %i\n", func_dfu_transfer_size);
 		if (!transfer_size)
 			transfer_size = func_dfu_transfer_size;
 		else
 			_PRINTF("Warning: Overriding device-reported transfer size\n");
+	} else if (!transfer_size && profile_transfer_size) {
+		/* the profile only stands in for a size the device doesn't report */
+		transfer_size = profile_transfer_size;
+		_PRINTF("Using transfer size %i from profile\n", transfer_size);
 	} else {
 		if (!transfer_size)
 			errx(EX_USAGE, "Transfer size must be specified");
@@ -707,25 +816,25 @@ status_again:
 	}
 #endif /* __linux__ */
 
-	if (transfer_size < dfu_root->bMaxPacketSize0) {
-		transfer_size = dfu_root->bMaxPacketSize0;
+	if (transfer_size < s->dfu_root->bMaxPacketSize0) {
+		transfer_size = s->dfu_root->bMaxPacketSize0;
 		_PRINTF("Adjusted transfer size to %i\n", transfer_size);
 	}
 
-	switch (mode) {
+	switch (s->mode) {
 	case MODE_UPLOAD:
 		/* open for "exclusive" writing */
-		fd = open(file.name, O_WRONLY | O_BINARY | O_CREAT | O_EXCL | O_TRUNC, 0666);
+		fd = open(s->file.name, O_WRONLY | O_BINARY | O_CREAT | O_EXCL | O_TRUNC, 0666);
 		if (fd < 0) {
-			warn("Cannot open file %s for writing", file.name);
+			warn("Cannot open file %s for writing", s->file.name);
 			ret = EX_CANTCREAT;
 			break;
 		}
 
-		if (dfuse_device || dfuse_options) {
-		    ret = dfuse_do_upload(dfu_root, transfer_size, fd, dfuse_options);
+		if (dfuse_device || s->dfuse_options) {
+		    ret = dfuse_do_upload(s, s->dfu_root, transfer_size, fd, s->dfuse_options);
 		} else {
-		    ret = dfuload_do_upload(dfu_root, transfer_size, expected_size, fd);
+		    ret = dfuload_do_upload(s->dfu_root, transfer_size, expected_size, fd);
 		}
 		close(fd);
 		if (ret < 0)
@@ -735,20 +844,28 @@ status_again:
 		break;
 
 	case MODE_DOWNLOAD:
-		if (((file.idVendor  != 0xffff && file.idVendor  != runtime_vendor) ||
-		     (file.idProduct != 0xffff && file.idProduct != runtime_product)) &&
-		    ((file.idVendor  != 0xffff && file.idVendor  != dfu_root->vendor) ||
-		     (file.idProduct != 0xffff && file.idProduct != dfu_root->product))) {
+		dfu_preload_wait(s);
+		if (((s->file.idVendor  != 0xffff && s->file.idVendor  != runtime_vendor) ||
+		     (s->file.idProduct != 0xffff && s->file.idProduct != runtime_product)) &&
+		    ((s->file.idVendor  != 0xffff && s->file.idVendor  != s->dfu_root->vendor) ||
+		     (s->file.idProduct != 0xffff && s->file.idProduct != s->dfu_root->product))) {
 			errx(EX_USAGE, "Error: File ID %04x:%04x does "
 				"not match device (%04x:%04x or %04x:%04x)",
-				file.idVendor, file.idProduct,
+				s->file.idVendor, s->file.idProduct,
 				runtime_vendor, runtime_product,
-				dfu_root->vendor, dfu_root->product);
+				s->dfu_root->vendor, s->dfu_root->product);
 		}
-		if (dfuse_device || dfuse_options || file.bcdDFU == 0x11a) {
-			ret = dfuse_do_dnload(dfu_root, transfer_size, &file, dfuse_options);
+		if (s->stream && (dfuse_device || s->dfuse_options)) {
+			/* DfuSe files are indexed and checked before downloading */
+			_PRINTF("DfuSe device, reading all of %s first\n", s->file.name);
+			dfu_map_file(&s->file, MAYBE_SUFFIX, MAYBE_PREFIX);
+		}
+		if (dfuse_device || s->dfuse_options || s->file.bcdDFU == 0x11a) {
+			ret = dfuse_do_dnload(s, s->dfu_root, transfer_size, &s->file, s->dfuse_options);
+		} else if (s->stream) {
+			ret = dfuload_do_dnload_stream(s, s->dfu_root, transfer_size, &s->file);
 		} else {
-			ret = dfuload_do_dnload(dfu_root, transfer_size, &file);
+			ret = dfuload_do_dnload(s, s->dfu_root, transfer_size, &s->file);
 	 	}
 		if (ret < 0)
 			ret = EX_IOERR;
@@ -756,7 +873,7 @@ status_again:
 			ret = EX_OK;
 		break;
 	case MODE_DETACH:
-		ret = dfu_detach(dfu_root->dev_handle, dfu_root->interface, 1000);
+		ret = dfu_detach(s->dfu_root, 1000);
 		if (ret < 0) {
 			warnx("can't detach");
 			/* allow combination with final_reset */
@@ -764,30 +881,45 @@ status_again:
 		}
 		break;
 	default:
-		warnx("Unsupported mode: %u", mode);
+		warnx("Unsupported mode: %u", s->mode);
 		ret = EX_SOFTWARE;
 		break;
 	}
 
+	if (!ret && s->profile_cache &&
+	    (s->mode == MODE_UPLOAD || s->mode == MODE_DOWNLOAD))
+		dfu_profile_save(s, transfer_size);
+	if (!ret && s->flash_ledger && s->mode == MODE_DOWNLOAD)
+		dfu_ledger_save(s);
+
 	if (!ret && final_reset) {
-		ret = dfu_detach(dfu_root->dev_handle, dfu_root->interface, 1000);
+		ret = dfu_detach(s->dfu_root, 1000);
 		if (ret < 0) {
 			/* Even if detach failed, just carry on to leave the
                            device in a known state */
 			warnx("can't detach");
 		}
 		_PRINTF("Resetting USB to switch back to Run-Time mode\n");
-		ret = libusb_reset_device(dfu_root->dev_handle);
+		ret = dfu_reset_device(s->dfu_root);
 		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
 			warnx("error resetting after download: %s", libusb_error_name(ret));
 			ret = EX_IOERR;
 		}
 	}
 
-	libusb_close(dfu_root->dev_handle);
-	dfu_root->dev_handle = NULL;
+	dfu_close(s->dfu_root);
 
-	disconnect_devices();
-	libusb_exit(ctx);
+	if (verbose)
+		dfu_poll_print_stats(s);
+
+	if (dfu_sim_num_alts()) {
+		dfu_sim_print_stats();
+		dfu_sim_exit();
+	}
+
+	disconnect_devices(s);
+	dfu_session_exit(s);
+	if (ctx)
+		libusb_exit(ctx);
 	return ret;
 }
@@ -64,12 +64,15 @@ uint16_t get_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice)
 
 	/* Some GigaDevice GD32 devices have improperly-encoded serial numbers
 	 * and bad DfuSe descriptors which we use serial number to correct.
-	 * They also "leave" without a DFU_GETSTATUS request */
+	 * They also "leave" without a DFU_GETSTATUS request. Their DfuSe
+	 * emulation is not known to honour block number offsets, so keep
+	 * setting the address before every block */
 	if (vendor == VENDOR_GIGADEVICE &&
 	    product == PRODUCT_GD32) {
 		quirks |= QUIRK_UTF8_SERIAL;
 		quirks |= QUIRK_DFUSE_LAYOUT;
 		quirks |= QUIRK_DFUSE_LEAVE;
+		quirks |= QUIRK_DFUSE_SET_ADDRESS;
 	}
 
 	return (quirks);
@@ -77,7 +80,7 @@ uint16_t get_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice)
 
 #define GD32VF103_FLASH_BASE 0x08000000
 
-void fixup_dfuse_layout(struct dfu_if *dif, struct memsegment **segment_list)
+void fixup_dfuse_layout(struct dfu_if *dif, struct memlayout *layout)
 {
 	if (dif->vendor == VENDOR_GIGADEVICE &&
 	    dif->product == PRODUCT_GD32 &&
@@ -92,7 +95,7 @@ void fixup_dfuse_layout(struct dfu_if *dif, struct memsegment **segment_list)
 		_PRINTF("Found GD32VF103, which reports a bad page size and "
 		       "count for its internal memory.\n");
 
-		seg = find_segment(*segment_list, GD32VF103_FLASH_BASE);
+		seg = find_segment(layout, GD32VF103_FLASH_BASE);
 		if (!seg) {
 			warnx("Could not fix GD32VF103 layout because there "
 			      "is no segment at 0x%08x", GD32VF103_FLASH_BASE);
@@ -28,11 +28,12 @@
 #define QUIRK_UTF8_SERIAL  (1<<2)
 #define QUIRK_DFUSE_LAYOUT (1<<3)
 #define QUIRK_DFUSE_LEAVE  (1<<4)
+#define QUIRK_DFUSE_SET_ADDRESS (1<<5)
 
 /* Fallback value, works for OpenMoko */
 #define DEFAULT_POLLTIMEOUT  5
 
 uint16_t get_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice);
-void fixup_dfuse_layout(struct dfu_if *dif, struct memsegment **segment_list);
+void fixup_dfuse_layout(struct dfu_if *dif, struct memlayout *layout);
 
 #endif /* DFU_QUIRKS_H */